@@ -1,5 +1,10 @@
 
+#ifndef FRONTEND
 #include "postgres.h"
+#else
+#include "postgres_fe.h"
+#endif
+
 #include "pg_hibernator.h"
 
 /* Returns FILE* on success, doesn't return on error */
@@ -8,9 +13,13 @@ fileOpen(const char *path, const char *mode)
 {
 	FILE *file = fopen(path, mode);
 	if (file == NULL)
+#ifndef FRONTEND
 		ereport(ERROR,
 				(errcode_for_file_access(),
 				 errmsg("could not open \"%s\": %m", path)));
+#else
+		hibernator_error("could not open \"%s\": %m", path);
+#endif
 
 	return file;
 }
@@ -23,10 +32,15 @@ fileClose(FILE *file, const char *path)
 
 	rc = fclose(file);
 	if (rc != 0)
+#ifndef FRONTEND
 		ereport(ERROR,
 				(errcode_for_file_access(),
 				errmsg("encountered error %d while closing file \"%s\": %m",
 						rc, path)));
+#else
+		hibernator_error("encountered error %d while closing file \"%s\": %m",
+						 rc, path);
+#endif
 
 	return true;
 }
@@ -42,13 +56,21 @@ fileRead(void *dest, size_t size, FILE *file, bool eof_ok, const char *path)
 			if (eof_ok)
 				return false;
 			else
+#ifndef FRONTEND
 				ereport(ERROR,
 						(errmsg("found EOF when not expecting one \"%s\"", path)));
+#else
+				hibernator_error("found EOF when not expecting one \"%s\"", path);
+#endif
 		}
 		else
+#ifndef FRONTEND
 			ereport(ERROR,
 					(errcode_for_file_access(),
 					errmsg("error reading \"%s\" : %m", path)));
+#else
+			hibernator_error("error reading \"%s\" : %m", path);
+#endif
 	}
 
 	return true;
@@ -59,9 +81,13 @@ bool
 fileWrite(const void *src, size_t size, FILE *file, const char *path)
 {
 	if (fwrite(src, size, 1, file) != 1)
+#ifndef FRONTEND
 		ereport(ERROR,
 				(errcode_for_file_access(),
 				errmsg("error writing to \"%s\" : %m", path)));
+#else
+		hibernator_error("error writing to \"%s\" : %m", path);
+#endif
 
 	return true;
 }
@@ -78,7 +104,7 @@ readDBName(FILE *file, const char *path)
 	char ch;
 	int char_count;
 
-	for(char_count = 0; char_count <= NAMEDATALEN; ++char_count)
+	for(char_count = 0; char_count < NAMEDATALEN; ++char_count)
 	{
 		fileRead(&ch, 1, file, false, path);
 
@@ -89,8 +115,12 @@ readDBName(FILE *file, const char *path)
 	}
 
 	if (ch != '\0')
+#ifndef FRONTEND
 		ereport(ERROR,
 				(errmsg("error reading database name from \"%s\"", path)));
+#else
+		hibernator_error("error reading database name from \"%s\"", path);
+#endif
 
 	return dbname;
 }
@@ -117,6 +147,29 @@ getSavefileName(int filenum)
 	return ret;
 }
 
+const char*
+getProgressFileName(int filenum)
+{
+	static char ret[MAXPGPATH];
+
+	snprintf(ret, sizeof(ret), "%s/%d.progress", SAVE_LOCATION, filenum);
+
+	return ret;
+}
+
+/* The progress file name format is: <integer>.progress */
+bool
+parseProgressFileName(const char *fname, int *filenum)
+{
+	int		len = 0;
+
+	if (sscanf(fname, "%d.progress%n", filenum, &len) != 1)
+		return false;
+
+	/* Fail if there's anything past the suffix, or if the suffix was cut short. */
+	return len > 0 && fname[len] == '\0';
+}
+
 bool
 parseSavefileName(const char *fname, int *filenum)
 {
@@ -3,6 +3,8 @@
 #if PG_VERSION_NUM >= 90400
 
 #include "pg_hibernator.h"
+#include "pg_hibernator_trace.h"
+#include "savefile.h"
 
 PG_MODULE_MAGIC;
 
@@ -18,45 +20,630 @@ PG_MODULE_MAGIC;
  * databases may be greater than max_worker_processes.
  *
  * The BufferSaver calls processOnePendingWorker() periodically, which in turn
- * waits for any currently running BlockReader to exit, and then registers a new
- * dynamic background worker to run a new BlockReader for the next item on the
- * "pending" list.
+ * registers a new dynamic background worker to run a new BlockReader for the
+ * next item on the "pending" list, unless as many BlockReaders as allowed are
+ * already running.
  *
  * On shutdown request, the BufferSaver scans the shared buffers and saves the
  * list of blocks currently in memory to the $PGDATA/pg_hibernator/ directory;
- * one save-file for each database.
+ * one save-file for each database. With pg_hibernator.save_workers, the scan
+ * is shared with helper workers launched ahead of time; see SaveControl.
  *
  * When launched, the BlockReader reads the save-file assigned to it, connects
  * to the database represented by that save-file, and restores the blocks
  * identified by the list of blocks in save-file.
  *
+ * With pg_hibernator.connectionless_restore, the BlockReader instead reads the
+ * blocks by their RelFileNode, without connecting to the database or looking
+ * up the relations in the catalogs. Since no connection is needed, a single
+ * BlockReader restores all the save-files, one after the other, unless the
+ * databases are to be restored in parallel.
+ *
+ * With pg_hibernator.single_file, the BufferSaver writes one container file,
+ * with a section for each database, instead of one save-file per database; see
+ * savefile.h. The BlockReaders then use their section number the way they'd
+ * otherwise use their save-file number.
+ *
  * Database numbers (and hence save-files with names) 0 and 1 are reserved;
  * In _PG_init() 0 is used to identify and register the BufferSaver, and 1 is
  * reserved in BufferSaver for save-file that contains global objects.
  */
 
-typedef struct SavedBuffer
+/*
+ * A relation a query touched while the restore was in progress. The backends
+ * put these in a queue in shared memory, and the BlockReaders restore the
+ * relations' blocks ahead of their turn; see ServeDemand().
+ */
+typedef struct DemandEntry
+{
+	Oid			database;
+	Oid			tablespace;
+	Oid			filenode;
+} DemandEntry;
+
+/*
+ * The queue is a ring that the backends overwrite as they please. A BlockReader
+ * that falls behind by more than this many entries misses the oldest ones,
+ * which is fine; the relations of the older queries are not the most urgent.
+ */
+#define DEMAND_QUEUE_SIZE	64
+
+/* Where a backend last added a relation to the demand queue; see ReportDemand() */
+typedef struct ReportedEntry
+{
+	Oid			relid;
+	uint64		position;
+} ReportedEntry;
+
+/*
+ * What the DBA asked of the restore of one database; see pg_hibernator_pause()
+ * and friends. The flags that apply to all databases are kept separately, in
+ * SharedState.
+ */
+typedef struct RestoreControl
+{
+	Oid			database;
+	uint32		flags;
+} RestoreControl;
+
+#define CONTROL_PAUSE		0x0001	/* Pause until resumed */
+#define CONTROL_RESUMED		0x0002	/* Resumed, even if all are paused */
+#define CONTROL_CANCEL		0x0004	/* Stop, and keep the rest for later */
+
+/* How many databases can have controls of their own */
+#define MAX_RESTORE_CONTROLS	64
+
+/*
+ * State shared by the BufferSaver, the BlockReaders, and the backends waiting
+ * for the restore to make progress; see pg_hibernator_wait().
+ */
+typedef struct SharedState
+{
+	slock_t		mutex;
+	bool		planned;			/* Have the counts below been set? */
+	int			readers_left;		/* BlockReaders that are yet to exit */
+	uint64		planned_blocks[NUM_PRIORITIES];	/* Blocks to restore */
+	uint64		done_blocks[NUM_PRIORITIES];	/* Restored, or found to be gone */
+	bool		accounting;			/* Are restored buffers being tracked? */
+	LWLock	   *stats_lock;			/* Protects relation_stats */
+	uint64		gap_blocks;			/* Read along to bridge gaps; see savefile.h */
+	uint64		demand_head;		/* Number of entries ever added to demand */
+	DemandEntry	demand[DEMAND_QUEUE_SIZE];
+	TimestampTz	restore_started;	/* When the counts above were set */
+	uint64		read_blocks;		/* Read from disk by the BlockReaders */
+	int			readers_paused;		/* BlockReaders waiting in WaitWhilePaused() */
+	bool		all_paused;			/* Are all the BlockReaders left paused? */
+	TimestampTz	all_paused_since;	/* If so, since when */
+	double		paused_seconds;		/* All paused for this long before that */
+	int			max_readers;		/* BlockReaders to run at once; 0 for the default */
+	uint32		control_flags;		/* Controls that apply to all databases */
+	int			ncontrols;
+	RestoreControl controls[MAX_RESTORE_CONTROLS];
+} SharedState;
+
+/*
+ * Restore-efficacy accounting: were the blocks we restored used by anyone
+ * before the clock sweep evicted them?
+ *
+ * The BlockReaders mark each buffer they load from disk in restore_map, which
+ * has a byte per shared buffer, and count the blocks they load of each relation
+ * in relation_stats. The mark is one more than the usage count the BlockReader
+ * left the buffer with; alongside it, restore_tags keeps the BufTableHashCode()
+ * of the block loaded. The BufferSaver samples the marked buffers: a buffer
+ * whose usage count has gone above its mark has been used; one that has been
+ * evicted, or reused for any other block, never will be. Either way, its mark
+ * is cleared. The buffers still marked when the observation window closes were
+ * never used. A reused buffer whose new block happens to hash the same is taken
+ * for the block restored; that's rare enough not to skew the counts.
+ *
+ * The entries of a buffer are written and settled only under its header
+ * spinlock. The map is there only if pg_hibernator.efficacy_window was set at
+ * server start, and is sampled a chunk of buffers at a time, so as not to hold
+ * up the BlockReaders counting their blocks for long.
+ */
+typedef struct RelationStats
+{
+	RelFileNode	rnode;			/* Hash key; must be first */
+	uint64		restored;		/* Blocks loaded by the BlockReaders */
+	uint64		used;			/* ... and used before being evicted */
+} RelationStats;
+
+/* restore_map entry of an unmarked buffer */
+#define RESTORE_MAP_NONE	0
+
+/* Buffers SampleRestoredBuffers() looks at per acquisition of stats_lock */
+#define SAMPLE_CHUNK_BUFFERS	16384
+
+/*
+ * The restore efficacy of each relation over the past restores, kept across
+ * restarts in HISTORY_PATH: a header, followed by the entries in no particular
+ * order. The BufferSaver updates it when it's done watching the restored
+ * blocks. Relations whose restored blocks keep going unused are restored after
+ * all the others, and once that's been the case for a few restores, not at all.
+ */
+typedef struct RestoreHistoryHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		generation;		/* Number of restores accounted for */
+	uint32		nentries;
+} RestoreHistoryHeader;
+
+typedef struct RestoreHistory
+{
+	RelFileNode	rnode;			/* Hash key; must be first */
+	uint32		observations;	/* Restores the relation was accounted in */
+	uint32		generation;		/* ... the last of which */
+	double		used_fraction;	/* Moving average of the fraction used */
+} RestoreHistory;
+
+#define HISTORY_MAGIC		0x52484750	/* "PGHR" */
+#define HISTORY_VERSION		1
+
+/* A relation with fewer restored blocks than this tells us too little. */
+#define HISTORY_MIN_BLOCKS			16
+/* Restores a relation must have gone unused in before it's skipped */
+#define HISTORY_MIN_OBSERVATIONS	3
+/*
+ * Restores after which a relation that hasn't been accounted in since is
+ * forgotten. This gives the skipped relations another chance.
+ */
+#define HISTORY_MAX_AGE				8
+
+/*
+ * The restore throughput measured during the last restore, kept across
+ * restarts in THROUGHPUT_PATH, for planning the next restore to fit in
+ * pg_hibernator.restore_deadline; see PlanToDeadline().
+ */
+typedef struct RestoreThroughput
+{
+	uint32		magic;
+	uint32		version;
+	double		blocks_per_second;
+} RestoreThroughput;
+
+#define THROUGHPUT_MAGIC	0x54484750	/* "PGHT" */
+#define THROUGHPUT_VERSION	1
+
+/* How far a restore must have got before its throughput tells us anything */
+#define THROUGHPUT_MIN_SECONDS	10
+#define THROUGHPUT_MIN_BLOCKS	1000
+
+/*
+ * Between the shutdown saves, the BufferSaver takes a snapshot of the shared
+ * buffers every pg_hibernator.snapshot_interval, so that a crash doesn't cost
+ * the next restore its list of blocks. It remembers which block each buffer
+ * held at the last snapshot; the first snapshot is written out in full, as the
+ * save-files of a base, and each one after that only appends to JOURNAL_PATH
+ * the blocks that came into and went out of the buffers since. A snapshot ends
+ * with a commit entry, and one that didn't get that far is ignored.
+ *
+ * Once the journal has as many entries as the base has blocks, the next
+ * snapshot is written out in full as a new base, and the journal starts over.
+ * At startup, the journal is replayed over the base into a new set of
+ * save-files, before they're restored. The shutdown save removes the journal.
+ */
+typedef struct JournalHeader
+{
+	uint32		magic;
+	uint32		version;
+} JournalHeader;
+
+typedef struct JournalEntry
+{
+	uint32		op;				/* One of the JOURNAL_* below */
+	SavedBuffer	buf;			/* Not used by JOURNAL_COMMIT */
+} JournalEntry;
+
+#define JOURNAL_MAGIC		0x4A484750	/* "PGHJ" */
+#define JOURNAL_VERSION		1
+
+#define JOURNAL_ADD			1	/* A buffer came to hold the block */
+#define JOURNAL_REMOVE		2	/* A buffer no longer holds the block */
+#define JOURNAL_COMMIT		3	/* End of a snapshot */
+
+/* The journal may grow to at least this many entries before a new base */
+#define JOURNAL_MIN_ENTRIES	1024
+
+/*
+ * A block of the list being replayed. A block may move from one buffer to
+ * another between snapshots, and the journal lists the buffers in their order,
+ * not the moves'; so we count the buffers holding each block, rather than
+ * apply the entries in order.
+ */
+typedef struct ReplayedBlock
+{
+	BufferTag	tag;			/* Hash key; must be first */
+	int32		count;			/* Buffers holding the block */
+	uint32		priority;
+	uint8		usage;
+} ReplayedBlock;
+
+/*
+ * The planner ranks blocks by their value for the time it takes to read them.
+ * The value of a block is the weight of its priority, times one plus its usage
+ * count. Reading a block costs a random read, or much less if it's in a run of
+ * blocks, which the BlockReaders read ahead as a whole; runs are grouped by
+ * length in powers of two.
+ */
+#define PLAN_RUN_LEVELS			8		/* Runs of 1, 2-3, 4-7, ... 128 or more */
+#define PLAN_USAGE_LEVELS		(BM_MAX_USAGE_COUNT + 1)
+#define PLAN_CLASSES			(NUM_PRIORITIES * PLAN_USAGE_LEVELS * PLAN_RUN_LEVELS)
+#define PLAN_SEQUENTIAL_COST	0.1		/* Of reading a block in a long run */
+
+static const double planWeights[NUM_PRIORITIES] = {8.0, 4.0, 1.0, 0.0};
+
+/*
+ * A BlockReader's means of restoring relations on demand; see ServeDemand().
+ * It has a handle on the save-file of its own, and an index of where each
+ * relation is listed in it, one entry for each priority the relation has
+ * blocks of.
+ */
+typedef struct SavedRelationKey
+{
+	Oid			tablespace;
+	Oid			filenode;
+} SavedRelationKey;
+
+typedef struct SavedRelation
+{
+	SavedRelationKey key;		/* Hash key; must be first */
+	int			nmarks;
+	SavefileProgress marks[NUM_PRIORITIES];	/* Where the relation's 'r' records are */
+} SavedRelation;
+
+typedef struct DemandState
+{
+	uint64		cursor;			/* Next entry of the demand queue to look at */
+	FILE	   *file;
+	SavefileReader reader;
+	HTAB	   *relations;		/* SavedRelation entries; built when first needed */
+	HTAB	   *served;			/* Positions of the relations already restored */
+} DemandState;
+
+/*
+ * A row of pg_hibernator_plan(): a fork of a relation listed in the save-files;
+ * see PlanBlock().
+ */
+typedef struct PlanRelationKey
 {
 	Oid			database;
-	Oid			filenode;	/* On-disk marker: 'r', for Relfilenode */
-	ForkNumber	forknum;	/* On-disk marker: 'f' */
-	BlockNumber	blocknum;	/* On-disk marker: 'b' */
-							/* On-disk marker: 'N', for range of N blocks */
-} SavedBuffer;
+	Oid			tablespace;
+	Oid			filenode;
+	ForkNumber	forknum;
+} PlanRelationKey;
+
+typedef struct PlanRelation
+{
+	PlanRelationKey key;		/* Hash key; must be first */
+	BlockNumber	nblocks;		/* Current size of the fork, if known */
+	BlockNumber	last;			/* Last valid block counted, if any */
+	uint64		listed;			/* Blocks yet to be restored */
+	uint64		valid;			/* ... within the current size of the fork */
+	uint64		runs;			/* Runs of consecutive valid blocks */
+} PlanRelation;
+
+typedef struct PlanState
+{
+	HTAB	   *relations;		/* PlanRelation entries */
+	PlanRelation *current;		/* Fork of the last block counted */
+} PlanState;
+
+/* A BlockReader's view of the current span of blocks; see savefile.h. */
+typedef struct SpanState
+{
+	BlockNumber	end;			/* Last block of the span, or InvalidBlockNumber */
+	BlockNumber	listed;			/* Last block in the span that's listed */
+} SpanState;
+
+/*
+ * What a BlockReader keeps track of while going through a save-file; see
+ * ReadBlocks(), and ReadRelationRecord() and friends for the records it reads.
+ */
+typedef struct ReaderState
+{
+	int			filenum;
+	bool		connectionless;
+	const char *dbname;
+	const char *filepath;
+	SavefileReader reader;
+	SavefileProgress progress;	/* How far we got; see WriteProgress() */
+	SavefileProgress mark;		/* Where the current relation is listed */
+	bool		retrying;		/* Going back for the relations found locked? */
+	SavefileProgress retry_mark;	/* ... if so, the one we're at */
+	List	   *deferred;		/* Relations found locked; see OpenRelation() */
+
+	Relation	rel;			/* The current relation, if we have it open */
+	SMgrRelation smgr;
+	RelFileNode	rnode;
+	bool		skip_relation;
+	bool		skip_fork;
+	bool		skip_block;
+	bool		served;			/* Was the relation restored on demand? */
+	BlockNumber	nblocks;		/* Current size of the fork */
+	ForkNumber	done_forknum;	/* Last block of the relation restored */
+	BlockNumber	done_blocknum;
+	SpanState	span;
+
+	BlockNumber	blocks_restored;
+	uint64		blocks_loaded;	/* ... of the current relation, from disk */
+	BlockNumber	blocks_locked;	/* Restored since we took the relation's lock */
+	BlockNumber	gap_blocks;
+	int			since_checkpoint;
+	int			relations_in_xact;
+	bool		past_deadline;
+	DemandState	demand;
+
+	MemoryContext caller_context;
+	MemoryContext relation_context;
+	MemoryContext oldcontext;
+} ReaderState;
+
+/*
+ * Runs of restored blocks of one segment file, whose copies in the OS cache are
+ * yet to be dropped; see pg_hibernator.drop_os_cache.
+ */
+#define DROP_BATCH_RUNS		64
+#define DROP_BATCH_BLOCKS	4096	/* 32 MB with 8 kB blocks */
+
+typedef struct DropBatch
+{
+	RelFileNode	rnode;
+	ForkNumber	forknum;
+	BlockNumber	segno;
+	int			nruns;
+	BlockNumber	nblocks;
+	BlockNumber	start[DROP_BATCH_RUNS];
+	BlockNumber	count[DROP_BATCH_RUNS];
+} DropBatch;
+
+/*
+ * A save-file waiting for a BlockReader, or being restored by one; see
+ * processOnePendingWorker().
+ */
+typedef struct ReaderLane
+{
+	int			filenum;
+	Oid			tablespace;		/* Of the save-file's first relation */
+	int			dbclass;		/* Priority class of the save-file's database */
+	BackgroundWorkerHandle *handle;	/* NULL until launched */
+} ReaderLane;
+
+/*
+ * Priority classes of databases; see pg_hibernator.high_priority_databases.
+ * The BlockReaders are launched for the classes in proportion to their weights,
+ * so that every class makes some progress; within a class, in the order the
+ * save-files were found.
+ */
+#define DATABASE_CLASS_HIGH		0
+#define DATABASE_CLASS_NORMAL	1
+#define DATABASE_CLASS_LOW		2
+#define NUM_DATABASE_CLASSES	3
+
+static const int databaseClassWeights[NUM_DATABASE_CLASSES] = {4, 2, 1};
+
+/*
+ * Helpers that share the scan and the sort of the shutdown save with the
+ * BufferSaver; see pg_hibernator.save_workers. Background workers can't be
+ * launched once the shutdown has begun, so the BufferSaver launches them when
+ * the restore is done, and they wait, attached to its control segment, whose
+ * handle they get as their bgw_main_arg; each takes the first free slot in it.
+ *
+ * They get a SIGTERM along with the BufferSaver at shutdown. It then creates a
+ * segment with room for a SavedBuffer per shared buffer, and assigns each
+ * helper a slice of the shared buffers, keeping the last for itself. Each of
+ * them saves the buffers of its slice at the start of the slice's part of the
+ * segment, and sorts them there; the BufferSaver then merges the sorted runs.
+ * The slice of a helper that exits without having done it is done by the
+ * BufferSaver.
+ *
+ * Should the BufferSaver exit before the save, say on an error, and be
+ * restarted, the helpers it launched would keep its segment and their worker
+ * slots forever; so they keep an eye on it, and exit once its process is gone
+ * or its PGPROC belongs to another one.
+ */
+#define MAX_SAVE_HELPERS		64
+
+#define SAVE_HELPER_IDLE		0	/* Not attached yet */
+#define SAVE_HELPER_READY		1	/* Waiting for the save */
+#define SAVE_HELPER_ASSIGNED	2	/* Saving its slice */
+#define SAVE_HELPER_DONE		3	/* Its slice is saved and sorted */
+
+typedef struct SaveHelper
+{
+	PGPROC	   *proc;
+	int			pid;			/* Of the helper that took this slot */
+	int			state;			/* One of the SAVE_HELPER_* above */
+	int			first;			/* First buffer of the slice */
+	int			end;			/* ... and the one after its last */
+	int			num_buffers;	/* Buffers saved of the slice */
+} SaveHelper;
+
+typedef struct SaveControl
+{
+	slock_t		mutex;
+	PGPROC	   *leader;			/* The BufferSaver */
+	int			leader_pid;		/* ... and its PID */
+	bool		aborted;		/* There will be no save to help with */
+	dsm_handle	buffers;		/* Segment of the saved buffers, once assigned */
+	bool		lanes;			/* Sort by SavedBufferLaneCmp()? */
+	SaveHelper	helpers[MAX_SAVE_HELPERS];
+} SaveControl;
+
+/* State of the merge of the sorted runs; see ParallelScanBuffers(). */
+typedef struct SaveMerge
+{
+	SavedBuffer *slices;
+	bool		lanes;
+	int			pos[MAX_SAVE_HELPERS + 1];	/* Next buffer of each run */
+	int			end[MAX_SAVE_HELPERS + 1];	/* ... and the end of the run */
+} SaveMerge;
+
+/* First buffer of the given slice, of the given number of slices */
+#define SliceStart(slice, nslices)	((int) ((int64) NBuffers * (slice) / (nslices)))
+
+/* How long a helper waits for the BufferSaver once the shutdown has begun */
+#define SAVE_HELPER_TIMEOUT		(60 * 1000)	/* milliseconds */
+
+/*
+ * With pg_hibernator.slru_caches, the shutdown save also lists the pages that
+ * are resident in the SLRU caches that visibility checks go to, in SLRU_PATH;
+ * and before the BlockReaders are launched, the BufferSaver reads those pages
+ * from their segment files, so that the checks on the restored blocks find
+ * them in the OS cache.
+ *
+ * The caches' control structures are private to the backend code, so we find
+ * their shared state by name, the way the backend creates it; see
+ * LookupSlru(). For the same reason the pages can't be read into the caches
+ * themselves.
+ *
+ * pg_subtrans is left out; StartupSUBTRANS() zeroes its pages at every
+ * startup, rather than reading them.
+ */
+#define SLRU_CLOG				0
+#define SLRU_MULTIXACT_OFFSETS	1
+#define SLRU_MULTIXACT_MEMBERS	2
+#define NUM_SLRUS				3
+
+typedef struct SlruCache
+{
+	const char *name;			/* Name of its shared state in the ShmemIndex */
+	const char *dir;			/* Directory of its segment files */
+} SlruCache;
+
+static const SlruCache slruCaches[NUM_SLRUS] = {
+	{"CLOG Ctl", "pg_clog"},
+	{"MultiXactOffset Ctl", "pg_multixact/offsets"},
+	{"MultiXactMember Ctl", "pg_multixact/members"}
+};
+
+typedef struct SlruPagesHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		npages;			/* Number of SlruPage entries that follow */
+} SlruPagesHeader;
+
+typedef struct SlruPage
+{
+	uint32		slru;			/* One of the SLRU_* above */
+	int			pageno;
+} SlruPage;
+
+#define SLRU_PAGES_MAGIC	0x53484750	/* "PGHS" */
+#define SLRU_PAGES_VERSION	2
+
+/* How many records a BlockReader goes through between looks at the demand */
+#define DEMAND_CHECK_INTERVAL	64
+
+/*
+ * How many records a connectionless BlockReader goes through between looks at
+ * its controls. One that connects looks only between relations, and whenever
+ * it lets go of a relation's lock, since it mustn't pause while holding one.
+ */
+#define CONTROL_CHECK_INTERVAL	64
+
+static SharedState *shared_state = NULL;
+static uint8 *restore_map = NULL;
+static uint32 *restore_tags = NULL;
+static HTAB *relation_stats = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static ExecutorStart_hook_type prev_ExecutorStart = NULL;
 
 /* Primary functions */
 void			_PG_init(void);
+static void		SharedStateSetup(void);
+static void		shmem_startup(void);
 static void		DefineGUCs(void);
+static Size		RestoreMapSize(void);
 static void		CreateDirectory(void);
 
+Datum			pg_hibernator_wait(PG_FUNCTION_ARGS);
+Datum			pg_hibernator_restore_stats(PG_FUNCTION_ARGS);
+Datum			pg_hibernator_progress(PG_FUNCTION_ARGS);
+Datum			pg_hibernator_pause(PG_FUNCTION_ARGS);
+Datum			pg_hibernator_resume(PG_FUNCTION_ARGS);
+Datum			pg_hibernator_cancel(PG_FUNCTION_ARGS);
+Datum			pg_hibernator_set_max_readers(PG_FUNCTION_ARGS);
+Datum			pg_hibernator_plan(PG_FUNCTION_ARGS);
+
 static void		RegisterBlockReaders(void);
+static List	   *ListSavefiles(int elevel);
 static bool		RegisterWorker(int id, BackgroundWorkerHandle **handle);
 
 static void		BlockReaderMain(Datum main_arg);
-static void		ReadBlocks(int filenum);
+static void		ReadBlocks(int filenum, bool connectionless, int priority);
+static void		ReadRelationRecord(ReaderState *rs, const SavefileRecord *record);
+static bool		OpenRestoredRelation(ReaderState *rs, const SavefileRecord *record);
+static bool		RelockRestoredRelation(ReaderState *rs, ForkNumber forknum);
+static void		CloseRestoredRelation(ReaderState *rs);
+static void		ReadForkRecord(ReaderState *rs, const SavefileRecord *record);
+static void		ReadBlockRecord(ReaderState *rs, const SavefileRecord *record);
+static void		ReadRangeRecord(ReaderState *rs, const SavefileRecord *record);
+static void		ReadSpanRecord(ReaderState *rs, const SavefileRecord *record);
+static void		RestoreListedBlock(ReaderState *rs, ForkNumber forknum,
+								   BlockNumber blocknum, uint8 usage);
+static FILE	   *OpenSavefile(int filenum, bool missing_ok, SavefileReader *reader,
+							 char **dbname, bool *in_container, SavefileSection *section);
+static bool		ReadProgress(int filenum, SavefileProgress *progress);
+static void		WriteProgress(int filenum, const SavefileProgress *progress);
+static void		RemoveProgress(int filenum);
+static bool		RestoreBlock(Relation rel, RelFileNode rnode, ForkNumber forknum,
+							 BlockNumber blocknum, uint8 saved_usage);
+static void		DropFromOSCache(RelFileNode rnode, ForkNumber forknum,
+								BlockNumber blocknum);
+static void		FlushDropBatch(void);
+static void		StartSpan(SpanState *span, SMgrRelation smgr, ForkNumber forknum,
+						  BlockNumber first, BlockNumber count, BlockNumber nblocks);
+static BlockNumber SpanGap(SpanState *span, BlockNumber first, BlockNumber last);
+
+static void		hibernator_ExecutorStart(QueryDesc *queryDesc, int eflags);
+static void		ReportDemand(Relation rel);
+static void		ServeDemand(DemandState *demand, int filenum, bool connectionless,
+							const char *dbname, Oid database, off_t position,
+							int priority);
+static void		IndexSavefile(DemandState *demand, int filenum);
+static bool		ServeRelation(DemandState *demand, int filenum, bool connectionless,
+							  const char *dbname, const SavefileProgress *mark);
+static bool		DemandServed(DemandState *demand, uint64 position);
+static void		EndDemand(DemandState *demand);
 
 static void		BufferSaverMain(Datum main_arg);
 static void		SaveBuffers(void);
+static int		ScanBuffers(SavedBuffer *saved_buffers, int first, int end);
+static int		SaveSlice(SavedBuffer *slices, int first, int end, bool lanes);
+static int		ParallelScanBuffers(SavedBuffer *saved_buffers);
+static int		SaveMergeCmp(Datum a, Datum b, void *arg);
+static void		LaunchSaveHelpers(void);
+static void		EndSaveHelpers(void);
+static void		SaveHelperMain(Datum main_arg);
+static bool		LeaderAlive(SaveControl *control);
+static bool		SaveHelperRunning(int pid);
+static int		WriteSave(SavedBuffer *saved_buffers, int num_buffers, bool sorted);
+static SlruShared LookupSlru(int slru);
+static void		SaveSlruPages(void);
+static void		PrefetchSlruPages(void);
+static int		SlruPageCmp(const void *a, const void *b);
+static void		TakeSnapshot(void);
+static void		AppendJournal(uint32 op, const SavedBuffer *buf);
+static void		RemoveJournal(void);
+static void		ReplayBlock(HTAB *blocks, const SavedBuffer *buf, int delta);
+static void		ReplayJournal(void);
+static uint32	ClassifyBuffer(volatile BufferDesc *bufHdr);
+static int		RemoveDroppedDatabases(SavedBuffer *saved_buffers, int num_buffers);
+static bool		DatabaseDirectoryExists(Oid database, Oid tablespace);
+static int		AddUnrestoredBlocks(SavedBuffer *saved_buffers, int num_buffers,
+									int max_buffers, bool *sorted);
+
+typedef bool (*UnrestoredBlockCallback) (const SavefileRecord *record,
+										 BlockNumber blocknum, void *arg);
+static bool		ForEachUnrestoredBlock(int filenum, UnrestoredBlockCallback callback,
+									   void *arg);
+static int		SavefileLength(const SavedBuffer *saved_buffers, int first, int num_buffers);
+static void		WriteSavefiles(SavedBuffer *saved_buffers, int num_buffers);
+static void		WriteContainer(SavedBuffer *saved_buffers, int num_buffers);
+static void		RemoveSavefiles(void);
+static void		SyncFile(FILE *file, const char *path);
 
 /* Secondary/supporting functions */
 static void		sigtermHandler(SIGNAL_ARGS);
@@ -64,13 +651,132 @@ static void		sighupHandler(SIGNAL_ARGS);
 
 static void		addPendingWorker(int filenum);
 static void		processOnePendingWorker(void);
+static void		WaitForBlockReaders(void);
+static Oid		SavefileTablespace(int filenum, char **dbname);
+static int		DatabaseClass(const char *dbname);
+static int		SavefileClassCmp(const void *a, const void *b);
 
 static void		WorkerCommon(void);
-static int		SavedBufferCmp(const void *a, const void *b);
-static Oid		GetRelOid(Oid filenode);
+static void		PlanRestore(List *savefiles, int num_readers);
+static void		ReportBlocksDone(uint32 priority, uint64 nblocks);
+static void		UpdateAllPaused(TimestampTz now);
+static void		ReportPaused(bool paused);
+static void		ReportGapBlocks(uint64 nblocks);
+static void		BlockReaderExit(int code, Datum arg);
+static double	RestoredFraction(bool hottest_tier);
+static void		UpdateReadyFile(bool ready);
+static bool		RestoreCancelled(void);
+static bool		RestoreFinished(void);
+static void		CountRestoredBlocks(RelFileNode rnode, uint64 nblocks);
+static int		SampleRestoredBuffers(bool final);
+static void		ReportRestoreEfficacy(void);
+static HTAB	   *LoadRestoreHistory(uint32 *generation);
+static void		UpdateRestoreHistory(void);
+static bool		MostlyUnused(HTAB *history, RelFileNode rnode, bool chronically);
+static void		DownrankUnusedRelations(SavedBuffer *saved_buffers, int num_buffers);
+static bool		PlanToDeadline(SavedBuffer *saved_buffers, int num_buffers);
+static int		PlanClass(const SavedBuffer *buf, int runlen);
+static int		PlanClassCmp(const void *a, const void *b);
+static void		LoadRestoreThroughput(void);
+static void		SaveRestoreThroughput(void);
+static void		MeasureRestoreThroughput(void);
+static bool		DeadlinePassed(void);
+static List	   *ParseRelationList(char *value, const char *name);
+static bool		RelationListed(List *names, const char *dbname, Relation rel);
+static bool		SkipRelation(RelFileNode rnode, Relation rel, const char *dbname);
+static BlockNumber CountBlocksToRestore(ForkNumber done_forknum, BlockNumber done_blocknum,
+										ForkNumber forknum, BlockNumber first,
+										BlockNumber count);
+static bool		ContainerExists(void);
+static void		RefreshDatabaseMap(void);
+static char	   *GetDatabaseName(Oid database);
+static Oid		GetRelOid(Oid tablespace, Oid filenode);
+static Relation	OpenRelation(Oid relOid, Oid filenode, bool *busy);
+static uint32	RestoreControlFlags(Oid database);
+static bool		WaitWhilePaused(int filenum, Oid database);
+static void		SetRestoreControl(FunctionCallInfo fcinfo, uint32 set_flags,
+								  uint32 clear_flags);
+static Relation	RelockRelation(Relation rel, ForkNumber forknum, SMgrRelation *smgr,
+							   BlockNumber *nblocks, bool *busy);
+static void		DeferRelation(List **deferred, MemoryContext context,
+							  const SavefileProgress *mark,
+							  ForkNumber done_forknum, BlockNumber done_blocknum);
+static bool		NextDeferredRelation(int filenum, List **deferred, List **retries,
+									 int *round, SavefileProgress *mark);
+
+/*
+ * BlockReader id that stands for all the save-files, rather than one save-file;
+ * used only for connectionless restores.
+ */
+#define ALL_SAVEFILES	(-1)
+
+/*
+ * Flag added to the id of a BlockReader for one save-file, in its bgw_main_arg,
+ * to fix its mode in case pg_hibernator.connectionless_restore changes before
+ * it's launched. A BlockReader for ALL_SAVEFILES is always connectionless.
+ */
+#define READER_CONNECTIONLESS	0x40000000
+
+/* ReadBlocks() priority that stands for all the priorities */
+#define ALL_PRIORITIES	(-1)
+
+/* How many blocks a BlockReader restores between checkpoints of its progress */
+#define PROGRESS_CHECKPOINT_BLOCKS	1024
+
+/*
+ * How many blocks of a relation a BlockReader restores before letting go of its
+ * lock for a moment, and how many relations it restores per transaction.
+ */
+#define LOCK_BATCH_BLOCKS			1024
+#define RELATIONS_PER_TRANSACTION	256
+
+/* How many times a BlockReader goes back for the relations it found locked */
+#define DEFERRAL_ROUNDS				5
+
+/*
+ * Has the block already been restored, according to the progress made before
+ * a restart? Blocks of a relation are listed in fork and block order.
+ */
+#define BlockAlreadyRestored(done_forknum, done_blocknum, forknum, blocknum)	\
+	((done_blocknum) != InvalidBlockNumber									\
+	 && ((forknum) < (done_forknum)											\
+		 || ((forknum) == (done_forknum) && (blocknum) <= (done_blocknum))))
+
+/*
+ * The BufferSaver's map of database OIDs to names, so that it doesn't have to
+ * look the names up in the catalog during shutdown.
+ */
+typedef struct DatabaseMapEntry
+{
+	Oid			database;		/* Hash key; must be first */
+	NameData	dbname;
+} DatabaseMapEntry;
+
+/* How often the BufferSaver refreshes its map of database names */
+#define DATABASE_MAP_REFRESH_INTERVAL	(60 * 1000)	/* milliseconds */
 
 /* Global variables */
 static List *pendingWorkers = NIL;	/* Used by BufferSaver */
+static List *launchedWorkers = NIL;	/* Used by BufferSaver; ReaderLanes of the BlockReaders not known to have exited */
+static HTAB *databaseMap = NULL;	/* Used by BufferSaver */
+static TimestampTz databaseMapRefreshed = 0;
+static HTAB *restoreHistory = NULL;		/* Used by BlockReader */
+static List *includeRelations = NIL;	/* Used by BlockReader */
+static List *excludeRelations = NIL;	/* Used by BlockReader */
+static bool restoreCancelled = false;	/* Used by BlockReader */
+static DropBatch dropBatch;				/* Used by BlockReader */
+static double restoreThroughput = 0;	/* Used by BufferSaver; blocks/s, 0 if unknown */
+static bool throughputMeasured = false;	/* Used by BufferSaver */
+static uint64 blocksRead = 0;			/* Used by BlockReaders; not yet reported */
+static SavedBuffer *snapshotBuffers = NULL;	/* Used by BufferSaver; see JournalEntry */
+static FILE *journalFile = NULL;		/* Used by BufferSaver */
+static uint64 journalEntries = 0;		/* Used by BufferSaver */
+static uint64 baseBlocks = 0;			/* Used by BufferSaver */
+static TimestampTz lastSnapshot = 0;	/* Used by BufferSaver */
+static dsm_segment *saveControlSegment = NULL;	/* Used by BufferSaver; see SaveControl */
+static BackgroundWorkerHandle *saveHelpers[MAX_SAVE_HELPERS];	/* Used by BufferSaver */
+static int numSaveHelpers = 0;			/* Used by BufferSaver */
+static ResourceOwner saveResourceOwner = NULL;	/* Used by BufferSaver */
 
 /* flags set by signal handlers */
 static volatile sig_atomic_t got_sighup = false;
@@ -80,6 +786,29 @@ static volatile sig_atomic_t got_sigterm = false;
 static bool		guc_enabled = true;					/* Is the extension enabled? */
 static bool		guc_parallel_enabled = false;		/* Can we restore databases in parallel? */
 static char*	guc_default_database = "postgres";	/* Default DB to connect to. */
+static bool		guc_connectionless = false;			/* Restore blocks without relcache? */
+static bool		guc_single_file = false;			/* Save all databases in one container? */
+static double	guc_ready_fraction = 1.0;			/* Fraction of blocks that makes us ready */
+static bool		guc_ready_hottest_tier = false;		/* ... of the hottest tier, instead of all? */
+static int		guc_efficacy_window = 600;			/* Seconds to watch restored blocks for use */
+static int		guc_efficacy_relations = 10000;		/* Relations to keep restore statistics of */
+static double	guc_unused_fraction = 0.05;			/* Used fraction below which relations are unused */
+static char*	guc_include_relations = "";			/* Relations to restore, whatever their history */
+static char*	guc_exclude_relations = "";			/* Relations never to restore */
+static bool		guc_query_driven = true;			/* Restore what queries touch first? */
+static int		guc_max_gap = 8;					/* Longest gap a span may bridge, in blocks */
+static int		guc_usage_count_cap = 3;			/* Highest usage count to give back */
+static double	guc_usage_count_scale = 1.0;		/* Scale the saved usage counts by this */
+static bool		guc_tablespace_lanes = false;		/* One save-file per database and tablespace? */
+static int		guc_lane_readers = 0;				/* BlockReaders per tablespace; 0 for no limit */
+static bool		guc_drop_os_cache = false;			/* Drop the OS cache's copies of restored blocks? */
+static int		guc_restore_deadline = 0;			/* Seconds the restore should fit in; 0 for none */
+static int		guc_snapshot_interval = 0;			/* Seconds between snapshots; 0 for none */
+static int		guc_plan_throughput = 0;			/* Blocks/s to estimate restores at; 0 for measured */
+static char*	guc_high_priority_databases = "";	/* Databases to restore ahead of the others */
+static char*	guc_low_priority_databases = "";	/* Databases to restore behind the others */
+static int		guc_save_workers = 0;				/* Helpers to share the shutdown save with */
+static bool		guc_slru_caches = false;			/* Save and prefetch the SLRU pages too? */
 
 /*
  * Signal handler for SIGTERM
@@ -129,7 +858,9 @@ sigusr1Handler(SIGNAL_ARGS)
 void
 _PG_init(void)
 {
+	/* The size of our shared memory depends on the parameters. */
 	DefineGUCs();
+	SharedStateSetup();
 	CreateDirectory();
 	/*
 	 * Create the BufferSaver irrespective of whether the extension is enabled.
@@ -149,6 +880,87 @@ _PG_init(void)
 	 */
 }
 
+static void
+SharedStateSetup(void)
+{
+	/* We can only ask for shared memory while being preloaded. */
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(SharedState))
+						   + (guc_efficacy_window > 0 ? RestoreMapSize() : 0)
+						   + hash_estimate_size(guc_efficacy_relations,
+												sizeof(RelationStats)));
+	RequestAddinLWLocks(1);
+
+	/* Register our hook for Shared Memory initialization */
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = shmem_startup;
+
+	/* ... and the one that tells the BlockReaders what queries need */
+	prev_ExecutorStart = ExecutorStart_hook;
+	ExecutorStart_hook = hibernator_ExecutorStart;
+}
+
+/* Size of restore_tags and restore_map, which are allocated together */
+static Size
+RestoreMapSize(void)
+{
+	return MAXALIGN(NBuffers * (sizeof(uint32) + sizeof(uint8)));
+}
+
+static void
+shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	/* reset in case this is a restart within the postmaster */
+	shared_state = NULL;
+	restore_map = NULL;
+	restore_tags = NULL;
+	relation_stats = NULL;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	shared_state = ShmemInitStruct("pg_hibernator",
+								   sizeof(SharedState),
+								   &found);
+	if (!found)
+	{
+		/* First time through */
+		MemSet(shared_state, 0, sizeof(SharedState));
+		SpinLockInit(&shared_state->mutex);
+		shared_state->stats_lock = LWLockAssign();
+	}
+
+	/* The tags go first, for their alignment. */
+	if (guc_efficacy_window > 0)
+	{
+		restore_tags = (uint32 *) ShmemInitStruct("pg_hibernator restore map",
+												  RestoreMapSize(),
+												  &found);
+		restore_map = (uint8 *) (restore_tags + NBuffers);
+		if (!found)
+			MemSet(restore_tags, 0, RestoreMapSize());
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize	= sizeof(RelFileNode);
+	info.entrysize	= sizeof(RelationStats);
+	info.hash		= tag_hash;
+
+	relation_stats = ShmemInitHash("pg_hibernator relation stats",
+								   guc_efficacy_relations,
+								   guc_efficacy_relations,
+								   &info,
+								   HASH_ELEM | HASH_FUNCTION);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
 /* Declare the parameters */
 static void
 DefineGUCs(void)
@@ -177,7 +989,7 @@ DefineGUCs(void)
 
 	DefineCustomStringVariable("pg_hibernator.default_database",
 							"Database to connect to, by default.",
-							"Postgres Hibernator will connect to this database when saving buffers, and when reading blocks of global objects.",
+							"Postgres Hibernator will connect to this database when reading blocks of global objects.",
 							&guc_default_database,
 							guc_default_database,
 							PGC_POSTMASTER,
@@ -185,841 +997,6171 @@ DefineGUCs(void)
 							NULL,
 							NULL,
 							NULL);
-}
 
-/*
- * Create the directory to save files in, if it doesn't already exist.
- */
-static void
-CreateDirectory(void)
-{
-	struct stat		st;
-	const char	   *hibernate_dir = SAVE_LOCATION;
+	DefineCustomBoolVariable("pg_hibernator.single_file",
+							"Save the blocks of all databases in a single file.",
+							NULL,
+							&guc_single_file,
+							guc_single_file,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
 
-	if (stat(hibernate_dir, &st) == 0)
-	{
-		/* Is it not a directory? */
-		if (!S_ISDIR(st.st_mode))
-			ereport(ERROR,
-					(errmsg("\"%s\" exists but is not a directory, hence disabling hibernation",
-							hibernate_dir)));
-	}
-	else
-	{
-		/* Directory does not exist? */
-		if (errno == ENOENT)
-		{
-			/* Create directory */
-			if (mkdir(hibernate_dir, S_IRWXU) < 0)
-				ereport(ERROR,
-						(errcode_for_file_access(),
-						errmsg("could not create directory \"%s\": %m",
-								hibernate_dir)));
-		}
-		else
-			ereport(ERROR,
-					(errcode_for_file_access(),
-					 errmsg("could not stat directory \"%s\": %m", hibernate_dir)));
-	}
+	DefineCustomBoolVariable("pg_hibernator.connectionless_restore",
+							"Restore blocks without connecting to their databases.",
+							"The BlockReaders read blocks by their relfilenode, without taking locks on the relations.",
+							&guc_connectionless,
+							guc_connectionless,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
 
-	/* XXX: Should we make sure we have write permissions on this directory? */
-}
+	DefineCustomRealVariable("pg_hibernator.ready_fraction",
+							"Fraction of the saved blocks that must be restored before declaring the restore ready.",
+							"When reached, the BufferSaver creates the file pg_hibernator/ready.",
+							&guc_ready_fraction,
+							guc_ready_fraction,
+							0.0,
+							1.0,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
 
-static void
-RegisterBlockReaders(void)
-{
-	DIR			   *dir;
-	const char	   *hibernate_dir;
-	struct dirent   *dent;
+	DefineCustomBoolVariable("pg_hibernator.ready_hottest_tier",
+							"Apply pg_hibernator.ready_fraction to the highest-priority blocks only.",
+							NULL,
+							&guc_ready_hottest_tier,
+							guc_ready_hottest_tier,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
 
-	/* Don't create BlockReaders if the extension is disabled. */
-	if (!guc_enabled)
-		return;
+	DefineCustomIntVariable("pg_hibernator.efficacy_window",
+							"How long to watch the restored blocks for use, after the restore.",
+							"Zero disables the accounting.",
+							&guc_efficacy_window,
+							guc_efficacy_window,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
 
-	hibernate_dir = SAVE_LOCATION;
+	DefineCustomIntVariable("pg_hibernator.efficacy_relations",
+							"Maximum number of relations to keep restore statistics of.",
+							NULL,
+							&guc_efficacy_relations,
+							guc_efficacy_relations,
+							100,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
 
-	dir = opendir(hibernate_dir);
-	if (dir == NULL)
-		ereport(ERROR,
-				(errcode_for_file_access(),
-				 errmsg("could not open directory \"%s\": %m", hibernate_dir)));
+	DefineCustomRealVariable("pg_hibernator.unused_fraction",
+							"Fraction of restored blocks used, below which a relation is considered unused.",
+							"Relations unused in past restores are restored last, and eventually not at all. Zero disables this.",
+							&guc_unused_fraction,
+							guc_unused_fraction,
+							0.0,
+							1.0,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_hibernator.include_relations",
+							"Relations to restore, regardless of how little they were used after past restores.",
+							"A comma-separated list of database.schema.relation or schema.relation names.",
+							&guc_include_relations,
+							guc_include_relations,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_hibernator.exclude_relations",
+							"Relations never to restore.",
+							"A comma-separated list of database.schema.relation or schema.relation names.",
+							&guc_exclude_relations,
+							guc_exclude_relations,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_hibernator.high_priority_databases",
+							"Databases to restore ahead of the others.",
+							"A comma-separated list of database names. Their BlockReaders are launched four times as often as those of the low priority databases, and twice as often as the rest.",
+							&guc_high_priority_databases,
+							guc_high_priority_databases,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_hibernator.low_priority_databases",
+							"Databases to restore behind the others.",
+							"A comma-separated list of database names.",
+							&guc_low_priority_databases,
+							guc_low_priority_databases,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_hibernator.query_driven",
+							"Restore the relations that queries touch ahead of the others.",
+							NULL,
+							&guc_query_driven,
+							guc_query_driven,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.max_gap",
+							"Longest gap between saved blocks that the restore reads through, in blocks.",
+							"Reading a short gap along with the blocks around it costs less than seeking over it. Zero disables this.",
+							&guc_max_gap,
+							guc_max_gap,
+							0,
+							RELSEG_SIZE,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.usage_count_cap",
+							"Highest usage count the restore gives back to a buffer.",
+							"Restored buffers get back the usage count they had when saved, up to this. Zero disables saving usage counts, and one disables giving them back.",
+							&guc_usage_count_cap,
+							guc_usage_count_cap,
+							0,
+							BM_MAX_USAGE_COUNT,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("pg_hibernator.usage_count_scale",
+							"Factor to scale the saved usage counts by, before capping them.",
+							NULL,
+							&guc_usage_count_scale,
+							guc_usage_count_scale,
+							0.0,
+							1.0,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_hibernator.tablespace_lanes",
+							"Save the blocks of each tablespace of a database in a save-file of their own.",
+							"Lets the blocks on different tablespaces be restored in parallel.",
+							&guc_tablespace_lanes,
+							guc_tablespace_lanes,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.lane_readers",
+							"Most BlockReaders to restore blocks of one tablespace at once.",
+							"Zero means no limit, other than that on the BlockReaders in all.",
+							&guc_lane_readers,
+							guc_lane_readers,
+							0,
+							INT_MAX / 2,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.restore_deadline",
+							"Time the restore should be done in.",
+							"The blocks that the last restore's throughput says won't fit are restored last, and not at all once the time is up. Zero means no deadline.",
+							&guc_restore_deadline,
+							guc_restore_deadline,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_hibernator.drop_os_cache",
+							"Drop the OS cache's copies of the blocks restored into shared buffers.",
+							"Leaves the OS cache to the blocks that aren't in shared buffers, rather than caching the restored blocks twice.",
+							&guc_drop_os_cache,
+							guc_drop_os_cache,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.snapshot_interval",
+							"Time between snapshots of the shared buffers.",
+							"Keeps the list of blocks to restore up to date in case of a crash, by journaling the blocks that came and went since the last snapshot. Zero disables snapshots.",
+							&guc_snapshot_interval,
+							guc_snapshot_interval,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.save_workers",
+							"Number of helper workers that share the shutdown save with the Buffer Saver.",
+							"They're launched once the restore is done, and wait for the shutdown.",
+							&guc_save_workers,
+							guc_save_workers,
+							0,
+							MAX_SAVE_HELPERS,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_hibernator.slru_caches",
+							"Save the pages in the commit log and related caches, and read them before the restore.",
+							"The pages are read into the OS cache, for the visibility checks on the restored blocks.",
+							&guc_slru_caches,
+							guc_slru_caches,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_hibernator.plan_throughput",
+							"Restore throughput pg_hibernator_plan() estimates the restore time at, in blocks per second.",
+							"Zero means the throughput measured during the last restore, if any.",
+							&guc_plan_throughput,
+							guc_plan_throughput,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+}
+
+/*
+ * Create the directory to save files in, if it doesn't already exist.
+ */
+static void
+CreateDirectory(void)
+{
+	struct stat		st;
+	const char	   *hibernate_dir = SAVE_LOCATION;
+
+	if (stat(hibernate_dir, &st) == 0)
+	{
+		/* Is it not a directory? */
+		if (!S_ISDIR(st.st_mode))
+			ereport(ERROR,
+					(errmsg("\"%s\" exists but is not a directory, hence disabling hibernation",
+							hibernate_dir)));
+	}
+	else
+	{
+		/* Directory does not exist? */
+		if (errno == ENOENT)
+		{
+			/* Create directory */
+			if (mkdir(hibernate_dir, S_IRWXU) < 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						errmsg("could not create directory \"%s\": %m",
+								hibernate_dir)));
+		}
+		else
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not stat directory \"%s\": %m", hibernate_dir)));
+	}
+
+	/* XXX: Should we make sure we have write permissions on this directory? */
+}
+
+static void
+RegisterBlockReaders(void)
+{
+	List		   *savefiles;
+	ListCell	   *lc;
+
+	/* Don't create BlockReaders if the extension is disabled. */
+	if (!guc_enabled)
+	{
+		PlanRestore(NIL, 0);
+		return;
+	}
+
+	savefiles = ListSavefiles(LOG);
+
+	/*
+	 * A connectionless BlockReader can restore any number of databases, so
+	 * unless we're asked to restore them in parallel, one is all we need.
+	 */
+	if (guc_connectionless && !guc_parallel_enabled)
+	{
+		PlanRestore(savefiles, savefiles != NIL ? 1 : 0);
+
+		if (savefiles != NIL)
+			addPendingWorker(ALL_SAVEFILES);
+	}
+	else
+	{
+		PlanRestore(savefiles, list_length(savefiles));
+
+		foreach(lc, savefiles)
+			addPendingWorker(lfirst_int(lc));
+	}
+
+	list_free(savefiles);
+}
+
+/*
+ * Returns the list of numbers of the save-files in the save directory, or of
+ * the sections of the container that are yet to be restored.
+ */
+static List *
+ListSavefiles(int elevel)
+{
+	DIR			   *dir;
+	const char	   *hibernate_dir;
+	struct dirent   *dent;
+	List		   *savefiles = NIL;
+
+	if (ContainerExists())
+	{
+		FILE		   *file;
+		uint32			nsections;
+		uint32			sectionnum;
+		SavefileSection	section;
+		uint64			nblocks = 0;
+
+		/*
+		 * The index tells us everything we need to plan the restore, without
+		 * reading any of the sections.
+		 */
+		file = fileOpen(CONTAINER_PATH, PG_BINARY_R);
+		nsections = readContainerHeader(file, CONTAINER_PATH);
+
+		for (sectionnum = 1; sectionnum <= nsections; ++sectionnum)
+		{
+			readContainerSection(file, CONTAINER_PATH, nsections, sectionnum, &section);
+
+			if (section.flags & SECTION_DONE)
+				continue;
+
+			savefiles = lappend_int(savefiles, sectionnum);
+			nblocks += section.nblocks;
+		}
+
+		fileClose(file, CONTAINER_PATH);
+
+		/* Nothing left to restore; the container has served its purpose. */
+		if (savefiles == NIL)
+		{
+			if (unlink(CONTAINER_PATH) != 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						errmsg("error removing file \"%s\" : %m", CONTAINER_PATH)));
+		}
+		else
+			ereport(elevel,
+					(errmsg("Buffer Saver: %lu blocks of %d databases to restore",
+							(unsigned long) nblocks, list_length(savefiles))));
+
+		return savefiles;
+	}
+
+	hibernate_dir = SAVE_LOCATION;
+
+	dir = opendir(hibernate_dir);
+	if (dir == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open directory \"%s\": %m", hibernate_dir)));
+
+	errno = 0;
+	while ((dent = readdir(dir)) != NULL)
+	{
+		int		filenum;
+
+		/* Skip the file if we can't parse its name. */
+		if (!parseSavefileName(dent->d_name, &filenum))
+			continue;
+
+		savefiles = lappend_int(savefiles, filenum);
+	}
+
+	if (errno != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("error encountered during readdir \"%s\": %m", hibernate_dir)));
+
+	closedir(dir);
+
+	return savefiles;
+}
+
+static void
+addPendingWorker(int filenum)
+{
+	MemoryContext oldContext = MemoryContextSwitchTo(TopMemoryContext);
+	ReaderLane *lane = (ReaderLane *) palloc(sizeof(ReaderLane));
+	char	   *dbname;
+
+	lane->filenum		= filenum;
+	lane->tablespace	= InvalidOid;
+	lane->dbclass		= DATABASE_CLASS_NORMAL;
+	lane->handle		= NULL;
+
+	if (filenum != ALL_SAVEFILES)
+	{
+		lane->tablespace = SavefileTablespace(filenum, &dbname);
+		if (dbname != NULL)
+		{
+			lane->dbclass = DatabaseClass(dbname);
+			pfree(dbname);
+		}
+	}
+
+	pendingWorkers = lappend(pendingWorkers, lane);
+
+	MemoryContextSwitchTo(oldContext);
+}
+
+/*
+ * The tablespace of the first relation in the given save-file; with
+ * pg_hibernator.tablespace_lanes, that of all its relations. InvalidOid if it
+ * has no relations, or doesn't say.
+ *
+ * Also hands out the name of the save-file's database, which the caller should
+ * pfree; or NULL if the save-file doesn't exist.
+ */
+static Oid
+SavefileTablespace(int filenum, char **dbname)
+{
+	FILE			   *file;
+	bool				in_container;
+	SavefileSection		section;
+	SavefileReader		reader;
+	SavefileRecord		record;
+	Oid					tablespace = InvalidOid;
+
+	file = OpenSavefile(filenum, true, &reader, dbname, &in_container, &section);
+	if (file == NULL)
+	{
+		*dbname = NULL;
+		return InvalidOid;
+	}
+
+	while (readSavefileRecord(&reader, &record))
+	{
+		if (record.type == 'r')
+		{
+			tablespace = record.tablespace;
+			break;
+		}
+	}
+
+	fileClose(file, reader.path);
+
+	return tablespace;
+}
+
+/*
+ * The priority class of the database, according to
+ * pg_hibernator.high_priority_databases and low_priority_databases; a database
+ * in both is of high priority. The global objects are of normal priority.
+ *
+ * The names in the lists are identifiers, downcased unless quoted; see
+ * ParseRelationList(). Qualified names match no database.
+ */
+static int
+DatabaseClass(const char *dbname)
+{
+	static char	   *high_value = NULL;	/* The values the lists were parsed from */
+	static char	   *low_value = NULL;
+	static List	   *high = NIL;
+	static List	   *low = NIL;
+	MemoryContext	oldContext;
+	ListCell	   *lc;
+
+	/* Parse the lists again only if they've changed since. */
+	oldContext = MemoryContextSwitchTo(TopMemoryContext);
+
+	if (high_value == NULL || strcmp(high_value, guc_high_priority_databases) != 0)
+	{
+		high_value = pstrdup(guc_high_priority_databases);
+		high = ParseRelationList(guc_high_priority_databases,
+								 "pg_hibernator.high_priority_databases");
+	}
+
+	if (low_value == NULL || strcmp(low_value, guc_low_priority_databases) != 0)
+	{
+		low_value = pstrdup(guc_low_priority_databases);
+		low = ParseRelationList(guc_low_priority_databases,
+								"pg_hibernator.low_priority_databases");
+	}
+
+	MemoryContextSwitchTo(oldContext);
+
+	foreach(lc, high)
+	{
+		List	   *parts = (List *) lfirst(lc);
+
+		if (list_length(parts) == 1 && strcmp((const char *) linitial(parts), dbname) == 0)
+			return DATABASE_CLASS_HIGH;
+	}
+
+	foreach(lc, low)
+	{
+		List	   *parts = (List *) lfirst(lc);
+
+		if (list_length(parts) == 1 && strcmp((const char *) linitial(parts), dbname) == 0)
+			return DATABASE_CLASS_LOW;
+	}
+
+	return DATABASE_CLASS_NORMAL;
+}
+
+/* Order save-file numbers by the priority classes of their databases. */
+static int
+SavefileClassCmp(const void *a, const void *b)
+{
+	const int  *fa = (const int *) a;
+	const int  *fb = (const int *) b;
+
+	/* Each entry is a pair: the class, then the save-file number. */
+	if (fa[0] != fb[0])
+		return fa[0] - fb[0];
+	return fa[1] - fb[1];
+}
+
+static void
+processOnePendingWorker()
+{
+	static int		classLaunches[NUM_DATABASE_CLASSES];	/* BlockReaders launched of each class */
+	ListCell	   *lc;
+	ListCell	   *prev = NULL;
+	ListCell	   *next;
+	ListCell	   *best;
+	ListCell	   *best_prev;
+	double			best_share = 0;
+	int				best_class = 0;
+	ReaderLane	   *lane = NULL;
+	int				running = 0;
+	int				max_readers;
+	MemoryContext	oldContext;
+
+	/* Nothing to do if the list is empty. */
+	if (list_length(pendingWorkers) == 0)
+		return;
+
+	/* Forget the BlockReaders that have exited. */
+	for (lc = list_head(launchedWorkers); lc != NULL; lc = next)
+	{
+		ReaderLane *done = (ReaderLane *) lfirst(lc);
+		pid_t		pid;
+
+		next = lnext(lc);
+
+		if (GetBackgroundWorkerPid(done->handle, &pid) == BGWH_STOPPED)
+		{
+			pfree(done->handle);
+			pfree(done);
+			launchedWorkers = list_delete_cell(launchedWorkers, lc, prev);
+		}
+		else
+		{
+			++running;
+			prev = lc;
+		}
+	}
+
+	/*
+	 * Run as many BlockReaders at once as pg_hibernator_set_max_readers() last
+	 * asked for, if it has been called; otherwise, one, or as many as there are
+	 * databases if parallelism is enabled. Lowering the limit doesn't stop any
+	 * BlockReaders that are running.
+	 */
+	max_readers = 0;
+	if (shared_state != NULL)
+	{
+		SpinLockAcquire(&shared_state->mutex);
+		max_readers = shared_state->max_readers;
+		SpinLockRelease(&shared_state->mutex);
+	}
+
+	if (max_readers == 0)
+		max_readers = guc_parallel_enabled ? INT_MAX : 1;
+
+	if (running >= max_readers)
+		return;
+
+	/*
+	 * Launch a BlockReader for a save-file whose tablespace isn't already
+	 * being read by pg_hibernator.lane_readers BlockReaders; so that each
+	 * tablespace, which may well be a device of its own, is kept busy, but not
+	 * swamped. Save-files of no particular tablespace can always go.
+	 *
+	 * Of those, take the first of the database priority class whose launches,
+	 * counting this one, come to the least per unit of the class's weight;
+	 * ties go to the higher priority. So the high priority databases go first, but
+	 * a lower priority class gets a launch every so often, even while there
+	 * are databases of higher priority waiting.
+	 */
+	best = NULL;
+	best_prev = NULL;
+	prev = NULL;
+	foreach(lc, pendingWorkers)
+	{
+		ListCell   *lc2;
+		int			in_lane = 0;
+
+		lane = (ReaderLane *) lfirst(lc);
+
+		if (guc_lane_readers > 0 && lane->tablespace != InvalidOid)
+		{
+			foreach(lc2, launchedWorkers)
+			{
+				if (((ReaderLane *) lfirst(lc2))->tablespace == lane->tablespace)
+					++in_lane;
+			}
+		}
+
+		if (guc_lane_readers == 0 || in_lane < guc_lane_readers)
+		{
+			double		share = (double) (classLaunches[lane->dbclass] + 1)
+				/ databaseClassWeights[lane->dbclass];
+
+			if (best == NULL || share < best_share
+				|| (share == best_share && lane->dbclass < best_class))
+			{
+				best = lc;
+				best_prev = prev;
+				best_share = share;
+				best_class = lane->dbclass;
+			}
+		}
+
+		prev = lc;
+	}
+
+	if (best == NULL)
+		return;
+
+	lc = best;
+	prev = best_prev;
+	lane = (ReaderLane *) lfirst(lc);
+
+	oldContext = MemoryContextSwitchTo(TopMemoryContext);
+
+	if (!RegisterWorker(lane->filenum, &lane->handle))
+	{
+		MemoryContextSwitchTo(oldContext);
+		ereport(LOG, (errmsg("registration of background worker failed")));
+		return;
+	}
+
+	/* Move it from the pending list iff we could register a worker successfully. */
+	pendingWorkers = list_delete_cell(pendingWorkers, lc, prev);
+	launchedWorkers = lappend(launchedWorkers, lane);
+	++classLaunches[lane->dbclass];
+
+	MemoryContextSwitchTo(oldContext);
+}
+
+/*
+ * Wait for the BlockReaders to exit. They get the SIGTERM along with us at
+ * shutdown, and write down how far they got before exiting; the save has to
+ * wait for that, lest they write progress, or remove save-files, after it
+ * has replaced the save-files.
+ */
+static void
+WaitForBlockReaders(void)
+{
+	while (launchedWorkers != NIL)
+	{
+		ReaderLane *lane = (ReaderLane *) linitial(launchedWorkers);
+		pid_t		pid;
+		int			rc;
+
+		if (GetBackgroundWorkerPid(lane->handle, &pid) == BGWH_STOPPED)
+		{
+			pfree(lane->handle);
+			pfree(lane);
+			launchedWorkers = list_delete_first(launchedWorkers);
+			continue;
+		}
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   100L);
+		ResetLatch(&MyProc->procLatch);
+
+		/* emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+}
+
+static bool
+RegisterWorker(int id, BackgroundWorkerHandle **handle)
+{
+	BackgroundWorker	worker;
+
+	/*
+	 * Protect against the possibility of more members being added to the
+	 * structure than we are using below.
+	 */
+	MemSet(&worker, 0, sizeof(worker));
+
+	worker.bgw_main_arg = Int32GetDatum(id);
+	if (id > 0 && guc_connectionless)
+		worker.bgw_main_arg = Int32GetDatum(id | READER_CONNECTIONLESS);
+	worker.bgw_flags		= BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+
+	if (id == 0)
+	{
+		/* Register the BufferSaver background worker */
+		worker.bgw_start_time	= BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time	= 0;	/* Keep the BufferSaver running */
+		worker.bgw_main			= BufferSaverMain;
+		snprintf(worker.bgw_name, BGW_MAXLEN, "Buffer Saver");
+		RegisterBackgroundWorker(&worker);
+		return true;
+	}
+	else
+	{
+		/* Register a BlockReader background worker process */
+		worker.bgw_start_time	= BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time	= BGW_NEVER_RESTART;	/* Don't restart BlockReaders upon error */
+		worker.bgw_main			= BlockReaderMain;
+		worker.bgw_notify_pid	= MyProcPid;			/* Send me SIGUSR1 when a BGWorker is created or dies. */
+		if (id == ALL_SAVEFILES)
+			snprintf(worker.bgw_name, BGW_MAXLEN, "Block Reader (all databases)");
+		else
+			snprintf(worker.bgw_name, BGW_MAXLEN, "Block Reader %d", id);
+		return RegisterDynamicBackgroundWorker(&worker, handle);
+	}
+}
+
+static void
+WorkerCommon(void)
+{
+	/* Establish signal handlers before unblocking signals. */
+	pqsignal(SIGHUP, sighupHandler);
+	pqsignal(SIGTERM, sigtermHandler);
+	pqsignal(SIGUSR1, sigusr1Handler);
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+}
+
+static void
+BlockReaderMain(Datum main_arg)
+{
+	int					id = DatumGetInt32(main_arg);
+	bool				connectionless = (id == ALL_SAVEFILES
+										  || (id & READER_CONNECTIONLESS) != 0);
+	int					filenum;
+
+	if (id != ALL_SAVEFILES)
+		id &= ~READER_CONNECTIONLESS;
+
+	WorkerCommon();
+
+	/* Let the waiters know when we're done, however we exit. */
+	before_shmem_exit(BlockReaderExit, (Datum) 0);
+
+	/* Learn which relations not to bother restoring; see SkipRelation(). */
+	if (guc_unused_fraction > 0.0)
+	{
+		uint32	generation;
+
+		restoreHistory = LoadRestoreHistory(&generation);
+	}
+	includeRelations = ParseRelationList(guc_include_relations, "pg_hibernator.include_relations");
+	excludeRelations = ParseRelationList(guc_exclude_relations, "pg_hibernator.exclude_relations");
+
+	if (connectionless)
+	{
+		/*
+		 * We don't need to be bound to any database, but connecting to none
+		 * still gets us set up for the statistics collector, and for releasing
+		 * our resources on exit. Buffer pins need a resource owner, and we
+		 * never start a transaction that would provide one.
+		 */
+		BackgroundWorkerInitializeConnection(NULL, NULL);
+		CurrentResourceOwner = ResourceOwnerCreate(NULL, "pg_hibernator");
+	}
+
+	if (id == ALL_SAVEFILES)
+	{
+		List	   *savefiles = ListSavefiles(DEBUG1);
+		ListCell   *lc;
+		int			priority;
+		int		   *order;
+		int			i;
+
+		Assert(connectionless);
+
+		/*
+		 * Go through the save-files of the high priority databases first; see
+		 * pg_hibernator.high_priority_databases. Each entry of the array is a
+		 * pair of the class and the save-file number.
+		 */
+		order = (int *) palloc(sizeof(int) * 2 * (list_length(savefiles) + 1));
+
+		i = 0;
+		foreach(lc, savefiles)
+		{
+			char	   *dbname;
+
+			SavefileTablespace(lfirst_int(lc), &dbname);
+
+			order[2 * i]		= (dbname != NULL ? DatabaseClass(dbname) : DATABASE_CLASS_NORMAL);
+			order[2 * i + 1]	= lfirst_int(lc);
+			++i;
+
+			if (dbname != NULL)
+				pfree(dbname);
+		}
+
+		qsort(order, list_length(savefiles), 2 * sizeof(int), SavefileClassCmp);
+
+		i = 0;
+		foreach(lc, savefiles)
+		{
+			lfirst_int(lc) = order[2 * i + 1];
+			++i;
+		}
+
+		pfree(order);
+
+		/*
+		 * Make one pass over all the save-files per priority, so that the
+		 * high-priority blocks of all the databases are restored before the
+		 * rest of the blocks of any database.
+		 */
+		for (priority = 0; priority < NUM_PRIORITIES && !got_sigterm; ++priority)
+		{
+			foreach(lc, savefiles)
+			{
+				if (got_sigterm)
+					break;
+
+				/* Cancelling one database's restore doesn't stop the others. */
+				ReadBlocks(lfirst_int(lc), true, priority);
+				restoreCancelled = false;
+			}
+		}
+
+		if (got_sigterm)
+		{
+			ereport(LOG,
+					(errmsg("Block Reader: stopped; the rest is kept for the next startup")));
+			proc_exit(1);
+		}
+
+		ereport(LOG, (errmsg("Block Reader: all blocks of %d save-files read successfully",
+							list_length(savefiles))));
+		proc_exit(1);
+	}
+
+	/*
+	 * The save-file (or section of the container) this worker is assigned to
+	 * is identified by its number; ReadBlocks() complains if it doesn't exist.
+	 */
+	filenum = id;
+
+	ReadBlocks(filenum, connectionless, ALL_PRIORITIES);
+
+	if (restoreCancelled)
+	{
+		ereport(LOG,
+				(errmsg("Block Reader %d: restore cancelled; the rest is kept for the next startup",
+						filenum)));
+		proc_exit(1);
+	}
+
+	if (got_sigterm)
+	{
+		ereport(LOG,
+				(errmsg("Block Reader %d: stopped; the rest is kept for the next startup",
+						filenum)));
+		proc_exit(1);
+	}
+
+	/*
+	 * Exit with non-zero status to ensure that this worker is not restarted.
+	 *
+	 * For any backend connected to shared-buffers, an exit code other than 0 or 1
+	 * causes a system-wide restart, so we have no choice but to use 1. Since an
+	 * ERROR also causes exit code 1, it would've been nice if we could use some
+	 * other code to signal normal exit, so that a monitor could differentiate
+	 * between a successful exit, and an exit due to an ERROR.
+	 *
+	 * To get around this ambiguity we resort to logging a message to server log;
+	 * this message should console the user that everything went okay, even though
+	 * the exit code is 1.
+	 */
+	ereport(LOG, (errmsg("Block Reader %d: all blocks read successfully", filenum)));
+	proc_exit(1);
+}
+
+/*
+ * Restore the blocks listed in the given save-file, or section of the container.
+ *
+ * If priority is not ALL_PRIORITIES, restore only the blocks of that priority;
+ * the save-file is considered done after its lowest priority is restored.
+ */
+static void
+ReadBlocks(int filenum, bool connectionless, int priority)
+{
+	FILE	   *file;
+	char	   *dbname;
+	SavefileRecord	record;
+	SavefileProgress here;
+	ReaderState	rs;
+	bool		in_container;
+	SavefileSection	section;
+	List	   *retries			= NIL;	/* Deferred relations we're going back for now */
+	int			round			= 0;
+	int			since_demand	= 0;
+	int			since_control	= 0;
+	bool		more;
+
+	MemSet(&rs, 0, sizeof(rs));
+
+	file = OpenSavefile(filenum, false, &rs.reader, &dbname, &in_container, &section);
+	if (file == NULL)
+	{
+		ereport(LOG,
+				(errmsg("Block Reader %d: section already restored", filenum)));
+		return;
+	}
+
+	rs.filenum			= filenum;
+	rs.connectionless	= connectionless;
+	rs.dbname			= dbname;
+	rs.filepath			= rs.reader.path;
+	rs.done_forknum		= InvalidForkNumber;
+	rs.done_blocknum	= InvalidBlockNumber;
+	rs.span.end			= InvalidBlockNumber;
+
+	TRACE_PG_HIBERNATOR_SAVEFILE_OPEN(filenum, rs.filepath, in_container);
+
+	/*
+	 * When restoring global objects, the dbname is zero-length string, and non-
+	 * zero length otherwise. And filenum is never expected to be smaller than 1.
+	 */
+	Assert(filenum >= 1);
+	Assert(filenum == 1 ? strlen(dbname) == 0 : strlen(dbname) > 0);
+
+	if (!connectionless)
+	{
+		/* To restore the global objects, use default database */
+		BackgroundWorkerInitializeConnection(filenum == 1 ? guc_default_database : dbname, NULL);
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		SPI_connect();
+		PushActiveSnapshot(GetTransactionSnapshot());
+	}
+
+	pgstat_report_activity(STATE_RUNNING, "restoring buffers");
+
+	/* Pick up where we left off before a restart, if we were interrupted. */
+	if (ReadProgress(filenum, &rs.progress))
+	{
+		if (resumeSavefileReader(&rs.reader, &rs.progress))
+			ereport(LOG,
+					(errmsg("Block Reader %d: resuming restore at offset %lu",
+							filenum, (unsigned long) rs.progress.position)));
+		else
+		{
+			ereport(LOG,
+					(errmsg("Block Reader %d: ignoring invalid progress file \"%s\"",
+							filenum, getProgressFileName(filenum))));
+			getSavefileProgress(&rs.reader, &rs.progress);
+		}
+	}
+	else
+		getSavefileProgress(&rs.reader, &rs.progress);
+
+	/*
+	 * Whatever we allocate while restoring a relation goes when we move on to
+	 * the next one; with very many relations, it would add up otherwise.
+	 */
+	rs.caller_context = CurrentMemoryContext;
+	rs.relation_context = AllocSetContextCreate(rs.caller_context,
+												"pg_hibernator relation",
+												ALLOCSET_DEFAULT_MINSIZE,
+												ALLOCSET_DEFAULT_INITSIZE,
+												ALLOCSET_DEFAULT_MAXSIZE);
+	rs.oldcontext = MemoryContextSwitchTo(rs.relation_context);
+
+	/*
+	 * Note that in case of a read error, we will leak relcache entry that we may
+	 * currently have open. In case of EOF, we close the relation after the loop.
+	 */
+	for (;;)
+	{
+		more = readSavefileRecord(&rs.reader, &record);
+
+		/*
+		 * A relation we've gone back for ends where the next relation, or any
+		 * other context record, begins.
+		 */
+		if (more && rs.retrying
+			&& (record.type == 'd' || record.type == 'p' || record.type == 't' || record.type == 'r'))
+		{
+			getSavefileProgress(&rs.reader, &here);
+			more = (here.position == rs.retry_mark.position);
+		}
+
+		/*
+		 * At the end, go back for the relations we found locked, if any. Only
+		 * connected restores lock relations, and they restore all priorities
+		 * in one pass, so we never leave the loop from the priority check
+		 * below with relations to go back for.
+		 */
+		if (!more)
+		{
+			if (!NextDeferredRelation(filenum, &rs.deferred, &retries, &round, &rs.retry_mark)
+				|| !resumeSavefileReader(&rs.reader, &rs.retry_mark))
+				break;
+
+			/* If we're interrupted, start over from the first of them. */
+			if (!rs.retrying)
+				rs.progress = rs.retry_mark;
+			rs.retrying = true;
+			continue;
+		}
+
+		/*
+		 * If we want to process the signals, this seems to be the best place
+		 * to do it. Generally the backends refrain from processing config file
+		 * while in transaction, but that's more for the fear of allowing GUC
+		 * changes to affect expression evaluation, causing different results
+		 * for the same expression in a transaction. Since this worker is not
+		 * processing any queries, it is okay to process the config file here.
+		 *
+		 * Even though it's okay to process SIGHUP here, doing so doesn't add
+		 * any value. The only reason we might want to process config file here
+		 * would be to allow the user to interrupt the BlockReader's operation
+		 * by changing this extenstion's GUC parameter. But the user can do that
+		 * anyway, using SIGTERM or pg_terminate_backend().
+		 */
+
+		/*
+		 * Stop processing the save-file if the Postmaster wants us to die, or
+		 * the DBA has cancelled the restore.
+		 */
+		if (got_sigterm || restoreCancelled)
+			break;
+
+		/* Heed pg_hibernator_pause() and pg_hibernator_cancel(). */
+		if (connectionless
+			&& (record.type == 'd' || record.type == 'r'
+				|| ++since_control >= CONTROL_CHECK_INTERVAL))
+		{
+			since_control = 0;
+			if (!WaitWhilePaused(filenum, record.database))
+				break;
+		}
+
+		/*
+		 * The blocks are sorted by priority, and every priority carries its own
+		 * tablespace, relation and fork records, so we can skip to the
+		 * priority we want, and stop after it.
+		 */
+		if (priority != ALL_PRIORITIES && savefilePassCmp(&record, priority) != 0)
+		{
+			if (savefilePassCmp(&record, priority) > 0)
+			{
+				/* The next pass starts here. */
+				getSavefileProgress(&rs.reader, &here);
+				if (here.position != rs.progress.position)
+					rs.progress = here;
+				break;
+			}
+
+			continue;
+		}
+
+		hibernator_trace("record type %x - %c", record.type, record.type);
+
+		/* Restore what the queries are waiting for, before anything else. */
+		if (!rs.retrying
+			&& (record.type == 'r' || ++since_demand >= DEMAND_CHECK_INTERVAL))
+		{
+			ServeDemand(&rs.demand, filenum, connectionless, dbname, record.database,
+						rs.reader.position, priority);
+			since_demand = 0;
+		}
+
+		/*
+		 * For the waiters, the blocks are done as soon as we get to them,
+		 * whether we find them or not. The blocks restored on demand were
+		 * reported then, and so were the blocks of the relations we've gone
+		 * back for, when we first got to them.
+		 */
+		if ((record.type == 'b' || record.type == 'N') && !rs.served && !rs.retrying)
+			ReportBlocksDone(record.priority,
+							 CountBlocksToRestore(rs.done_forknum, rs.done_blocknum,
+												  record.forknum, record.blocknum,
+												  record.type == 'b' ? 1 : record.range));
+
+		switch (record.type)
+		{
+			case 'd':
+			case 'p':
+			case 't':
+				/* Nothing to do; the records that follow carry these along. */
+				break;
+			case 'r':
+				ReadRelationRecord(&rs, &record);
+				break;
+			case 'f':
+				ReadForkRecord(&rs, &record);
+				break;
+			case 'b':
+				ReadBlockRecord(&rs, &record);
+				break;
+			case 'N':
+				ReadRangeRecord(&rs, &record);
+				break;
+			case 'S':
+				ReadSpanRecord(&rs, &record);
+				break;
+		}
+	}
+
+	CloseRestoredRelation(&rs);
+
+	EndDemand(&rs.demand);
+
+	/* We may have stopped early, leaving some relations to go back for. */
+	list_free_deep(rs.deferred);
+	list_free_deep(retries);
+
+	MemoryContextSwitchTo(rs.oldcontext);
+	MemoryContextDelete(rs.relation_context);
+
+	TRACE_PG_HIBERNATOR_SAVEFILE_DONE(filenum, rs.blocks_restored);
+
+	if (priority == ALL_PRIORITIES)
+		ereport(LOG,
+				(errmsg("Block Reader %d: restored %u blocks, reading %u more to bridge gaps",
+						filenum, rs.blocks_restored, rs.gap_blocks)));
+	else
+		ereport(LOG,
+				(errmsg("Block Reader %d: restored %u blocks of priority %d, reading %u more to bridge gaps",
+						filenum, rs.blocks_restored, priority, rs.gap_blocks)));
+
+	FlushDropBatch();
+
+	if (!connectionless)
+	{
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+	}
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	fileClose(file, rs.filepath);
+	pfree(dbname);
+
+	/*
+	 * If we've been asked to stop, or have more passes to make over this
+	 * save-file, keep it around, along with a note of how far we got.
+	 */
+	if (got_sigterm || restoreCancelled
+		|| (priority != ALL_PRIORITIES && priority < NUM_PRIORITIES - 1))
+	{
+		WriteProgress(filenum, &rs.progress);
+		return;
+	}
+
+	/*
+	 * Remove the progress file first; a progress file without its save-file
+	 * could be mistaken for the progress of the next save-file by that number.
+	 */
+	RemoveProgress(filenum);
+
+	if (in_container)
+	{
+		/*
+		 * Mark our section as done, rather than removing the container; the
+		 * container is removed when it is next listed with no sections left to
+		 * restore, or replaced by the next save. Other BlockReaders may be
+		 * updating their own entries concurrently, but the entries don't
+		 * overlap.
+		 */
+		section.flags |= SECTION_DONE;
+
+		file = fileOpen(rs.filepath, PG_BINARY_RW);
+		writeContainerSection(file, rs.filepath, filenum, &section);
+		fileClose(file, rs.filepath);
+	}
+	/* Remove the save-file */
+	else if (remove(rs.filepath) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("error removing file \"%s\" : %m", rs.filepath)));
+}
+
+/*
+ * An 'r' record: move on from the previous relation to this one, and open it,
+ * unless it is to be skipped.
+ */
+static void
+ReadRelationRecord(ReaderState *rs, const SavefileRecord *record)
+{
+	uint32		control;
+
+	/*
+	 * Remember where this relation begins, for the checkpoints of our
+	 * progress. If we've resumed at this relation, skip the blocks restored
+	 * before the restart.
+	 */
+	getSavefileProgress(&rs->reader, &rs->mark);
+	if (rs->retrying)
+	{
+		rs->done_forknum	= rs->retry_mark.forknum;
+		rs->done_blocknum	= rs->retry_mark.blocknum;
+	}
+	else if (rs->mark.position == rs->progress.position)
+	{
+		rs->done_forknum	= rs->progress.forknum;
+		rs->done_blocknum	= rs->progress.blocknum;
+	}
+	else
+	{
+		rs->done_forknum	= InvalidForkNumber;
+		rs->done_blocknum	= InvalidBlockNumber;
+		rs->progress		= rs->mark;
+	}
+
+	CloseRestoredRelation(rs);
+
+	/*
+	 * Start a new transaction every so often, so that what the transaction
+	 * accumulates doesn't grow with the number of relations; SPI_connect()
+	 * leaves us in its own memory context. Also pause between transactions,
+	 * if asked to, so that we don't hold back anyone's snapshots meanwhile.
+	 */
+	control = (rs->connectionless ? 0 : RestoreControlFlags(record->database));
+	if (!rs->connectionless
+		&& (control != 0 || ++rs->relations_in_xact >= RELATIONS_PER_TRANSACTION))
+	{
+		MemoryContextSwitchTo(rs->oldcontext);
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+
+		if (control != 0)
+			(void) WaitWhilePaused(rs->filenum, record->database);
+
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		SPI_connect();
+		PushActiveSnapshot(GetTransactionSnapshot());
+		rs->oldcontext = MemoryContextSwitchTo(rs->relation_context);
+
+		rs->relations_in_xact = 0;
+
+		if (restoreCancelled || got_sigterm)
+		{
+			rs->skip_relation = true;
+			return;
+		}
+	}
+
+	MemoryContextReset(rs->relation_context);
+
+	rs->served = DemandServed(&rs->demand, rs->mark.position);
+	if (rs->served)
+	{
+		rs->skip_relation = true;
+		return;
+	}
+
+	/*
+	 * Past pg_hibernator.restore_deadline, drop the lowest priority, which the
+	 * planner left the blocks that didn't fit in the deadline. Its blocks are
+	 * still reported done, so that the waiters aren't left waiting.
+	 */
+	if (record->priority == PRIORITY_UNUSED && DeadlinePassed())
+	{
+		if (!rs->past_deadline)
+			ereport(LOG,
+					(errmsg("Block Reader %d: restore deadline passed; skipping the lowest priority blocks",
+							rs->filenum)));
+		rs->past_deadline = true;
+		rs->skip_relation = true;
+		return;
+	}
+
+	rs->skip_relation = !OpenRestoredRelation(rs, record);
+}
+
+/*
+ * Open the relation listed in the given 'r' record, for ReadBlocks() to restore
+ * its blocks; a connected BlockReader locks it, and a connectionless one goes
+ * by its filenode alone. Returns false if the relation is to be skipped: it
+ * is gone, or excluded, or found locked, in which case it is deferred.
+ */
+static bool
+OpenRestoredRelation(ReaderState *rs, const SavefileRecord *record)
+{
+	Oid			relOid;
+	bool		busy;
+
+	if (rs->connectionless)
+	{
+		/*
+		 * Save-files written before the tablespace was recorded can't be
+		 * restored without looking up the relation.
+		 */
+		if (record->tablespace == InvalidOid)
+			ereport(ERROR,
+					(errmsg("save-file \"%s\" lacks tablespace information needed for a connectionless restore",
+							rs->filepath)));
+
+		rs->rnode.spcNode	= record->tablespace;
+		rs->rnode.dbNode	= record->database;
+		rs->rnode.relNode	= record->filenode;
+
+		hibernator_trace("processing filenode %u", record->filenode);
+
+		/*
+		 * Note that nothing stops the relation from being dropped or truncated
+		 * while we read it; see the caveat in README.
+		 */
+		if (SkipRelation(rs->rnode, NULL, rs->dbname))
+			return false;
+
+		rs->smgr = smgropen(rs->rnode, InvalidBackendId);
+		CountRestoredBlocks(rs->rnode, 0);
+
+		TRACE_PG_HIBERNATOR_RELATION_OPEN(rs->rnode.spcNode, rs->rnode.dbNode,
+										  rs->rnode.relNode, InvalidOid);
+		return true;
+	}
+
+	relOid = GetRelOid(record->tablespace, record->filenode);
+
+	hibernator_trace("processing filenode %u, relation %u",
+					 record->filenode, relOid);
+
+	/*
+	 * If the relation has been rewritten/dropped since we saved it, just skip
+	 * it and process the next relation.
+	 */
+	if (relOid == InvalidOid)
+		return false;
+
+	/* Open the relation, unless it's locked; then come back later. */
+	rs->rel = OpenRelation(relOid, record->filenode, &busy);
+	if (rs->rel == NULL)
+	{
+		if (busy)
+			DeferRelation(&rs->deferred, rs->caller_context, &rs->mark,
+						  rs->done_forknum, rs->done_blocknum);
+		return false;
+	}
+
+	if (SkipRelation(rs->rel->rd_node, rs->rel, rs->dbname))
+	{
+		relation_close(rs->rel, AccessShareLock);
+		rs->rel = NULL;
+		return false;
+	}
+
+	RelationOpenSmgr(rs->rel);
+	rs->smgr = rs->rel->rd_smgr;
+	rs->rnode = rs->rel->rd_node;
+	CountRestoredBlocks(rs->rnode, 0);
+
+	TRACE_PG_HIBERNATOR_RELATION_OPEN(rs->rnode.spcNode, rs->rnode.dbNode,
+									  rs->rnode.relNode, relOid);
+	return true;
+}
+
+/*
+ * Don't hold on to the lock on the relation for long; see OpenRelation(). If
+ * someone else has it by the time we want it back, come back for the rest of
+ * the relation later. Returns false if the rest of the relation is to be
+ * skipped for now.
+ */
+static bool
+RelockRestoredRelation(ReaderState *rs, ForkNumber forknum)
+{
+	bool		busy;
+
+	if (rs->rel == NULL || rs->blocks_locked < LOCK_BATCH_BLOCKS)
+		return true;
+
+	rs->blocks_locked = 0;
+	rs->rel = RelockRelation(rs->rel, forknum, &rs->smgr, &rs->nblocks, &busy);
+	if (rs->rel == NULL)
+	{
+		if (busy)
+			DeferRelation(&rs->deferred, rs->caller_context, &rs->mark,
+						  rs->done_forknum, rs->done_blocknum);
+		rs->skip_relation = true;
+		return false;
+	}
+
+	return true;
+}
+
+/* Done with the current relation, if any; count what we restored of it. */
+static void
+CloseRestoredRelation(ReaderState *rs)
+{
+	if (rs->smgr)
+		CountRestoredBlocks(rs->rnode, rs->blocks_loaded);
+	rs->blocks_loaded = 0;
+	rs->blocks_locked = 0;
+
+	if (rs->rel)
+	{
+		relation_close(rs->rel, AccessShareLock);
+		rs->rel = NULL;
+	}
+
+	if (rs->smgr && rs->connectionless)
+		smgrclose(rs->smgr);
+	rs->smgr = NULL;
+
+	rs->nblocks = 0;
+	rs->span.end = InvalidBlockNumber;
+}
+
+/* An 'f' record: note the current size of the fork, if it exists. */
+static void
+ReadForkRecord(ReaderState *rs, const SavefileRecord *record)
+{
+	rs->nblocks = 0;
+	rs->span.end = InvalidBlockNumber;
+
+	if (rs->skip_relation)
+		return;
+
+	hibernator_trace("processing fork %d", record->forknum);
+
+	if (!smgrexists(rs->smgr, record->forknum))
+		rs->skip_fork = true;
+	else
+	{
+		rs->skip_fork = false;
+
+		rs->nblocks = smgrnblocks(rs->smgr, record->forknum);
+	}
+
+	TRACE_PG_HIBERNATOR_FORK_SIZE(record->filenode, record->forknum, rs->nblocks);
+}
+
+/* A 'b' record: restore the block, if it's still there. */
+static void
+ReadBlockRecord(ReaderState *rs, const SavefileRecord *record)
+{
+	BlockNumber	gap;
+
+	if (rs->skip_relation || rs->skip_fork)
+		return;
+
+	if (!RelockRestoredRelation(rs, record->forknum))
+		return;
+
+	/*
+	 * Don't try to read past the file; the file may have been shrunk by a
+	 * vaccum/truncate operation.
+	 */
+	if (record->blocknum >= rs->nblocks)
+	{
+		hibernator_trace("reader %d skipping block filenode %u forknum %d blocknum %u",
+						 rs->filenum, record->filenode, record->forknum, record->blocknum);
+
+		rs->skip_block = true;
+		return;
+	}
+
+	rs->skip_block = false;
+
+	gap = SpanGap(&rs->span, record->blocknum, record->blocknum);
+	if (gap > 0)
+	{
+		ReportGapBlocks(gap);
+		rs->gap_blocks += gap;
+	}
+
+	hibernator_trace("reader %d reading block filenode %u forknum %d blocknum %u",
+					 rs->filenum, record->filenode, record->forknum, record->blocknum);
+
+	RestoreListedBlock(rs, record->forknum, record->blocknum, record->usage);
+}
+
+/*
+ * An 'N' record: restore the range of blocks following the last 'b' record, up
+ * to the end of the fork.
+ */
+static void
+ReadRangeRecord(ReaderState *rs, const SavefileRecord *record)
+{
+	BlockNumber block;
+
+	if (rs->skip_relation || rs->skip_fork || rs->skip_block)
+		return;
+
+	hibernator_trace("reader %d reading range filenode %u forknum %d blocknum %u range %u",
+					 rs->filenum, record->filenode, record->forknum, record->blocknum,
+					 record->range);
+
+	(void) SpanGap(&rs->span, record->blocknum, record->blocknum + record->range - 1);
+
+	for (block = record->blocknum; block < (record->blocknum + record->range); ++block)
+	{
+		if (!RelockRestoredRelation(rs, record->forknum))
+			break;
+
+		/*
+		 * Don't try to read past the file; the file may have been shrunk by a
+		 * vaccum operation.
+		 */
+		if (block >= rs->nblocks)
+		{
+			hibernator_trace("reader %d skipping block range filenode %u forknum %d start %u end %u",
+							 rs->filenum, record->filenode, record->forknum,
+							 block, record->blocknum + record->range - 1);
+
+			break;
+		}
+
+		RestoreListedBlock(rs, record->forknum, block, record->usage);
+	}
+
+	TRACE_PG_HIBERNATOR_RANGE_DONE(record->filenode, record->forknum,
+								   record->blocknum, record->range);
+}
+
+/* An 'S' record: read ahead the span of blocks that starts here. */
+static void
+ReadSpanRecord(ReaderState *rs, const SavefileRecord *record)
+{
+	if (rs->skip_relation || rs->skip_fork || rs->skip_block)
+		return;
+
+	StartSpan(&rs->span, rs->smgr, record->forknum, record->blocknum, record->range,
+			  rs->nblocks);
+}
+
+/*
+ * Restore one block listed in the save-file, unless it was restored before a
+ * restart, and checkpoint our progress every so often.
+ */
+static void
+RestoreListedBlock(ReaderState *rs, ForkNumber forknum, BlockNumber blocknum,
+				   uint8 usage)
+{
+	if (BlockAlreadyRestored(rs->done_forknum, rs->done_blocknum, forknum, blocknum))
+		return;
+
+	if (RestoreBlock(rs->rel, rs->rnode, forknum, blocknum, usage))
+		++rs->blocks_loaded;
+
+	++rs->blocks_restored;
+	++rs->blocks_locked;
+
+	rs->done_forknum	= forknum;
+	rs->done_blocknum	= blocknum;
+
+	/* The progress of a pass over relations we went back for isn't kept. */
+	if (rs->retrying)
+		return;
+
+	rs->progress.forknum	= forknum;
+	rs->progress.blocknum	= blocknum;
+	if (++rs->since_checkpoint >= PROGRESS_CHECKPOINT_BLOCKS)
+	{
+		WriteProgress(rs->filenum, &rs->progress);
+		rs->since_checkpoint = 0;
+	}
+}
+
+/*
+ * Open the save-file, or section of the container, with the given number, and
+ * set up the reader for its records. Also returns the database name, palloc'd,
+ * and whether the records are in the container, and if so, its index entry.
+ *
+ * Returns NULL if the section has already been restored, or if the save-file
+ * doesn't exist and missing_ok is true.
+ */
+static FILE *
+OpenSavefile(int filenum, bool missing_ok, SavefileReader *reader,
+			 char **dbname, bool *in_container, SavefileSection *section)
+{
+	FILE	   *file;
+	const char *filepath;
+
+	*in_container = ContainerExists();
+
+	if (*in_container)
+	{
+		uint32	nsections;
+
+		/* Seek straight to our section, using the container's index. */
+		filepath = CONTAINER_PATH;
+		file = fileOpen(filepath, PG_BINARY_R);
+		nsections = readContainerHeader(file, filepath);
+		readContainerSection(file, filepath, nsections, filenum, section);
+
+		if (section->flags & SECTION_DONE)
+		{
+			fileClose(file, filepath);
+			return NULL;
+		}
+
+		if (fseeko(file, section->offset, SEEK_SET) != 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not seek to section %d of \"%s\": %m",
+							filenum, filepath)));
+	}
+	else
+	{
+		filepath = getSavefileName(filenum);
+
+		if (missing_ok)
+		{
+			file = fopen(filepath, PG_BINARY_R);
+			if (file == NULL)
+			{
+				if (errno == ENOENT)
+					return NULL;
+
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not open \"%s\": %m", filepath)));
+			}
+		}
+		else
+			file = fileOpen(filepath, PG_BINARY_R);
+	}
+
+	/* readDBName() returns a static buffer, which the next call overwrites. */
+	*dbname = pstrdup(readDBName(file, filepath));
+
+	initSavefileReader(reader, file, filepath);
+	if (*in_container)
+		limitSavefileReader(reader, section->offset + section->length);
+
+	return file;
+}
+
+/*
+ * Read the progress made restoring the given save-file before a restart.
+ * Returns false if there's none.
+ */
+static bool
+ReadProgress(int filenum, SavefileProgress *progress)
+{
+	const char *path = getProgressFileName(filenum);
+	FILE	   *file;
+	bool		found;
+
+	file = fopen(path, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno == ENOENT)
+			return false;
+
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open \"%s\": %m", path)));
+	}
+
+	/* A truncated file is as good as none; the caller validates the rest. */
+	found = fileRead(progress, sizeof(*progress), file, true, path);
+
+	fileClose(file, path);
+
+	return found;
+}
+
+/* Flush the file's buffered writes, and fsync it. */
+static void
+SyncFile(FILE *file, const char *path)
+{
+	if (fflush(file) != 0 || pg_fsync(fileno(file)) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file \"%s\": %m", path)));
+}
+
+/*
+ * Durably record the progress made restoring the given save-file, so that a
+ * restore interrupted by a restart doesn't have to start over.
+ */
+static void
+WriteProgress(int filenum, const SavefileProgress *progress)
+{
+	const char *path = getProgressFileName(filenum);
+	char		temp_path[MAXPGPATH];
+	FILE	   *file;
+
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+	file = fileOpen(temp_path, PG_BINARY_W);
+	fileWrite(progress, sizeof(*progress), file, temp_path);
+	SyncFile(file, temp_path);
+	fileClose(file, temp_path);
+
+	if (rename(temp_path, path) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("could not rename file \"%s\" to \"%s\": %m",
+						temp_path, path)));
+
+	fsync_fname(SAVE_LOCATION, true);
+}
+
+static void
+RemoveProgress(int filenum)
+{
+	const char *path = getProgressFileName(filenum);
+
+	if (unlink(path) != 0 && errno != ENOENT)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("error removing file \"%s\" : %m", path)));
+}
+
+/*
+ * Read one block into shared buffers. If we have the relation open, go through
+ * the relcache as usual; otherwise read the block by its RelFileNode.
+ *
+ * Returns true if the block had to be read from disk, rather than being found
+ * in shared buffers already; such buffers are marked for the restore-efficacy
+ * accounting.
+ */
+static bool
+RestoreBlock(Relation rel, RelFileNode rnode, ForkNumber forknum, BlockNumber blocknum,
+			 uint8 saved_usage)
+{
+	Buffer	buf;
+	long	hits_before = pgBufferUsage.shared_blks_hit;
+	bool	loaded;
+	uint16	usage_count = 1;	/* What a freshly read buffer starts with */
+
+	TRACE_PG_HIBERNATOR_BLOCK_READ_START(rnode.spcNode, rnode.dbNode, rnode.relNode,
+										 forknum, blocknum);
+
+	if (rel)
+		buf = ReadBufferExtended(rel, forknum, blocknum, RBM_NORMAL, NULL);
+	else
+		buf = ReadBufferWithoutRelcache(rnode, forknum, blocknum, RBM_NORMAL, NULL);
+
+	/*
+	 * A block someone else read in before us has had its usage count bumped by
+	 * our pin, so the BufferSaver couldn't tell whether it was used after the
+	 * restore; and we didn't restore it anyway.
+	 */
+	loaded = (pgBufferUsage.shared_blks_hit == hits_before);
+
+	/*
+	 * Give the buffer back (some of) the usage count it had when it was saved,
+	 * so that the clock sweep treats it as the hot block it was, rather than as
+	 * a block read once. Buffers that someone else read in have had their usage
+	 * count set by their use since; leave those alone.
+	 */
+	if (loaded && saved_usage > 1 && guc_usage_count_cap > 1)
+	{
+		volatile BufferDesc *bufHdr = &BufferDescriptors[buf - 1];
+		uint16		target;
+
+		target = (uint16) (saved_usage * guc_usage_count_scale + 0.5);
+		target = Min(target, guc_usage_count_cap);
+		target = Min(target, BM_MAX_USAGE_COUNT);
+
+		LockBufHdr(bufHdr);
+		if (bufHdr->usage_count < target)
+			bufHdr->usage_count = target;
+		usage_count = bufHdr->usage_count;
+		UnlockBufHdr(bufHdr);
+	}
+
+	if (loaded && restore_map != NULL && shared_state->accounting)
+	{
+		volatile BufferDesc *bufHdr = &BufferDescriptors[buf - 1];
+		BufferTag	tag;
+		uint32		hashcode;
+
+		INIT_BUFFERTAG(tag, rnode, forknum, blocknum);
+		hashcode = BufTableHashCode(&tag);
+
+		LockBufHdr(bufHdr);
+		restore_tags[buf - 1] = hashcode;
+		restore_map[buf - 1] = (uint8) (usage_count + 1);
+		UnlockBufHdr(bufHdr);
+	}
+
+	ReleaseBuffer(buf);
+
+	if (loaded)
+		++blocksRead;
+
+	if (loaded && guc_drop_os_cache)
+		DropFromOSCache(rnode, forknum, blocknum);
+
+	TRACE_PG_HIBERNATOR_BLOCK_READ_DONE(rnode.spcNode, rnode.dbNode, rnode.relNode,
+										forknum, blocknum);
+
+	return loaded;
+}
+
+/*
+ * Note that the given block, just read into shared buffers, is to be dropped
+ * from the OS cache. The blocks are dropped in batches, one segment file at a
+ * time; see FlushDropBatch().
+ */
+static void
+DropFromOSCache(RelFileNode rnode, ForkNumber forknum, BlockNumber blocknum)
+{
+	BlockNumber	segno = blocknum / RELSEG_SIZE;
+	int			last;
+
+	if (dropBatch.nruns > 0
+		&& (!RelFileNodeEquals(dropBatch.rnode, rnode)
+			|| dropBatch.forknum != forknum
+			|| dropBatch.segno != segno))
+		FlushDropBatch();
+
+	last = dropBatch.nruns - 1;
+
+	if (last >= 0 && dropBatch.start[last] + dropBatch.count[last] == blocknum)
+		++dropBatch.count[last];
+	else
+	{
+		if (dropBatch.nruns == DROP_BATCH_RUNS)
+		{
+			FlushDropBatch();
+			last = -1;
+		}
+
+		dropBatch.rnode		= rnode;
+		dropBatch.forknum	= forknum;
+		dropBatch.segno		= segno;
+		dropBatch.start[last + 1] = blocknum;
+		dropBatch.count[last + 1] = 1;
+		dropBatch.nruns		= last + 2;
+	}
+
+	if (++dropBatch.nblocks >= DROP_BATCH_BLOCKS)
+		FlushDropBatch();
+}
+
+/*
+ * Ask the kernel to drop its copies of the blocks in the batch. Only the runs
+ * of blocks we read are dropped; the gaps between them, read only as part of a
+ * span, may hold blocks that aren't in shared buffers.
+ */
+static void
+FlushDropBatch(void)
+{
+#ifdef USE_POSIX_FADVISE
+	char	   *path;
+	char		segpath[MAXPGPATH];
+	int			fd;
+	int			i;
+
+	if (dropBatch.nruns == 0)
+		return;
+
+	path = relpathperm(dropBatch.rnode, dropBatch.forknum);
+	if (dropBatch.segno == 0)
+		snprintf(segpath, sizeof(segpath), "%s", path);
+	else
+		snprintf(segpath, sizeof(segpath), "%s.%u", path, dropBatch.segno);
+	pfree(path);
+
+	/* If the relation has been dropped meanwhile, there's nothing to drop. */
+	fd = OpenTransientFile(segpath, O_RDONLY | PG_BINARY, 0);
+	if (fd >= 0)
+	{
+		for (i = 0; i < dropBatch.nruns; ++i)
+			(void) posix_fadvise(fd,
+								 (off_t) (dropBatch.start[i] % RELSEG_SIZE) * BLCKSZ,
+								 (off_t) dropBatch.count[i] * BLCKSZ,
+								 POSIX_FADV_DONTNEED);
+
+		CloseTransientFile(fd);
+	}
+#endif
+
+	dropBatch.nruns		= 0;
+	dropBatch.nblocks	= 0;
+}
+
+/*
+ * Begin a span of blocks, and ask the kernel to read it all, gaps included;
+ * the kernel can then read the span in a few large sequential reads. Only the
+ * listed blocks make it to shared buffers, as we read them.
+ *
+ * The writer caps spans at MAX_SPAN_BLOCKS; so do we, in case of a save-file
+ * written before it did, rather than flood the kernel with prefetches. The
+ * blocks listed past the end of a capped span are read as if it had ended.
+ */
+static void
+StartSpan(SpanState *span, SMgrRelation smgr, ForkNumber forknum,
+		  BlockNumber first, BlockNumber count, BlockNumber nblocks)
+{
+	BlockNumber	end = Min(first + Min(count, MAX_SPAN_BLOCKS), nblocks);
+	BlockNumber	block;
+
+	span->end = InvalidBlockNumber;
+
+	/* Don't try to read past the file; it may have been shrunk. */
+	if (first >= end)
+		return;
+
+	for (block = first; block < end; ++block)
+		smgrprefetch(smgr, forknum, block);
+
+	span->end		= end - 1;
+	span->listed	= first;
+}
+
+/*
+ * Note that the listed blocks from first to last are being read. Returns the
+ * number of blocks in the gap between them and the blocks listed before them
+ * in the current span, if any.
+ */
+static BlockNumber
+SpanGap(SpanState *span, BlockNumber first, BlockNumber last)
+{
+	BlockNumber	gap = 0;
+
+	if (span->end == InvalidBlockNumber)
+		return 0;
+
+	if (first > span->end)
+	{
+		span->end = InvalidBlockNumber;
+		return 0;
+	}
+
+	if (first > span->listed)
+		gap = first - span->listed - 1;
+
+	span->listed = last;
+
+	return gap;
+}
+
+/*
+ * ExecutorStart hook: while the restore is in progress, tell the BlockReaders
+ * which relations the queries touch, so that they restore those first.
+ */
+static void
+hibernator_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	/*
+	 * Reading readers_left without the spinlock is good enough for a hint,
+	 * and keeps the queries from contending for it after the restore is over.
+	 * The BlockReaders' own queries don't count.
+	 */
+	if (guc_query_driven
+		&& shared_state != NULL
+		&& shared_state->readers_left > 0
+		&& !IsBackgroundWorker)
+	{
+		ListCell   *lc;
+
+		foreach(lc, queryDesc->plannedstmt->rtable)
+		{
+			RangeTblEntry  *rte = (RangeTblEntry *) lfirst(lc);
+			Relation		rel;
+			List		   *indexes;
+			ListCell	   *lc2;
+
+			if (rte->rtekind != RTE_RELATION)
+				continue;
+
+			/*
+			 * The relation is locked by now: by the parser, or for a cached
+			 * plan, by AcquireExecutorLocks().
+			 */
+			rel = RelationIdGetRelation(rte->relid);
+			if (rel == NULL)
+				continue;
+
+			ReportDemand(rel);
+
+			/*
+			 * Queries generally reach a table through its indexes. Those
+			 * aren't necessarily locked yet; the executor locks them as it
+			 * opens them. So look only at the ones we can lock right away, and
+			 * only once we have, lest one be dropped under us; and let go of
+			 * the lock when done, so as not to hold up DDL on indexes the
+			 * query doesn't use.
+			 */
+			indexes = RelationGetIndexList(rel);
+			foreach(lc2, indexes)
+			{
+				Oid			indexOid = lfirst_oid(lc2);
+				Relation	index;
+
+				if (!ConditionalLockRelationOid(indexOid, AccessShareLock))
+					continue;
+
+				if (SearchSysCacheExists1(RELOID, ObjectIdGetDatum(indexOid)))
+				{
+					index = RelationIdGetRelation(indexOid);
+					if (index != NULL)
+					{
+						ReportDemand(index);
+						RelationClose(index);
+					}
+				}
+
+				UnlockRelationOid(indexOid, AccessShareLock);
+			}
+			list_free(indexes);
+
+			RelationClose(rel);
+		}
+	}
+
+	if (prev_ExecutorStart)
+		prev_ExecutorStart(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+}
+
+/*
+ * Add the relation to the demand queue, unless it is there already; the
+ * BlockReaders don't need to hear about a relation twice.
+ *
+ * The backend remembers where in the queue it last added each relation, so that
+ * it needn't look through the queue again while that entry is in it. Once other
+ * entries have overwritten it, the relation is reported afresh, lest a burst of
+ * queries on other relations keep the BlockReaders from ever hearing about it.
+ */
+static void
+ReportDemand(Relation rel)
+{
+	static HTAB	   *reported = NULL;
+	Oid				relid = RelationGetRelid(rel);
+	bool			found;
+	ReportedEntry  *rep;
+	DemandEntry	   *entry;
+	uint64			head;
+	uint64			pos;
+
+	if (reported == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize		= sizeof(Oid);
+		ctl.entrysize	= sizeof(ReportedEntry);
+		ctl.hash		= oid_hash;
+
+		reported = hash_create("pg_hibernator reported relations", 256, &ctl,
+							   HASH_ELEM | HASH_FUNCTION);
+	}
+
+	rep = (ReportedEntry *) hash_search(reported, &relid, HASH_ENTER, &found);
+
+	SpinLockAcquire(&shared_state->mutex);
+	head = shared_state->demand_head;
+
+	if (found && head - rep->position <= DEMAND_QUEUE_SIZE)
+	{
+		SpinLockRelease(&shared_state->mutex);
+		return;
+	}
+
+	/* Another backend may have added it since */
+	for (pos = head; pos > 0 && head - pos < DEMAND_QUEUE_SIZE; --pos)
+	{
+		entry = &shared_state->demand[(pos - 1) % DEMAND_QUEUE_SIZE];
+		if (entry->database == rel->rd_node.dbNode
+			&& entry->tablespace == rel->rd_node.spcNode
+			&& entry->filenode == rel->rd_node.relNode)
+		{
+			SpinLockRelease(&shared_state->mutex);
+			rep->position = pos - 1;
+			return;
+		}
+	}
+
+	entry = &shared_state->demand[head % DEMAND_QUEUE_SIZE];
+	entry->database		= rel->rd_node.dbNode;
+	entry->tablespace	= rel->rd_node.spcNode;
+	entry->filenode		= rel->rd_node.relNode;
+	++shared_state->demand_head;
+	SpinLockRelease(&shared_state->mutex);
+
+	rep->position = head;
+}
+
+/*
+ * Restore, ahead of their turn, the relations of our database that queries
+ * have touched since we last looked; see hibernator_ExecutorStart().
+ *
+ * The relations listed before the given position in the save-file, which the
+ * main pass has got to already, are left alone, and so are the blocks of the
+ * priorities other than the one being restored. The main pass skips the
+ * relations restored here; see DemandServed().
+ *
+ * A BlockReader that restores many databases serves only the demand for the
+ * one it's restoring at the moment.
+ */
+static void
+ServeDemand(DemandState *demand, int filenum, bool connectionless,
+			const char *dbname, Oid database, off_t position, int priority)
+{
+	DemandEntry	entries[DEMAND_QUEUE_SIZE];
+	int			nentries = 0;
+	int			i;
+	int			j;
+
+	if (shared_state == NULL)
+		return;
+
+	SpinLockAcquire(&shared_state->mutex);
+	if (shared_state->demand_head - demand->cursor > DEMAND_QUEUE_SIZE)
+		demand->cursor = shared_state->demand_head - DEMAND_QUEUE_SIZE;
+	for (; demand->cursor < shared_state->demand_head; ++demand->cursor)
+	{
+		DemandEntry	   *entry = &shared_state->demand[demand->cursor % DEMAND_QUEUE_SIZE];
+
+		if (entry->database == database)
+			entries[nentries++] = *entry;
+	}
+	SpinLockRelease(&shared_state->mutex);
+
+	if (nentries == 0)
+		return;
+
+	if (demand->relations == NULL)
+		IndexSavefile(demand, filenum);
+
+	for (i = 0; i < nentries; ++i)
+	{
+		SavedRelationKey	key;
+		SavedRelation	   *saved;
+
+		key.tablespace	= entries[i].tablespace;
+		key.filenode	= entries[i].filenode;
+
+		saved = (SavedRelation *) hash_search(demand->relations, &key, HASH_FIND, NULL);
+		if (saved == NULL)
+			continue;
+
+		for (j = 0; j < saved->nmarks; ++j)
+		{
+			SavefileProgress   *mark = &saved->marks[j];
+
+			if (mark->position < (uint64) position
+				|| (priority != ALL_PRIORITIES && mark->priority != priority)
+				|| DemandServed(demand, mark->position))
+				continue;
+
+			hibernator_trace("reader %d serving demand for filenode %u",
+							 filenum, key.filenode);
+
+			/* A relation that's locked is left to the main pass. */
+			if (ServeRelation(demand, filenum, connectionless, dbname, mark))
+				hash_search(demand->served, &mark->position, HASH_ENTER, NULL);
+		}
+	}
+}
+
+/* Build the index of the relations in the save-file; see DemandState. */
+static void
+IndexSavefile(DemandState *demand, int filenum)
+{
+	HASHCTL			ctl;
+	char		   *dbname;
+	bool			in_container;
+	SavefileSection	section;
+	SavefileRecord	record;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize		= sizeof(SavedRelationKey);
+	ctl.entrysize	= sizeof(SavedRelation);
+	ctl.hash		= tag_hash;
+
+	demand->relations = hash_create("pg_hibernator saved relations", 1024, &ctl,
+									HASH_ELEM | HASH_FUNCTION);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize		= sizeof(uint64);
+	ctl.entrysize	= sizeof(uint64);
+	ctl.hash		= tag_hash;
+
+	demand->served = hash_create("pg_hibernator served relations", 64, &ctl,
+								 HASH_ELEM | HASH_FUNCTION);
+
+	demand->file = OpenSavefile(filenum, true, &demand->reader, &dbname,
+								&in_container, &section);
+	if (demand->file == NULL)
+		return;
+
+	pfree(dbname);
+
+	while (readSavefileRecord(&demand->reader, &record))
+	{
+		SavedRelationKey	key;
+		SavedRelation	   *saved;
+		bool				found;
+
+		if (record.type != 'r')
+			continue;
+
+		key.tablespace	= record.tablespace;
+		key.filenode	= record.filenode;
+
+		saved = (SavedRelation *) hash_search(demand->relations, &key, HASH_ENTER, &found);
+		if (!found)
+			saved->nmarks = 0;
+
+		if (saved->nmarks < NUM_PRIORITIES)
+			getSavefileProgress(&demand->reader, &saved->marks[saved->nmarks++]);
+	}
+}
+
+/*
+ * Restore the blocks listed for the relation from the given 'r' record up to
+ * the next relation. Returns false, having done nothing, if the relation is
+ * locked by someone else; see OpenRelation().
+ */
+static bool
+ServeRelation(DemandState *demand, int filenum, bool connectionless,
+			  const char *dbname, const SavefileProgress *mark)
+{
+	SavefileRecord	record;
+	Relation		rel = NULL;
+	SMgrRelation	smgr = NULL;
+	RelFileNode		rnode;
+	BlockNumber		nblocks = 0;
+	uint64			blocks_loaded = 0;
+	BlockNumber		blocks_locked = 0;
+	bool			busy;
+	bool			counted;
+	SpanState		span;
+
+	span.end = InvalidBlockNumber;
+
+	if (!resumeSavefileReader(&demand->reader, mark)
+		|| !readSavefileRecord(&demand->reader, &record)
+		|| record.type != 'r')
+		return true;
+
+	rnode.spcNode	= record.tablespace;
+	rnode.dbNode	= record.database;
+	rnode.relNode	= record.filenode;
+
+	if (connectionless)
+		smgr = smgropen(rnode, InvalidBackendId);
+	else
+	{
+		Oid		relOid = GetRelOid(record.tablespace, record.filenode);
+
+		if (relOid != InvalidOid)
+		{
+			rel = OpenRelation(relOid, record.filenode, &busy);
+			if (busy)
+				return false;
+
+			/* The queries' wishes don't override the DBA's. */
+			if (rel && RelationListed(excludeRelations, dbname, rel))
+			{
+				relation_close(rel, AccessShareLock);
+				rel = NULL;
+			}
+
+			if (rel)
+			{
+				RelationOpenSmgr(rel);
+				smgr = rel->rd_smgr;
+				rnode = rel->rd_node;
+			}
+		}
+	}
+
+	counted = (smgr != NULL);
+	if (counted)
+		CountRestoredBlocks(rnode, 0);
+
+	while (readSavefileRecord(&demand->reader, &record))
+	{
+		BlockNumber	block;
+		BlockNumber	count;
+
+		if (record.type == 'f')
+		{
+			nblocks = 0;
+			span.end = InvalidBlockNumber;
+			if (smgr && smgrexists(smgr, record.forknum))
+				nblocks = smgrnblocks(smgr, record.forknum);
+			continue;
+		}
+
+		if (record.type == 'S')
+		{
+			if (smgr)
+				StartSpan(&span, smgr, record.forknum, record.blocknum, record.range, nblocks);
+			continue;
+		}
+
+		if (record.type != 'b' && record.type != 'N')
+			break;
+
+		count = (record.type == 'b' ? 1 : record.range);
+
+		ReportBlocksDone(record.priority, count);
+		ReportGapBlocks(SpanGap(&span, record.blocknum, record.blocknum + count - 1));
+
+		for (block = record.blocknum; block < record.blocknum + count && block < nblocks; ++block)
+		{
+			/*
+			 * As in ReadBlocks(), don't hold on to the lock for long; but if
+			 * we can't have it back, just report the rest of the blocks done,
+			 * since the main pass will skip this relation.
+			 */
+			if (rel && blocks_locked >= LOCK_BATCH_BLOCKS)
+			{
+				blocks_locked = 0;
+				rel = RelockRelation(rel, record.forknum, &smgr, &nblocks, &busy);
+				if (rel == NULL)
+				{
+					smgr = NULL;
+					nblocks = 0;
+					break;
+				}
+			}
+
+			if (RestoreBlock(rel, rnode, record.forknum, block, record.usage))
+				++blocks_loaded;
+			++blocks_locked;
+		}
+	}
+
+	if (counted)
+		CountRestoredBlocks(rnode, blocks_loaded);
+
+	/*
+	 * Don't close the smgr relation of a connectionless restore; the main pass
+	 * may have the same relation open, and smgropen() would have handed it the
+	 * same object.
+	 */
+	if (rel)
+		relation_close(rel, AccessShareLock);
+
+	return true;
+}
+
+/* Has the relation listed at the given position been restored on demand? */
+static bool
+DemandServed(DemandState *demand, uint64 position)
+{
+	if (demand->served == NULL)
+		return false;
+
+	return hash_search(demand->served, &position, HASH_FIND, NULL) != NULL;
+}
+
+static void
+EndDemand(DemandState *demand)
+{
+	if (demand->file != NULL)
+		fileClose(demand->file, demand->reader.path);
+
+	if (demand->relations != NULL)
+		hash_destroy(demand->relations);
+
+	if (demand->served != NULL)
+		hash_destroy(demand->served);
+}
+
+/*
+ * Publish the number of blocks each priority has to restore, and the number of
+ * BlockReaders that will restore them, for the waiters on the restore.
+ */
+static bool
+CountUnrestoredBlock(const SavefileRecord *record, BlockNumber blocknum, void *arg)
+{
+	uint64	   *planned_blocks = (uint64 *) arg;
+
+	++planned_blocks[record->priority];
+
+	return true;
+}
+
+static void
+PlanRestore(List *savefiles, int num_readers)
+{
+	uint64		planned_blocks[NUM_PRIORITIES];
+	ListCell   *lc;
+	int			i;
+	HASH_SEQ_STATUS	status;
+	RelationStats  *stats;
+
+	if (shared_state == NULL)
+		return;
+
+	MemSet(planned_blocks, 0, sizeof(planned_blocks));
+
+	foreach(lc, savefiles)
+		ForEachUnrestoredBlock(lfirst_int(lc), CountUnrestoredBlock, planned_blocks);
+
+	SpinLockAcquire(&shared_state->mutex);
+	for (i = 0; i < NUM_PRIORITIES; ++i)
+	{
+		shared_state->planned_blocks[i]	= planned_blocks[i];
+		shared_state->done_blocks[i]	= 0;
+	}
+	shared_state->gap_blocks	= 0;
+	shared_state->readers_left	= num_readers;
+	shared_state->restore_started = GetCurrentTimestamp();
+	shared_state->read_blocks	= 0;
+	shared_state->readers_paused = 0;
+	shared_state->all_paused	= false;
+	shared_state->paused_seconds = 0;
+	shared_state->planned		= true;
+	SpinLockRelease(&shared_state->mutex);
+
+	/* Start the restore-efficacy accounting afresh; no BlockReader runs yet. */
+	LWLockAcquire(shared_state->stats_lock, LW_EXCLUSIVE);
+	hash_seq_init(&status, relation_stats);
+	while ((stats = (RelationStats *) hash_seq_search(&status)) != NULL)
+		hash_search(relation_stats, &stats->rnode, HASH_REMOVE, NULL);
+	if (restore_map != NULL)
+		MemSet(restore_map, RESTORE_MAP_NONE, NBuffers * sizeof(uint8));
+	shared_state->accounting = (restore_map != NULL && guc_efficacy_window > 0
+								&& num_readers > 0);
+	LWLockRelease(shared_state->stats_lock);
+}
+
+/*
+ * Report the blocks we've got to, and along with them, the blocks read from
+ * disk since the last report; see MeasureRestoreThroughput().
+ */
+static void
+ReportBlocksDone(uint32 priority, uint64 nblocks)
+{
+	if (shared_state == NULL || (nblocks == 0 && blocksRead == 0))
+		return;
+
+	SpinLockAcquire(&shared_state->mutex);
+	shared_state->done_blocks[priority] += nblocks;
+	shared_state->read_blocks += blocksRead;
+	SpinLockRelease(&shared_state->mutex);
+
+	blocksRead = 0;
+}
+
+/*
+ * Note that a BlockReader has started or stopped waiting while paused, or has
+ * exited, and start or stop the clock on the time all the BlockReaders left
+ * are paused. Called with the mutex held.
+ */
+static void
+UpdateAllPaused(TimestampTz now)
+{
+	bool		all_paused;
+	long		secs;
+	int			usecs;
+
+	all_paused = (shared_state->readers_left > 0
+				  && shared_state->readers_paused >= shared_state->readers_left);
+
+	if (all_paused && !shared_state->all_paused)
+		shared_state->all_paused_since = now;
+	else if (!all_paused && shared_state->all_paused)
+	{
+		TimestampDifference(shared_state->all_paused_since, now, &secs, &usecs);
+		shared_state->paused_seconds += secs + usecs / 1000000.0;
+	}
+
+	shared_state->all_paused = all_paused;
+}
+
+static void
+ReportPaused(bool paused)
+{
+	TimestampTz	now = GetCurrentTimestamp();
+
+	if (shared_state == NULL)
+		return;
+
+	SpinLockAcquire(&shared_state->mutex);
+	shared_state->readers_paused += (paused ? 1 : -1);
+	UpdateAllPaused(now);
+	SpinLockRelease(&shared_state->mutex);
+}
+
+static void
+ReportGapBlocks(uint64 nblocks)
+{
+	if (shared_state == NULL || nblocks == 0)
+		return;
+
+	SpinLockAcquire(&shared_state->mutex);
+	shared_state->gap_blocks += nblocks;
+	SpinLockRelease(&shared_state->mutex);
+}
+
+static void
+BlockReaderExit(int code, Datum arg)
+{
+	TimestampTz	now = GetCurrentTimestamp();
+
+	if (shared_state == NULL)
+		return;
+
+	SpinLockAcquire(&shared_state->mutex);
+	shared_state->read_blocks += blocksRead;
+	if (shared_state->readers_left > 0)
+		--shared_state->readers_left;
+	UpdateAllPaused(now);
+	SpinLockRelease(&shared_state->mutex);
+
+	blocksRead = 0;
+}
+
+/*
+ * Fraction of the planned blocks that the BlockReaders are done with, or of
+ * the blocks of the highest priority that has any. Once all the BlockReaders
+ * have exited, the restore is as complete as it'll ever be.
+ */
+static double
+RestoredFraction(bool hottest_tier)
+{
+	uint64		planned = 0;
+	uint64		done = 0;
+	bool		planned_yet;
+	int			readers_left;
+	int			i;
+
+	if (shared_state == NULL)
+		return 0.0;
+
+	SpinLockAcquire(&shared_state->mutex);
+	planned_yet = shared_state->planned;
+	readers_left = shared_state->readers_left;
+	for (i = 0; i < NUM_PRIORITIES; ++i)
+	{
+		if (hottest_tier && planned != 0)
+			break;
+
+		planned	+= shared_state->planned_blocks[i];
+		done	+= shared_state->done_blocks[i];
+	}
+	SpinLockRelease(&shared_state->mutex);
+
+	if (!planned_yet)
+		return 0.0;
+
+	if (readers_left == 0 || planned == 0 || done >= planned)
+		return 1.0;
+
+	return (double) done / planned;
+}
+
+/* Has the restore of any database been cancelled? See pg_hibernator_cancel(). */
+static bool
+RestoreCancelled(void)
+{
+	bool	cancelled;
+	int		i;
+
+	if (shared_state == NULL)
+		return false;
+
+	SpinLockAcquire(&shared_state->mutex);
+	cancelled = ((shared_state->control_flags & CONTROL_CANCEL) != 0);
+	for (i = 0; i < shared_state->ncontrols; ++i)
+		if (shared_state->controls[i].flags & CONTROL_CANCEL)
+			cancelled = true;
+	SpinLockRelease(&shared_state->mutex);
+
+	return cancelled;
+}
+
+/* Have all the BlockReaders exited? */
+static bool
+RestoreFinished(void)
+{
+	bool	finished;
+
+	if (shared_state == NULL)
+		return true;
+
+	SpinLockAcquire(&shared_state->mutex);
+	finished = (shared_state->planned && shared_state->readers_left == 0);
+	SpinLockRelease(&shared_state->mutex);
+
+	return finished;
+}
+
+/*
+ * Add to the number of blocks of the relation the BlockReaders loaded. Called
+ * with zero before loading any, so that the BufferSaver finds the relation's
+ * entry when it samples the buffers.
+ *
+ * If the table of relations is full, the relation's blocks go uncounted.
+ */
+static void
+CountRestoredBlocks(RelFileNode rnode, uint64 nblocks)
+{
+	RelationStats  *stats;
+	bool			found;
+
+	if (relation_stats == NULL || !shared_state->accounting)
+		return;
+
+	LWLockAcquire(shared_state->stats_lock, LW_EXCLUSIVE);
+
+	stats = (RelationStats *) hash_search(relation_stats, &rnode, HASH_ENTER_NULL, &found);
+	if (stats != NULL)
+	{
+		if (!found)
+		{
+			stats->restored	= 0;
+			stats->used		= 0;
+		}
+
+		stats->restored += nblocks;
+	}
+
+	LWLockRelease(shared_state->stats_lock);
+}
+
+/*
+ * Look at each buffer marked in the restore map, and settle the ones that have
+ * been used or evicted since; if final, consider the rest unused, and clear
+ * the map. Returns the number of buffers still to be settled.
+ *
+ * A usage count greater than the lowest one seen since the BlockReader left
+ * the buffer means it has been pinned since. The mark follows the clock sweep
+ * down, so that a use after the sweep has passed is still seen; only a use and
+ * a decrement that fall between two samples cancel out.
+ */
+static int
+SampleRestoredBuffers(bool final)
+{
+	int						i;
+	int						end;
+	int						pending = 0;
+	volatile BufferDesc	   *bufHdr;
+
+	for (i = 0, bufHdr = BufferDescriptors; i < NBuffers; )
+	{
+		end = Min(i + SAMPLE_CHUNK_BUFFERS, NBuffers);
+
+		LWLockAcquire(shared_state->stats_lock, LW_EXCLUSIVE);
+
+		for (; i < end; ++i, ++bufHdr)
+		{
+			bool			settled = true;
+			bool			used = false;
+			RelFileNode		rnode;
+			RelationStats  *stats;
+
+			/* A mark made meanwhile will be there next time. */
+			if (restore_map[i] == RESTORE_MAP_NONE)
+				continue;
+
+			LockBufHdr(bufHdr);
+
+			/* Otherwise it has been evicted, or reused for another block. */
+			if ((bufHdr->flags & BM_VALID)
+				&& BufTableHashCode((BufferTag *) &bufHdr->tag) == restore_tags[i])
+			{
+				rnode = bufHdr->tag.rnode;
+
+				if (bufHdr->usage_count + 1 > restore_map[i])
+					used = true;
+				else if (!final)
+				{
+					settled = false;
+					restore_map[i] = (uint8) (bufHdr->usage_count + 1);
+				}
+			}
+
+			if (settled)
+				restore_map[i] = RESTORE_MAP_NONE;
+			UnlockBufHdr(bufHdr);
+
+			if (!settled)
+			{
+				++pending;
+				continue;
+			}
+
+			if (used)
+			{
+				stats = (RelationStats *) hash_search(relation_stats, &rnode,
+													  HASH_FIND, NULL);
+				if (stats != NULL)
+					++stats->used;
+			}
+		}
+
+		if (final && i == NBuffers)
+			shared_state->accounting = false;
+
+		LWLockRelease(shared_state->stats_lock);
+	}
+
+	return pending;
+}
+
+/* Log the overall outcome of the restore-efficacy accounting. */
+static void
+ReportRestoreEfficacy(void)
+{
+	HASH_SEQ_STATUS	status;
+	RelationStats  *stats;
+	uint64			restored = 0;
+	uint64			used = 0;
+
+	LWLockAcquire(shared_state->stats_lock, LW_SHARED);
+
+	hash_seq_init(&status, relation_stats);
+	while ((stats = (RelationStats *) hash_seq_search(&status)) != NULL)
+	{
+		restored	+= stats->restored;
+		used		+= stats->used;
+	}
+
+	LWLockRelease(shared_state->stats_lock);
+
+	ereport(LOG,
+			(errmsg("Buffer Saver: %lu of %lu restored blocks were used before eviction",
+					(unsigned long) used, (unsigned long) restored)));
+}
+
+/*
+ * Read the history of the past restores into a new hash table of
+ * RestoreHistory entries, and return it along with its generation. A missing
+ * or damaged file is as good as an empty history.
+ */
+static HTAB *
+LoadRestoreHistory(uint32 *generation)
+{
+	HASHCTL			ctl;
+	HTAB		   *history;
+	FILE		   *file;
+	RestoreHistoryHeader header;
+	RestoreHistory	entry;
+	uint32			i;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize		= sizeof(RelFileNode);
+	ctl.entrysize	= sizeof(RestoreHistory);
+	ctl.hash		= tag_hash;
+
+	history = hash_create("pg_hibernator restore history", 1024, &ctl,
+						  HASH_ELEM | HASH_FUNCTION);
+	*generation = 0;
+
+	file = fopen(HISTORY_PATH, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open \"%s\": %m", HISTORY_PATH)));
+		return history;
+	}
+
+	if (!fileRead(&header, sizeof(header), file, true, HISTORY_PATH)
+		|| header.magic != HISTORY_MAGIC
+		|| header.version != HISTORY_VERSION)
+	{
+		ereport(LOG,
+				(errmsg("ignoring invalid restore history file \"%s\"", HISTORY_PATH)));
+		fileClose(file, HISTORY_PATH);
+		return history;
+	}
+
+	for (i = 0; i < header.nentries; ++i)
+	{
+		RestoreHistory *found;
+
+		if (!fileRead(&entry, sizeof(entry), file, true, HISTORY_PATH))
+			break;
+
+		found = (RestoreHistory *) hash_search(history, &entry.rnode, HASH_ENTER, NULL);
+		*found = entry;
+	}
+
+	fileClose(file, HISTORY_PATH);
+
+	*generation = header.generation;
+
+	return history;
+}
+
+/*
+ * Fold the outcome of the restore-efficacy accounting into the history, and
+ * forget the relations not restored in a while.
+ */
+static void
+UpdateRestoreHistory(void)
+{
+	HTAB		   *history;
+	uint32			generation;
+	HASH_SEQ_STATUS	status;
+	RelationStats  *stats;
+	RestoreHistory *entry;
+	RestoreHistoryHeader header;
+	char			temp_path[MAXPGPATH];
+	FILE		   *file;
+
+	history = LoadRestoreHistory(&generation);
+	++generation;
+
+	LWLockAcquire(shared_state->stats_lock, LW_SHARED);
+
+	hash_seq_init(&status, relation_stats);
+	while ((stats = (RelationStats *) hash_seq_search(&status)) != NULL)
+	{
+		double	used_fraction;
+		bool	found;
+
+		if (stats->restored < HISTORY_MIN_BLOCKS)
+			continue;
+
+		used_fraction = (double) stats->used / stats->restored;
+
+		entry = (RestoreHistory *) hash_search(history, &stats->rnode, HASH_ENTER, &found);
+		if (!found)
+		{
+			entry->observations		= 0;
+			entry->used_fraction	= used_fraction;
+		}
+
+		/* Weigh the latest restore as much as all the earlier ones. */
+		entry->used_fraction	= (entry->used_fraction + used_fraction) / 2;
+		entry->generation		= generation;
+		++entry->observations;
+	}
+
+	LWLockRelease(shared_state->stats_lock);
+
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", HISTORY_PATH);
+
+	header.magic		= HISTORY_MAGIC;
+	header.version		= HISTORY_VERSION;
+	header.generation	= generation;
+	header.nentries		= 0;
+
+	file = fileOpen(temp_path, PG_BINARY_W);
+	fileWrite(&header, sizeof(header), file, temp_path);
+
+	hash_seq_init(&status, history);
+	while ((entry = (RestoreHistory *) hash_seq_search(&status)) != NULL)
+	{
+		if (generation - entry->generation > HISTORY_MAX_AGE)
+			continue;
+
+		fileWrite(entry, sizeof(*entry), file, temp_path);
+		++header.nentries;
+	}
+
+	/* Now that we know the number of entries, fill it in. */
+	if (fseeko(file, 0, SEEK_SET) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not seek in file \"%s\": %m", temp_path)));
+	fileWrite(&header, sizeof(header), file, temp_path);
+
+	SyncFile(file, temp_path);
+	fileClose(file, temp_path);
+
+	if (rename(temp_path, HISTORY_PATH) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("could not rename file \"%s\" to \"%s\": %m",
+						temp_path, HISTORY_PATH)));
+
+	fsync_fname(SAVE_LOCATION, true);
+
+	ereport(DEBUG1,
+			(errmsg("Buffer Saver: restore history has %u relations", header.nentries)));
+
+	hash_destroy(history);
+}
+
+/*
+ * Did the relation's restored blocks mostly go unused in the past restores?
+ * If chronically, in enough of them to stop restoring the relation.
+ */
+static bool
+MostlyUnused(HTAB *history, RelFileNode rnode, bool chronically)
+{
+	RestoreHistory *entry;
+
+	entry = (RestoreHistory *) hash_search(history, &rnode, HASH_FIND, NULL);
+
+	if (entry == NULL || entry->used_fraction >= guc_unused_fraction)
+		return false;
+
+	return !chronically || entry->observations >= HISTORY_MIN_OBSERVATIONS;
+}
+
+/*
+ * The class of the given buffer, in a run of the given number of blocks, for
+ * PlanToDeadline().
+ */
+static int
+PlanClass(const SavedBuffer *buf, int runlen)
+{
+	int			level = 0;
+
+	while (level < PLAN_RUN_LEVELS - 1 && (runlen >> (level + 1)) > 0)
+		++level;
+
+	return (buf->priority * PLAN_USAGE_LEVELS + Min(buf->usage, BM_MAX_USAGE_COUNT))
+		* PLAN_RUN_LEVELS + level;
+}
+
+/* Order of classes for PlanToDeadline(), most valuable first */
+static double planScores[PLAN_CLASSES];
+
+static int
+PlanClassCmp(const void *a, const void *b)
+{
+	double		sa = planScores[*(const int *) a];
+	double		sb = planScores[*(const int *) b];
+
+	if (sa > sb)
+		return -1;
+	if (sa < sb)
+		return 1;
+	return *(const int *) a - *(const int *) b;
+}
+
+/*
+ * If the restore of the sorted list of buffers can't be done within
+ * pg_hibernator.restore_deadline at the throughput of the last restore, keep
+ * the most valuable blocks that fit, and move the rest to the lowest priority;
+ * the BlockReaders restore those last, and drop them once the deadline
+ * passes. Returns true if any buffers were moved, and so need sorting again.
+ *
+ * The blocks are ranked by class (see PlanClass()), and not individually, so
+ * that this takes no memory to speak of; of the class that straddles the
+ * budget, the blocks that come first in the list are kept.
+ */
+static bool
+PlanToDeadline(SavedBuffer *saved_buffers, int num_buffers)
+{
+	uint64		counts[PLAN_CLASSES];
+	int			order[PLAN_CLASSES];
+	uint64		keep[PLAN_CLASSES];
+	uint64		budget;
+	uint64		planned = 0;
+	int			moved = 0;
+	int			i;
+	int			j;
+	int			runlen = 0;
+
+	if (guc_restore_deadline == 0 || restoreThroughput <= 0)
+		return false;
+
+	budget = (uint64) (guc_restore_deadline * restoreThroughput);
+
+	/* The buffers already at the lowest priority are restored last anyway. */
+	for (i = 0; i < num_buffers; ++i)
+		if (saved_buffers[i].priority != PRIORITY_UNUSED)
+			++planned;
+
+	if (planned <= budget)
+		return false;
+
+	MemSet(counts, 0, sizeof(counts));
+
+	for (i = 0; i < PLAN_CLASSES; ++i)
+	{
+		uint32		priority = i / (PLAN_USAGE_LEVELS * PLAN_RUN_LEVELS);
+		int			usage = (i / PLAN_RUN_LEVELS) % PLAN_USAGE_LEVELS;
+		int			level = i % PLAN_RUN_LEVELS;
+
+		planScores[i] = planWeights[priority] * (1 + usage)
+			/ (PLAN_SEQUENTIAL_COST + (1 - PLAN_SEQUENTIAL_COST) / (1 << level));
+		order[i] = i;
+	}
+
+	/*
+	 * Count the blocks of each class. A run is a sequence of consecutive
+	 * blocks of a fork, at one priority.
+	 */
+	for (i = 0; i < num_buffers; i += runlen)
+	{
+		for (runlen = 1; i + runlen < num_buffers; ++runlen)
+		{
+			SavedBuffer *a = &saved_buffers[i + runlen - 1];
+			SavedBuffer *b = &saved_buffers[i + runlen];
+
+			if (a->database != b->database || a->priority != b->priority
+				|| a->tablespace != b->tablespace || a->filenode != b->filenode
+				|| a->forknum != b->forknum || a->blocknum + 1 != b->blocknum)
+				break;
+		}
+
+		for (j = i; j < i + runlen; ++j)
+			if (saved_buffers[j].priority != PRIORITY_UNUSED)
+				++counts[PlanClass(&saved_buffers[j], runlen)];
+	}
+
+	/* Hand out the budget to the classes, most valuable first. */
+	qsort(order, PLAN_CLASSES, sizeof(int), PlanClassCmp);
+
+	for (i = 0; i < PLAN_CLASSES; ++i)
+	{
+		keep[order[i]] = Min(counts[order[i]], budget);
+		budget -= keep[order[i]];
+	}
+
+	/* Move the rest. */
+	for (i = 0; i < num_buffers; i += runlen)
+	{
+		for (runlen = 1; i + runlen < num_buffers; ++runlen)
+		{
+			SavedBuffer *a = &saved_buffers[i + runlen - 1];
+			SavedBuffer *b = &saved_buffers[i + runlen];
+
+			if (a->database != b->database || a->priority != b->priority
+				|| a->tablespace != b->tablespace || a->filenode != b->filenode
+				|| a->forknum != b->forknum || a->blocknum + 1 != b->blocknum)
+				break;
+		}
+
+		for (j = i; j < i + runlen; ++j)
+		{
+			int			planclass;
+
+			if (saved_buffers[j].priority == PRIORITY_UNUSED)
+				continue;
+
+			planclass = PlanClass(&saved_buffers[j], runlen);
+			if (keep[planclass] > 0)
+				--keep[planclass];
+			else
+			{
+				saved_buffers[j].priority = PRIORITY_UNUSED;
+				++moved;
+			}
+		}
+	}
+
+	ereport(LOG,
+			(errmsg("Buffer Saver: %lu of %lu blocks fit the restore deadline at %.0f blocks/s; the rest are restored last",
+					(unsigned long) (planned - moved), (unsigned long) planned,
+					restoreThroughput)));
+
+	return moved > 0;
+}
+
+/* Read the throughput of the last restore, if it's been measured. */
+static void
+LoadRestoreThroughput(void)
+{
+	RestoreThroughput	throughput;
+	FILE			   *file;
+
+	file = fopen(THROUGHPUT_PATH, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open \"%s\": %m", THROUGHPUT_PATH)));
+		return;
+	}
+
+	if (fileRead(&throughput, sizeof(throughput), file, true, THROUGHPUT_PATH)
+		&& throughput.magic == THROUGHPUT_MAGIC
+		&& throughput.version == THROUGHPUT_VERSION
+		&& throughput.blocks_per_second > 0)
+		restoreThroughput = throughput.blocks_per_second;
+	else
+		ereport(LOG,
+				(errmsg("ignoring invalid restore throughput file \"%s\"", THROUGHPUT_PATH)));
+
+	fileClose(file, THROUGHPUT_PATH);
+}
+
+/* Keep the throughput we know of for the next restore; see PlanToDeadline(). */
+static void
+SaveRestoreThroughput(void)
+{
+	RestoreThroughput	throughput;
+	char				temp_path[MAXPGPATH];
+	FILE			   *file;
+
+	if (restoreThroughput <= 0)
+		return;
+
+	throughput.magic				= THROUGHPUT_MAGIC;
+	throughput.version				= THROUGHPUT_VERSION;
+	throughput.blocks_per_second	= restoreThroughput;
+
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", THROUGHPUT_PATH);
+
+	file = fileOpen(temp_path, PG_BINARY_W);
+	fileWrite(&throughput, sizeof(throughput), file, temp_path);
+	SyncFile(file, temp_path);
+	fileClose(file, temp_path);
+
+	if (rename(temp_path, THROUGHPUT_PATH) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("could not rename file \"%s\" to \"%s\": %m",
+						temp_path, THROUGHPUT_PATH)));
+
+	fsync_fname(SAVE_LOCATION, true);
+}
+
+/*
+ * Measure the throughput of the restore in progress, once it's gone on long
+ * enough to tell, and until it's done; an interrupted restore is measured for
+ * as long as it went on.
+ *
+ * Only the blocks the BlockReaders actually read from disk count, and only the
+ * time they weren't all paused; the blocks they skipped, deferred, or found
+ * gone or in shared buffers already took next to no time.
+ */
+static void
+MeasureRestoreThroughput(void)
+{
+	TimestampTz	started;
+	TimestampTz	now = GetCurrentTimestamp();
+	uint64		done;
+	bool		finished;
+	long		secs;
+	int			usecs;
+	double		elapsed;
+
+	if (shared_state == NULL || throughputMeasured)
+		return;
+
+	SpinLockAcquire(&shared_state->mutex);
+	finished = (shared_state->planned && shared_state->readers_left == 0);
+	started = shared_state->restore_started;
+	done = shared_state->read_blocks;
+	elapsed = -shared_state->paused_seconds;
+	if (shared_state->all_paused)
+	{
+		/* The pause in progress, so far */
+		TimestampDifference(shared_state->all_paused_since, now, &secs, &usecs);
+		elapsed -= secs + usecs / 1000000.0;
+	}
+	SpinLockRelease(&shared_state->mutex);
+
+	if (finished)
+		throughputMeasured = true;
+
+	TimestampDifference(started, now, &secs, &usecs);
+	elapsed += secs + usecs / 1000000.0;
+
+	if (done < THROUGHPUT_MIN_BLOCKS || elapsed <= 0
+		|| (!finished && elapsed < THROUGHPUT_MIN_SECONDS))
+		return;
+
+	restoreThroughput = done / elapsed;
+}
+
+/* Has pg_hibernator.restore_deadline passed since the restore started? */
+static bool
+DeadlinePassed(void)
+{
+	TimestampTz	started;
+
+	if (guc_restore_deadline == 0 || shared_state == NULL)
+		return false;
+
+	SpinLockAcquire(&shared_state->mutex);
+	started = shared_state->restore_started;
+	SpinLockRelease(&shared_state->mutex);
+
+	return TimestampDifferenceExceeds(started, GetCurrentTimestamp(),
+									  guc_restore_deadline * 1000);
+}
+
+/*
+ * Move the blocks of relations that mostly went unused after the past restores
+ * to the lowest priority, so that they're restored after everything else; see
+ * also SkipRelation().
+ */
+static void
+DownrankUnusedRelations(SavedBuffer *saved_buffers, int num_buffers)
+{
+	HTAB	   *history;
+	uint32		generation;
+	int			i;
+	int			downranked = 0;
+	RelFileNode	rnode;
+	bool		unused = false;
+
+	if (guc_unused_fraction <= 0.0)
+		return;
+
+	rnode.spcNode	= InvalidOid;
+	rnode.dbNode	= InvalidOid;
+	rnode.relNode	= InvalidOid;
+
+	history = LoadRestoreHistory(&generation);
+
+	if (hash_get_num_entries(history) > 0)
+	{
+		for (i = 0; i < num_buffers; ++i)
+		{
+			SavedBuffer *buf = &saved_buffers[i];
+
+			/* Consecutive buffers often belong to the same relation. */
+			if (i == 0
+				|| buf->database != rnode.dbNode
+				|| buf->tablespace != rnode.spcNode
+				|| buf->filenode != rnode.relNode)
+			{
+				rnode.spcNode	= buf->tablespace;
+				rnode.dbNode	= buf->database;
+				rnode.relNode	= buf->filenode;
+
+				unused = MostlyUnused(history, rnode, false);
+			}
+
+			if (unused)
+			{
+				buf->priority = PRIORITY_UNUSED;
+				++downranked;
+			}
+		}
+	}
+
+	hash_destroy(history);
+
+	if (downranked > 0)
+		ereport(LOG,
+				(errmsg("Buffer Saver: %d blocks of relations seldom used after past restores will be restored last",
+						downranked)));
+}
+
+/*
+ * Split the value of pg_hibernator.include_relations or exclude_relations, or
+ * of one of the lists of databases, into a list of names; each is a list of the
+ * parts of a qualified name. The parts follow the rules for identifiers:
+ * unquoted ones are downcased, and quoted ones may hold commas and dots. An
+ * invalid value is treated as empty.
+ *
+ * The list is split on commas here rather than by SplitIdentifierString(),
+ * which would truncate each whole qualified name to NAMEDATALEN.
+ */
+static List *
+ParseRelationList(char *value, const char *name)
+{
+	char	   *element = pstrdup(value);
+	char	   *p;
+	bool		quoted = false;
+	bool		last = false;
+	List	   *names = NIL;
+	List	   *parts;
+
+	for (p = element; !last; ++p)
+	{
+		/* A doubled quote inside quotes leaves us inside them, as it should. */
+		if (*p == '"')
+			quoted = !quoted;
+
+		if (*p != '\0' && (*p != ',' || quoted))
+			continue;
+
+		last = (*p == '\0');
+		*p = '\0';
+
+		/* An empty value is an empty list, but an empty element is invalid. */
+		if (!SplitIdentifierString(element, '.', &parts)
+			|| (parts == NIL && !(last && names == NIL)))
+		{
+			ereport(WARNING,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid list syntax in parameter \"%s\"", name)));
+			return NIL;
+		}
+
+		if (parts != NIL)
+			names = lappend(names, parts);
+		element = p + 1;
+	}
+
+	return names;
+}
+
+/*
+ * Is the relation in the list, by database.schema.relation or by
+ * schema.relation?
+ */
+static bool
+RelationListed(List *names, const char *dbname, Relation rel)
+{
+	char	   *nspname;
+	bool		listed = false;
+	ListCell   *lc;
+
+	if (names == NIL)
+		return false;
+
+	nspname = get_namespace_name(RelationGetNamespace(rel));
+
+	foreach(lc, names)
+	{
+		List	   *parts = (List *) lfirst(lc);
+		int			nparts = list_length(parts);
+
+		if (nparts < 2 || nparts > 3)
+			continue;
+
+		if (nparts == 3 && strcmp((const char *) linitial(parts), dbname) != 0)
+			continue;
+
+		if (strcmp((const char *) list_nth(parts, nparts - 2), nspname) == 0
+			&& strcmp((const char *) llast(parts), RelationGetRelationName(rel)) == 0)
+		{
+			listed = true;
+			break;
+		}
+	}
+
+	pfree(nspname);
+
+	return listed;
+}
+
+/*
+ * Should the BlockReader skip the relation? It does if the relation is in
+ * pg_hibernator.exclude_relations, or if its restored blocks went unused in
+ * enough of the past restores, unless it's in pg_hibernator.include_relations.
+ *
+ * The relation's name is known only if we have it open; a connectionless
+ * restore goes by the history alone.
+ */
+static bool
+SkipRelation(RelFileNode rnode, Relation rel, const char *dbname)
+{
+	if (rel != NULL)
+	{
+		if (RelationListed(excludeRelations, dbname, rel))
+		{
+			ereport(DEBUG1,
+					(errmsg("Block Reader: skipping excluded relation \"%s\"",
+							RelationGetRelationName(rel))));
+			return true;
+		}
+
+		if (RelationListed(includeRelations, dbname, rel))
+			return false;
+	}
+
+	if (restoreHistory != NULL && MostlyUnused(restoreHistory, rnode, true))
+	{
+		ereport(DEBUG1,
+				(errmsg("Block Reader: skipping relfilenode %u, seldom used after past restores",
+						rnode.relNode)));
+		return true;
+	}
+
+	return false;
+}
+
+/* Create or remove the ready file, for external tools to watch. */
+static void
+UpdateReadyFile(bool ready)
+{
+	if (ready)
+	{
+		FILE   *file = fileOpen(READY_FILE_PATH, PG_BINARY_W);
+
+		fileClose(file, READY_FILE_PATH);
+
+		ereport(LOG,
+				(errmsg("Buffer Saver: restore is ready")));
+	}
+	else if (unlink(READY_FILE_PATH) != 0 && errno != ENOENT)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("error removing file \"%s\" : %m", READY_FILE_PATH)));
+}
+
+/*
+ * Number of blocks in the range that are yet to be restored, given the last
+ * block restored before a restart; see BlockAlreadyRestored().
+ */
+static BlockNumber
+CountBlocksToRestore(ForkNumber done_forknum, BlockNumber done_blocknum,
+					 ForkNumber forknum, BlockNumber first, BlockNumber count)
+{
+	BlockNumber	last = first + count - 1;
+
+	if (done_blocknum == InvalidBlockNumber || forknum > done_forknum)
+		return count;
+
+	if (forknum < done_forknum || last <= done_blocknum)
+		return 0;
+
+	if (first > done_blocknum)
+		return count;
+
+	return last - done_blocknum;
+}
+
+/*
+ * SQL function pg_hibernator_wait(target_fraction, timeout, hottest_tier)
+ *
+ * Wait until the given fraction of the blocks (or of the blocks of the hottest
+ * tier) has been restored, or until timeout seconds have passed. A NULL timeout
+ * waits forever. Returns true if the target was reached.
+ */
+PG_FUNCTION_INFO_V1(pg_hibernator_wait);
+
+Datum
+pg_hibernator_wait(PG_FUNCTION_ARGS)
+{
+	double		target_fraction;
+	bool		hottest_tier;
+	int			timeout_ms = -1;
+	TimestampTz	start = GetCurrentTimestamp();
+
+	if (shared_state == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_hibernator must be loaded via shared_preload_libraries")));
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(2))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("target_fraction and hottest_tier must not be null")));
+
+	target_fraction = PG_GETARG_FLOAT8(0);
+	hottest_tier = PG_GETARG_BOOL(2);
+
+	if (target_fraction < 0.0 || target_fraction > 1.0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("target_fraction must be between 0 and 1")));
+
+	if (!PG_ARGISNULL(1))
+	{
+		double	timeout = PG_GETARG_FLOAT8(1);
+
+		if (timeout < 0.0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("timeout must not be negative")));
+
+		timeout_ms = (int) Min(timeout * 1000.0, (double) INT_MAX);
+	}
+
+	for (;;)
+	{
+		int		rc;
+
+		if (RestoredFraction(hottest_tier) >= target_fraction)
+			PG_RETURN_BOOL(true);
+
+		if (timeout_ms >= 0
+			&& TimestampDifferenceExceeds(start, GetCurrentTimestamp(), timeout_ms))
+			PG_RETURN_BOOL(false);
+
+		/* The BlockReaders don't wake us up, so poll. */
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   100L);
+		ResetLatch(&MyProc->procLatch);
+
+		/* emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Set and clear the given controls for the database named by the first
+ * argument of the SQL function, or for all databases if it's NULL. The
+ * controls set for all databases replace those set for any one database.
+ */
+static void
+SetRestoreControl(FunctionCallInfo fcinfo, uint32 set_flags, uint32 clear_flags)
+{
+	Oid			database = InvalidOid;
+	int			i;
+
+	if (shared_state == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_hibernator must be loaded via shared_preload_libraries")));
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to control the restore")));
+
+	if (!PG_ARGISNULL(0))
+		database = get_database_oid(NameStr(*PG_GETARG_NAME(0)), false);
+
+	SpinLockAcquire(&shared_state->mutex);
+
+	if (database == InvalidOid)
+	{
+		shared_state->control_flags |= set_flags;
+		shared_state->control_flags &= ~clear_flags;
+
+		for (i = 0; i < shared_state->ncontrols; ++i)
+			shared_state->controls[i].flags &= ~(set_flags | clear_flags);
+	}
+	else
+	{
+		for (i = 0; i < shared_state->ncontrols; ++i)
+		{
+			if (shared_state->controls[i].database == database)
+				break;
+		}
+
+		if (i == shared_state->ncontrols)
+		{
+			if (i >= MAX_RESTORE_CONTROLS)
+			{
+				SpinLockRelease(&shared_state->mutex);
+				ereport(ERROR,
+						(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+						 errmsg("cannot control the restore of more than %d databases separately",
+								MAX_RESTORE_CONTROLS)));
+			}
+
+			shared_state->controls[i].database	= database;
+			shared_state->controls[i].flags		= 0;
+			++shared_state->ncontrols;
+		}
+
+		shared_state->controls[i].flags |= set_flags;
+		shared_state->controls[i].flags &= ~clear_flags;
+	}
+
+	SpinLockRelease(&shared_state->mutex);
+}
+
+/*
+ * SQL functions pg_hibernator_pause(), pg_hibernator_resume() and
+ * pg_hibernator_cancel()
+ *
+ * Pause, resume or cancel the restore of the given database, or of all of them
+ * if NULL. The BlockReaders notice within a relation or so; see
+ * WaitWhilePaused(). A cancelled BlockReader exits, keeping what it didn't
+ * restore for the next startup.
+ */
+PG_FUNCTION_INFO_V1(pg_hibernator_pause);
+
+Datum
+pg_hibernator_pause(PG_FUNCTION_ARGS)
+{
+	SetRestoreControl(fcinfo, CONTROL_PAUSE, CONTROL_RESUMED);
+
+	PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(pg_hibernator_resume);
+
+Datum
+pg_hibernator_resume(PG_FUNCTION_ARGS)
+{
+	/* A database resumed on its own stays resumed when all are paused. */
+	if (PG_ARGISNULL(0))
+		SetRestoreControl(fcinfo, 0, CONTROL_PAUSE | CONTROL_RESUMED);
+	else
+		SetRestoreControl(fcinfo, CONTROL_RESUMED, CONTROL_PAUSE);
+
+	PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(pg_hibernator_cancel);
+
+Datum
+pg_hibernator_cancel(PG_FUNCTION_ARGS)
+{
+	SetRestoreControl(fcinfo, CONTROL_CANCEL, 0);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * SQL function pg_hibernator_set_max_readers()
+ *
+ * Set the number of BlockReaders the BufferSaver runs at once, from now on;
+ * zero goes back to what pg_hibernator.parallel says.
+ */
+PG_FUNCTION_INFO_V1(pg_hibernator_set_max_readers);
+
+Datum
+pg_hibernator_set_max_readers(PG_FUNCTION_ARGS)
+{
+	int32		max_readers = PG_GETARG_INT32(0);
+
+	if (shared_state == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_hibernator must be loaded via shared_preload_libraries")));
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to control the restore")));
+
+	if (max_readers < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of BlockReaders must not be negative")));
+
+	SpinLockAcquire(&shared_state->mutex);
+	shared_state->max_readers = max_readers;
+	SpinLockRelease(&shared_state->mutex);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * SQL function pg_hibernator_progress()
+ *
+ * Returns the counts behind pg_hibernator_wait(), summed over the priorities,
+ * along with the number of blocks read only to bridge gaps, and the number of
+ * BlockReaders yet to exit.
+ */
+PG_FUNCTION_INFO_V1(pg_hibernator_progress);
+
+Datum
+pg_hibernator_progress(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[4];
+	bool		nulls[4];
+	uint64		planned = 0;
+	uint64		done = 0;
+	uint64		gap_blocks;
+	int			readers_left;
+	int			i;
+
+	if (shared_state == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_hibernator must be loaded via shared_preload_libraries")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	SpinLockAcquire(&shared_state->mutex);
+	for (i = 0; i < NUM_PRIORITIES; ++i)
+	{
+		planned	+= shared_state->planned_blocks[i];
+		done	+= shared_state->done_blocks[i];
+	}
+	gap_blocks = shared_state->gap_blocks;
+	readers_left = shared_state->readers_left;
+	SpinLockRelease(&shared_state->mutex);
+
+	MemSet(nulls, 0, sizeof(nulls));
+
+	values[0] = Int64GetDatum((int64) planned);
+	values[1] = Int64GetDatum((int64) done);
+	values[2] = Int64GetDatum((int64) gap_blocks);
+	values[3] = Int32GetDatum(readers_left);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * SQL function pg_hibernator_restore_stats()
+ *
+ * Returns a row for each relation the BlockReaders restored blocks of, with
+ * the number of blocks they loaded, and the number of those that were used
+ * before being evicted; see SampleRestoredBuffers().
+ */
+PG_FUNCTION_INFO_V1(pg_hibernator_restore_stats);
+
+Datum
+pg_hibernator_restore_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc		tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext	per_query_ctx;
+	MemoryContext	oldcontext;
+	HASH_SEQ_STATUS	status;
+	RelationStats  *stats;
+
+	if (relation_stats == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_hibernator must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(shared_state->stats_lock, LW_SHARED);
+
+	hash_seq_init(&status, relation_stats);
+	while ((stats = (RelationStats *) hash_seq_search(&status)) != NULL)
+	{
+		Datum	values[5];
+		bool	nulls[5];
+
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[0] = ObjectIdGetDatum(stats->rnode.dbNode);
+		values[1] = ObjectIdGetDatum(stats->rnode.spcNode);
+		values[2] = ObjectIdGetDatum(stats->rnode.relNode);
+		values[3] = Int64GetDatum((int64) stats->restored);
+		values[4] = Int64GetDatum((int64) stats->used);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(shared_state->stats_lock);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Count a block in its fork's row of pg_hibernator_plan().
+ *
+ * A block past the end of the fork has gone since the save, perhaps to a
+ * truncation, and won't be read. We can't look up the size of a fork whose
+ * save-file predates 't' records, and count all its blocks as valid.
+ */
+static bool
+PlanBlock(const SavefileRecord *record, BlockNumber blocknum, void *arg)
+{
+	PlanState	   *state = (PlanState *) arg;
+	PlanRelation   *rel = state->current;
+
+	if (rel == NULL
+		|| rel->key.database != record->database
+		|| rel->key.tablespace != record->tablespace
+		|| rel->key.filenode != record->filenode
+		|| rel->key.forknum != record->forknum)
+	{
+		PlanRelationKey	key;
+		bool			found;
+
+		MemSet(&key, 0, sizeof(key));
+		key.database	= record->database;
+		key.tablespace	= record->tablespace;
+		key.filenode	= record->filenode;
+		key.forknum		= record->forknum;
+
+		rel = (PlanRelation *) hash_search(state->relations, &key, HASH_ENTER, &found);
+		if (!found)
+		{
+			rel->nblocks	= InvalidBlockNumber;
+			rel->listed		= 0;
+			rel->valid		= 0;
+			rel->runs		= 0;
+
+			if (key.tablespace != InvalidOid)
+			{
+				RelFileNode		rnode;
+				SMgrRelation	smgr;
+
+				rnode.spcNode	= key.tablespace;
+				rnode.dbNode	= key.database;
+				rnode.relNode	= key.filenode;
+
+				smgr = smgropen(rnode, InvalidBackendId);
+				rel->nblocks = (smgrexists(smgr, key.forknum)
+								? smgrnblocks(smgr, key.forknum) : 0);
+				smgrclose(smgr);
+			}
+		}
+
+		/* The fork is listed again under another priority; a new run begins. */
+		rel->last = InvalidBlockNumber;
+		state->current = rel;
+	}
+
+	++rel->listed;
+
+	if (rel->nblocks == InvalidBlockNumber || blocknum < rel->nblocks)
+	{
+		++rel->valid;
+		if (rel->last == InvalidBlockNumber || blocknum != rel->last + 1)
+			++rel->runs;
+		rel->last = blocknum;
+	}
+
+	return true;
+}
+
+/*
+ * SQL function pg_hibernator_plan()
+ *
+ * Returns a row for each fork of each relation listed in the save-files, with
+ * the number of blocks yet to be restored, the number of those within the
+ * fork's current size, the number of runs of consecutive blocks those make,
+ * and estimates of the bytes the restore will read and the time it will take.
+ * The save-files are only decoded, and the forks' sizes looked up; no blocks
+ * are read. See PlanBlock().
+ *
+ * The time is estimated at pg_hibernator.plan_throughput, or failing that, at
+ * the throughput of the last restore; it's NULL if neither is known.
+ */
+PG_FUNCTION_INFO_V1(pg_hibernator_plan);
+
+Datum
+pg_hibernator_plan(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc		tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext	per_query_ctx;
+	MemoryContext	oldcontext;
+	HASHCTL			ctl;
+	PlanState		state;
+	List		   *savefiles;
+	ListCell	   *lc;
+	HASH_SEQ_STATUS	status;
+	PlanRelation   *rel;
+	double			throughput;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (guc_plan_throughput > 0)
+		throughput = guc_plan_throughput;
+	else
+	{
+		LoadRestoreThroughput();
+		throughput = restoreThroughput;
+	}
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize		= sizeof(PlanRelationKey);
+	ctl.entrysize	= sizeof(PlanRelation);
+	ctl.hash		= tag_hash;
+	ctl.hcxt		= CurrentMemoryContext;
+
+	state.relations = hash_create("pg_hibernator planned relations", 1024, &ctl,
+								  HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+	state.current = NULL;
+
+	savefiles = ListSavefiles(DEBUG1);
+	foreach(lc, savefiles)
+		ForEachUnrestoredBlock(lfirst_int(lc), PlanBlock, &state);
+	list_free(savefiles);
+
+	hash_seq_init(&status, state.relations);
+	while ((rel = (PlanRelation *) hash_seq_search(&status)) != NULL)
+	{
+		Datum	values[9];
+		bool	nulls[9];
+
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[0] = ObjectIdGetDatum(rel->key.database);
+		values[1] = ObjectIdGetDatum(rel->key.tablespace);
+		values[2] = ObjectIdGetDatum(rel->key.filenode);
+		values[3] = CStringGetTextDatum(forkNames[rel->key.forknum]);
+		values[4] = Int64GetDatum((int64) rel->listed);
+		values[5] = Int64GetDatum((int64) rel->valid);
+		values[6] = Int64GetDatum((int64) rel->runs);
+		values[7] = Int64GetDatum((int64) rel->valid * BLCKSZ);
+
+		if (throughput > 0)
+			values[8] = Float8GetDatum(rel->valid / throughput);
+		else
+			nulls[8] = true;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	hash_destroy(state.relations);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+static void
+BufferSaverMain(Datum main_arg)
+{
+	bool		ready = false;
+	bool		accounting;
+	TimestampTz	restore_finished = 0;
+
+	WorkerCommon();
+
+	/*
+	 * Connect to no database in particular; that's enough to read the shared
+	 * catalog pg_database, which is all we need from the catalogs.
+	 */
+	BackgroundWorkerInitializeConnection(NULL, NULL);
+	RefreshDatabaseMap();
+
+	/* The previous restore's readiness says nothing about this one. */
+	UpdateReadyFile(false);
+
+	LoadRestoreThroughput();
+
+	/* If we crashed after a snapshot, the save-files are only its base. */
+	if (guc_enabled)
+		ReplayJournal();
+
+	/* Visibility checks on the restored blocks need these first. */
+	if (guc_enabled && guc_slru_caches)
+		PrefetchSlruPages();
+
+	RegisterBlockReaders();
+
+	accounting = (shared_state != NULL && shared_state->accounting);
+
+	/*
+	 * Main loop: do this until the SIGTERM handler tells us to terminate
+	 */
+	while (!got_sigterm)
+	{
+		int	rc;
+
+		ResetLatch(&MyProc->procLatch);
+		processOnePendingWorker();
+		MeasureRestoreThroughput();
+
+		if (!ready && RestoredFraction(guc_ready_hottest_tier) >= guc_ready_fraction)
+		{
+			UpdateReadyFile(true);
+			ready = true;
+		}
+
+		/*
+		 * Watch the restored buffers until they've all been settled, or until
+		 * the observation window that opens when the restore finishes closes.
+		 */
+		if (accounting)
+		{
+			int		pending = SampleRestoredBuffers(false);
+
+			if (restore_finished == 0 && RestoreFinished())
+				restore_finished = GetCurrentTimestamp();
+
+			if (restore_finished != 0
+				&& (pending == 0
+					|| TimestampDifferenceExceeds(restore_finished, GetCurrentTimestamp(),
+												  guc_efficacy_window * 1000)))
+			{
+				SampleRestoredBuffers(true);
+				ReportRestoreEfficacy();
+				UpdateRestoreHistory();
+				accounting = false;
+			}
+		}
+
+		/*
+		 * Wait on the process latch, which sleeps as necessary, but is awakened
+		 * if postmaster dies. This way the background process goes away
+		 * immediately in case of an emergency.
+		 *
+		 * Until the restore is ready, wake up often enough to notice promptly;
+		 * while watching the restored buffers, often enough to catch them
+		 * between their use and their eviction.
+		 */
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   (ready && !accounting) ? 10 * 1000L : 1000L);
+
+		/* emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		/*
+		 * In case of a SIGHUP, just reload the configuration.
+		 */
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		/* Keep the map of database names fresh, for the shutdown save. */
+		if (!got_sigterm
+			&& TimestampDifferenceExceeds(databaseMapRefreshed, GetCurrentTimestamp(),
+										  DATABASE_MAP_REFRESH_INTERVAL))
+			RefreshDatabaseMap();
+
+		/*
+		 * Take a snapshot now and then, but not while the BlockReaders are
+		 * still restoring the save-files that it would replace; nor once the
+		 * restore has been cancelled, since the save-files hold what it kept
+		 * for the next startup. The shutdown save carries that over.
+		 */
+		if (!got_sigterm && guc_enabled && guc_snapshot_interval > 0
+			&& RestoreFinished() && !RestoreCancelled()
+			&& TimestampDifferenceExceeds(lastSnapshot, GetCurrentTimestamp(),
+										  guc_snapshot_interval * 1000))
+		{
+			TakeSnapshot();
+			lastSnapshot = GetCurrentTimestamp();
+		}
+
+		/*
+		 * Launch the save helpers once the restore is done; they can't be
+		 * launched once the shutdown has begun. See SaveControl.
+		 */
+		if (!got_sigterm && guc_enabled && guc_save_workers > 0
+			&& saveControlSegment == NULL && RestoreFinished())
+			LaunchSaveHelpers();
+	}
+
+	/*
+	 * We recieved the SIGTERM; Shutdown is in progress, so save the
+	 * shared-buffer contents. We're no longer ready to serve, as far as anyone
+	 * watching the ready file is concerned.
+	 */
+	UpdateReadyFile(false);
+
+	/* Save the buffers only if the extension is enabled. */
+	if (guc_enabled)
+		SaveBuffers();
+
+	/* Let the save helpers that weren't needed go. */
+	EndSaveHelpers();
+
+	/*
+	 * The worker exits here. A proc_exit(0) is not necessary, we'll let the
+	 * caller do that.
+	 */
+}
+
+static void
+SaveBuffers(void)
+{
+	int						num_buffers;
+	SavedBuffer			   *saved_buffers;
+	bool					sorted;
+
+	/*
+	 * XXX: If the memory request fails, ask for a smaller memory chunk, and use
+	 * it to create chunks of save-files, and make the workers read those chunks.
+	 *
+	 * This is not a concern as of now, so deferred; there's at least one other
+	 * place that allocates (NBuffers * (much_bigger_struct)), so this seems to
+	 * be an acceptable practice.
+	 */
+
+	TRACE_PG_HIBERNATOR_SAVE_START();
+
+	saved_buffers = (SavedBuffer *) palloc(sizeof(SavedBuffer) * NBuffers);
+
+	/* With the help of the save helpers, if there are any, the list comes sorted. */
+	num_buffers = ParallelScanBuffers(saved_buffers);
+	sorted = (num_buffers >= 0);
+
+	if (!sorted)
+		num_buffers = ScanBuffers(saved_buffers, 0, NBuffers);
+
+	/* The BlockReaders' progress files have to be final before we read them. */
+	WaitForBlockReaders();
+
+	/*
+	 * If we're shutting down before the BlockReaders finished restoring the
+	 * previous save, keep the blocks they didn't get to. Once we've taken a
+	 * snapshot, the restore is long finished, and the save-files are only the
+	 * snapshot's base.
+	 */
+	if (snapshotBuffers == NULL)
+		num_buffers = AddUnrestoredBlocks(saved_buffers, num_buffers, NBuffers, &sorted);
+
+	pgstat_report_activity(STATE_RUNNING, "saving buffers");
+
+	/* This save is more recent than any snapshot. */
+	RemoveJournal();
+
+	num_buffers = WriteSave(saved_buffers, num_buffers, sorted);
+
+	SaveSlruPages();
+
+	TRACE_PG_HIBERNATOR_SAVE_DONE(num_buffers);
+
+	ereport(LOG,
+			(errmsg("Buffer Saver: saved metadata of %d blocks", num_buffers)));
+
+	pfree(saved_buffers);
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/*
+ * Replace the save-files with ones listing the given buffers, and return the
+ * number of buffers listed. The list is sorted in the process, unless the
+ * caller says it's sorted already, with the seldom used relations downranked.
+ */
+static int
+WriteSave(SavedBuffer *saved_buffers, int num_buffers, bool sorted)
+{
+	if (!sorted)
+	{
+		DownrankUnusedRelations(saved_buffers, num_buffers);
+
+		/*
+		 * Sort the list, so that we can optimize the storage of these buffers.
+		 *
+		 * The side-effect of this storage optimization is that when reading
+		 * the blocks back from relation forks, it leads to sequential reads,
+		 * which improve the restore speeds quite considerably as compared to
+		 * random reads from different blocks all over the data directory.
+		 */
+		pg_qsort(saved_buffers, num_buffers, sizeof(SavedBuffer),
+				 guc_tablespace_lanes ? SavedBufferLaneCmp : SavedBufferCmp);
+	}
+
+	/* The blocks that won't fit in the deadline move; sort them into place. */
+	if (PlanToDeadline(saved_buffers, num_buffers))
+		pg_qsort(saved_buffers, num_buffers, sizeof(SavedBuffer),
+				 guc_tablespace_lanes ? SavedBufferLaneCmp : SavedBufferCmp);
+
+	SaveRestoreThroughput();
+
+	/*
+	 * Database names come from the map we've kept up to date while idle, so
+	 * there's no need for a connection to a database, or a transaction, here.
+	 */
+	num_buffers = RemoveDroppedDatabases(saved_buffers, num_buffers);
+
+	/*
+	 * Remove the previous save, and the progress of its restore, now that its
+	 * unrestored blocks are in our list; so that the BlockReaders don't pick up
+	 * stale files on the next startup.
+	 */
+	RemoveSavefiles();
+
+	if (unlink(CONTAINER_PATH) != 0 && errno != ENOENT)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("error removing file \"%s\" : %m", CONTAINER_PATH)));
+
+	if (guc_single_file)
+		WriteContainer(saved_buffers, num_buffers);
+	else
+		WriteSavefiles(saved_buffers, num_buffers);
+
+	return num_buffers;
+}
+
+/*
+ * Find the shared state of the given SLRU cache; see SlruCache. The backend
+ * created it at startup, so ShmemInitStruct() only looks it up, given the size
+ * the backend asked for.
+ */
+static SlruShared
+LookupSlru(int slru)
+{
+	SlruShared	shared;
+	Size		size;
+	bool		found;
+
+	switch (slru)
+	{
+		case SLRU_CLOG:
+			size = CLOGShmemSize();
+			break;
+		case SLRU_MULTIXACT_OFFSETS:
+			size = SimpleLruShmemSize(NUM_MXACTOFFSET_BUFFERS, 0);
+			break;
+		case SLRU_MULTIXACT_MEMBERS:
+			size = SimpleLruShmemSize(NUM_MXACTMEMBER_BUFFERS, 0);
+			break;
+		default:
+			elog(ERROR, "unrecognized SLRU cache %d", slru);
+			return NULL;	/* keep compiler quiet */
+	}
+
+	shared = (SlruShared) ShmemInitStruct(slruCaches[slru].name, size, &found);
+
+	if (!found)
+		ereport(ERROR,
+				(errmsg("could not find the shared state of \"%s\"",
+						slruCaches[slru].name)));
+
+	return shared;
+}
+
+/*
+ * List the pages resident in the SLRU caches in SLRU_PATH, for the next
+ * startup to read; see SlruCache.
+ */
+static void
+SaveSlruPages(void)
+{
+	SlruPagesHeader	header;
+	SlruPage	   *pages;
+	FILE		   *file;
+	int				slru;
+	int				i;
+
+	if (!guc_slru_caches)
+	{
+		/* Don't leave a stale list behind for when it's enabled again. */
+		if (unlink(SLRU_PATH) != 0 && errno != ENOENT)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					errmsg("error removing file \"%s\" : %m", SLRU_PATH)));
+		return;
+	}
+
+	header.magic	= SLRU_PAGES_MAGIC;
+	header.version	= SLRU_PAGES_VERSION;
+	header.npages	= 0;
+
+	pages = NULL;
+
+	for (slru = 0; slru < NUM_SLRUS; ++slru)
+	{
+		SlruShared	shared = LookupSlru(slru);
+
+		if (pages == NULL)
+			pages = (SlruPage *) palloc(sizeof(SlruPage) * shared->num_slots);
+		else
+			pages = (SlruPage *) repalloc(pages, sizeof(SlruPage) * (header.npages + shared->num_slots));
+
+		LWLockAcquire(shared->ControlLock, LW_SHARED);
+
+		for (i = 0; i < shared->num_slots; ++i)
+		{
+			/* Pages being read in were not necessarily wanted. */
+			if (shared->page_status[i] == SLRU_PAGE_EMPTY
+				|| shared->page_status[i] == SLRU_PAGE_READ_IN_PROGRESS)
+				continue;
+
+			pages[header.npages].slru	= slru;
+			pages[header.npages].pageno	= shared->page_number[i];
+			++header.npages;
+		}
+
+		LWLockRelease(shared->ControlLock);
+	}
+
+	/* In file order, for the reads at startup. */
+	pg_qsort(pages, header.npages, sizeof(SlruPage), SlruPageCmp);
+
+	file = fileOpen(SLRU_PATH, PG_BINARY_W);
+	fileWrite(&header, sizeof(header), file, SLRU_PATH);
+	fileWrite(pages, sizeof(SlruPage) * header.npages, file, SLRU_PATH);
+	fileClose(file, SLRU_PATH);
+
+	ereport(LOG,
+			(errmsg("Buffer Saver: saved %u SLRU pages", header.npages)));
+
+	pfree(pages);
+}
+
+/*
+ * Read the SLRU pages listed by the last shutdown save, so that they're in
+ * the OS cache when the visibility checks on the restored blocks need them.
+ * A page whose segment has since been truncated away is skipped.
+ */
+static void
+PrefetchSlruPages(void)
+{
+	SlruPagesHeader	header;
+	SlruPage		page;
+	FILE		   *file;
+	char			path[MAXPGPATH];
+	char			block[BLCKSZ];
+	int				fd = -1;
+	int				fd_slru = -1;
+	int				fd_segno = -1;
+	uint32			i;
+	uint32			nread = 0;
+
+	file = fopen(SLRU_PATH, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open \"%s\": %m", SLRU_PATH)));
+		return;
+	}
+
+	if (!fileRead(&header, sizeof(header), file, true, SLRU_PATH)
+		|| header.magic != SLRU_PAGES_MAGIC
+		|| header.version != SLRU_PAGES_VERSION)
+	{
+		ereport(LOG,
+				(errmsg("ignoring invalid SLRU page list \"%s\"", SLRU_PATH)));
+		fileClose(file, SLRU_PATH);
+		return;
+	}
+
+	pgstat_report_activity(STATE_RUNNING, "reading SLRU pages");
+
+	for (i = 0; i < header.npages; ++i)
+	{
+		int			segno;
+
+		if (!fileRead(&page, sizeof(page), file, true, SLRU_PATH))
+			break;
+
+		if (page.slru >= NUM_SLRUS || page.pageno < 0)
+			continue;
+
+		segno = page.pageno / SLRU_PAGES_PER_SEGMENT;
+
+		/* The list is sorted, so consecutive pages share a segment file. */
+		if ((int) page.slru != fd_slru || segno != fd_segno)
+		{
+			if (fd >= 0)
+				CloseTransientFile(fd);
+
+			snprintf(path, sizeof(path), "%s/%04X", slruCaches[page.slru].dir, segno);
+			fd = OpenTransientFile(path, O_RDONLY | PG_BINARY, 0);
+			fd_slru = page.slru;
+			fd_segno = segno;
+		}
+
+		if (fd < 0)
+			continue;
+
+		if (lseek(fd, (off_t) (page.pageno % SLRU_PAGES_PER_SEGMENT) * BLCKSZ, SEEK_SET) >= 0
+			&& read(fd, block, BLCKSZ) == BLCKSZ)
+			++nread;
+	}
+
+	if (fd >= 0)
+		CloseTransientFile(fd);
+
+	fileClose(file, SLRU_PATH);
+
+	ereport(LOG,
+			(errmsg("Buffer Saver: read %u of %u SLRU pages", nread, header.npages)));
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+static int
+SlruPageCmp(const void *a, const void *b)
+{
+	const SlruPage *pagea = (const SlruPage *) a;
+	const SlruPage *pageb = (const SlruPage *) b;
+
+	if (pagea->slru != pageb->slru)
+		return pagea->slru < pageb->slru ? -1 : 1;
+
+	if (pagea->pageno != pageb->pageno)
+		return pagea->pageno < pageb->pageno ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Save the valid buffers among the given range of shared buffers into the
+ * array, and return their number.
+ */
+static int
+ScanBuffers(SavedBuffer *saved_buffers, int first, int end)
+{
+	int						i;
+	int						num_buffers;
+	volatile BufferDesc	   *bufHdr;			// XXX: Do we really need volatile here?
+	bool					saved;
+
+	/* Lock the buffer partitions for reading. */
+	for (i = 0; i < NUM_BUFFER_PARTITIONS; ++i)
+		LWLockAcquire(BufMappingPartitionLockByIndex(i), LW_SHARED);
+
+	/* Scan and save a list of valid buffers. */
+	for (num_buffers = 0, i = first, bufHdr = &BufferDescriptors[first]; i < end; ++i, ++bufHdr)
+	{
+		/* Lock each buffer header before inspecting. */
+		LockBufHdr(bufHdr);
+
+		/* Skip invalid buffers */
+		if ((bufHdr->flags & BM_VALID) && (bufHdr->flags & BM_TAG_VALID))
+		{
+			saved_buffers[num_buffers].database	= bufHdr->tag.rnode.dbNode;
+			saved_buffers[num_buffers].tablespace = bufHdr->tag.rnode.spcNode;
+			saved_buffers[num_buffers].filenode	= bufHdr->tag.rnode.relNode;
+			saved_buffers[num_buffers].forknum	= bufHdr->tag.forkNum;
+			saved_buffers[num_buffers].blocknum	= bufHdr->tag.blockNum;
+			saved_buffers[num_buffers].usage	= (guc_usage_count_cap > 0 ? bufHdr->usage_count : 0);
+			saved = true;
+		}
+		else
+			saved = false;
+
+		UnlockBufHdr(bufHdr);
+
+		/* Look at the page contents only after releasing the spinlock. */
+		if (saved)
+		{
+			saved_buffers[num_buffers].priority = ClassifyBuffer(bufHdr);
+			++num_buffers;
+		}
+	}
+
+	/* Unlock the buffer partitions in reverse order, to avoid a deadlock. */
+	for (i = NUM_BUFFER_PARTITIONS - 1; i >= 0; --i)
+		LWLockRelease(BufMappingPartitionLockByIndex(i));
+
+	return num_buffers;
+}
+
+/*
+ * Save the valid buffers of the given slice of the shared buffers at the start
+ * of the slice's part of the array, and sort them there, as WriteSave() would;
+ * return their number. See SaveControl.
+ */
+static int
+SaveSlice(SavedBuffer *slices, int first, int end, bool lanes)
+{
+	int			num_buffers;
+
+	num_buffers = ScanBuffers(&slices[first], first, end);
+
+	DownrankUnusedRelations(&slices[first], num_buffers);
+
+	pg_qsort(&slices[first], num_buffers, sizeof(SavedBuffer),
+			 lanes ? SavedBufferLaneCmp : SavedBufferCmp);
+
+	return num_buffers;
+}
+
+/* binaryheap keeps the greatest element on top; we want the least. */
+static int
+SaveMergeCmp(Datum a, Datum b, void *arg)
+{
+	SaveMerge  *merge = (SaveMerge *) arg;
+	SavedBuffer *bufa = &merge->slices[merge->pos[DatumGetInt32(a)]];
+	SavedBuffer *bufb = &merge->slices[merge->pos[DatumGetInt32(b)]];
+
+	return -(merge->lanes ? SavedBufferLaneCmp(bufa, bufb) : SavedBufferCmp(bufa, bufb));
+}
+
+/*
+ * Save the valid buffers into the array, sorted, along with the save helpers
+ * that are waiting, if any; see SaveControl. Returns the number of buffers
+ * saved, or -1 if there's no help to be had.
+ */
+static int
+ParallelScanBuffers(SavedBuffer *saved_buffers)
+{
+	SaveControl	   *control;
+	dsm_segment	   *volatile seg = NULL;
+	ResourceOwner	oldOwner;
+	MemoryContext	oldContext;
+	SaveMerge		merge;
+	binaryheap	   *heap;
+	int				assigned[MAX_SAVE_HELPERS];
+	int				nassigned = 0;
+	int				nslices;
+	int				slice;
+	int				num_buffers;
+
+	if (saveControlSegment == NULL)
+		return -1;
+
+	control = (SaveControl *) dsm_segment_address(saveControlSegment);
+
+	SpinLockAcquire(&control->mutex);
+	for (slice = 0; slice < numSaveHelpers; ++slice)
+	{
+		if (control->helpers[slice].state == SAVE_HELPER_READY)
+			assigned[nassigned++] = slice;
+	}
+	SpinLockRelease(&control->mutex);
+
+	if (nassigned == 0)
+		return -1;
+
+	/*
+	 * The segment is as large as the list of buffers; if the system can't
+	 * provide that much, we do without the helpers.
+	 */
+	oldOwner = CurrentResourceOwner;
+	oldContext = CurrentMemoryContext;
+	CurrentResourceOwner = saveResourceOwner;
+
+	PG_TRY();
+	{
+		seg = dsm_create(sizeof(SavedBuffer) * (Size) NBuffers);
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldContext);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		ereport(LOG,
+				(errmsg("Buffer Saver: saving without the save helpers: %s",
+						edata->message)));
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+
+	CurrentResourceOwner = oldOwner;
+
+	if (seg == NULL)
+		return -1;
+
+	merge.slices	= (SavedBuffer *) dsm_segment_address(seg);
+	merge.lanes		= guc_tablespace_lanes;
+
+	/* The helpers take the first slices, and we take the last. */
+	nslices = nassigned + 1;
+
+	SpinLockAcquire(&control->mutex);
+	control->buffers	= dsm_segment_handle(seg);
+	control->lanes		= merge.lanes;
+	for (slice = 0; slice < nassigned; ++slice)
+	{
+		SaveHelper *helper = &control->helpers[assigned[slice]];
+
+		helper->first	= SliceStart(slice, nslices);
+		helper->end		= SliceStart(slice + 1, nslices);
+		helper->state	= SAVE_HELPER_ASSIGNED;
+	}
+	SpinLockRelease(&control->mutex);
+
+	for (slice = 0; slice < nassigned; ++slice)
+		SetLatch(&control->helpers[assigned[slice]].proc->procLatch);
+
+	merge.pos[nassigned] = SliceStart(nassigned, nslices);
+	merge.end[nassigned] = merge.pos[nassigned]
+		+ SaveSlice(merge.slices, merge.pos[nassigned], NBuffers, merge.lanes);
+
+	/* Wait for the helpers; do the slices of those that exit without. */
+	for (;;)
+	{
+		bool		pending = false;
+		int			rc;
+
+		ResetLatch(&MyProc->procLatch);
+
+		for (slice = 0; slice < nassigned; ++slice)
+		{
+			SaveHelper *helper = &control->helpers[assigned[slice]];
+			int			state;
+
+			SpinLockAcquire(&control->mutex);
+			state = helper->state;
+			SpinLockRelease(&control->mutex);
+
+			if (state == SAVE_HELPER_DONE)
+				continue;
+
+			if (SaveHelperRunning(helper->pid))
+			{
+				pending = true;
+				continue;
+			}
+
+			ereport(LOG,
+					(errmsg("Buffer Saver: save helper %d exited; saving its slice",
+							assigned[slice] + 1)));
+
+			helper->num_buffers = SaveSlice(merge.slices, helper->first, helper->end,
+											merge.lanes);
+			helper->state = SAVE_HELPER_DONE;
+		}
+
+		if (!pending)
+			break;
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   100L);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+
+	/* Merge the sorted runs. */
+	heap = binaryheap_allocate(nslices, SaveMergeCmp, &merge);
+
+	for (slice = 0; slice < nslices; ++slice)
+	{
+		if (slice < nassigned)
+		{
+			SaveHelper *helper = &control->helpers[assigned[slice]];
+
+			merge.pos[slice] = helper->first;
+			merge.end[slice] = helper->first + helper->num_buffers;
+		}
+
+		if (merge.pos[slice] < merge.end[slice])
+			binaryheap_add_unordered(heap, Int32GetDatum(slice));
+	}
+
+	binaryheap_build(heap);
+
+	for (num_buffers = 0; !binaryheap_empty(heap); ++num_buffers)
+	{
+		slice = DatumGetInt32(binaryheap_first(heap));
+
+		saved_buffers[num_buffers] = merge.slices[merge.pos[slice]++];
+
+		if (merge.pos[slice] < merge.end[slice])
+			binaryheap_replace_first(heap, Int32GetDatum(slice));
+		else
+			binaryheap_remove_first(heap);
+	}
+
+	binaryheap_free(heap);
+
+	CurrentResourceOwner = saveResourceOwner;
+	dsm_detach(seg);
+	CurrentResourceOwner = oldOwner;
+
+	ereport(LOG,
+			(errmsg("Buffer Saver: %d save helpers shared the save", nassigned)));
+
+	return num_buffers;
+}
+
+/*
+ * Launch the save helpers, and create the segment they attach to; see
+ * SaveControl. Called once the restore is done, not to take worker slots
+ * from the BlockReaders.
+ */
+static void
+LaunchSaveHelpers(void)
+{
+	SaveControl	   *control;
+	ResourceOwner	oldOwner;
+	MemoryContext	oldContext;
+	dsm_handle		handle;
+	int				i;
+
+	/* DSM segments have to be tracked by a resource owner. */
+	if (saveResourceOwner == NULL)
+		saveResourceOwner = ResourceOwnerCreate(NULL, "pg_hibernator");
+
+	oldOwner = CurrentResourceOwner;
+	CurrentResourceOwner = saveResourceOwner;
+
+	saveControlSegment = dsm_create(sizeof(SaveControl));
+	dsm_keep_mapping(saveControlSegment);
+
+	CurrentResourceOwner = oldOwner;
+
+	control = (SaveControl *) dsm_segment_address(saveControlSegment);
+	MemSet(control, 0, sizeof(SaveControl));
+	SpinLockInit(&control->mutex);
+	control->leader = MyProc;
+	control->leader_pid = MyProcPid;
+
+	handle = dsm_segment_handle(saveControlSegment);
+
+	oldContext = MemoryContextSwitchTo(TopMemoryContext);
+
+	for (i = 0; i < guc_save_workers; ++i)
+	{
+		BackgroundWorker	worker;
+
+		MemSet(&worker, 0, sizeof(worker));
+
+		worker.bgw_flags		= BGWORKER_SHMEM_ACCESS;
+		worker.bgw_start_time	= BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time	= BGW_NEVER_RESTART;
+		worker.bgw_main			= SaveHelperMain;
+		worker.bgw_main_arg		= UInt32GetDatum(handle);
+		worker.bgw_notify_pid	= MyProcPid;
+		snprintf(worker.bgw_name, BGW_MAXLEN, "Save Helper %d", i + 1);
+
+		if (!RegisterDynamicBackgroundWorker(&worker, &saveHelpers[i]))
+		{
+			ereport(LOG,
+					(errmsg("Buffer Saver: could launch only %d of %d save helpers",
+							i, guc_save_workers)));
+			break;
+		}
+	}
+
+	numSaveHelpers = i;
+
+	MemoryContextSwitchTo(oldContext);
+}
+
+/*
+ * Is the save helper with the given PID still running? The helpers take their
+ * slots in SaveControl in whatever order they start, so we go by PID rather
+ * than by the slot.
+ */
+static bool
+SaveHelperRunning(int pid)
+{
+	int			i;
+	pid_t		helper_pid;
+
+	for (i = 0; i < numSaveHelpers; ++i)
+	{
+		if (GetBackgroundWorkerPid(saveHelpers[i], &helper_pid) == BGWH_STARTED
+			&& helper_pid == pid)
+			return true;
+	}
+
+	return false;
+}
+
+/* Let the save helpers still waiting know that there's no save to help with. */
+static void
+EndSaveHelpers(void)
+{
+	SaveControl	   *control;
+	int				i;
+
+	if (saveControlSegment == NULL)
+		return;
+
+	control = (SaveControl *) dsm_segment_address(saveControlSegment);
+
+	SpinLockAcquire(&control->mutex);
+	control->aborted = true;
+	SpinLockRelease(&control->mutex);
+
+	for (i = 0; i < numSaveHelpers; ++i)
+	{
+		if (control->helpers[i].proc != NULL)
+			SetLatch(&control->helpers[i].proc->procLatch);
+	}
+}
+
+/* Is the BufferSaver that launched us still there? See SaveControl. */
+static bool
+LeaderAlive(SaveControl *control)
+{
+	if (control->leader->pid != control->leader_pid)
+		return false;
+
+	return (kill(control->leader_pid, 0) == 0 || errno != ESRCH);
+}
+
+static void
+SaveHelperMain(Datum main_arg)
+{
+	dsm_handle		handle = DatumGetUInt32(main_arg);
+	int				id;
+	dsm_segment	   *seg;
+	dsm_segment	   *buffers;
+	SaveControl	   *control;
+	SaveHelper	   *helper;
+	TimestampTz		shutdown_began = 0;
+	PGPROC		   *leader;
+	int				num_buffers;
+
+	WorkerCommon();
+
+	/* DSM segments have to be tracked by a resource owner. */
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "pg_hibernator");
+
+	seg = dsm_attach(handle);
+	if (seg == NULL)
+		ereport(ERROR,
+				(errmsg("Save Helper: could not attach to the Buffer Saver's segment")));
+
+	control = (SaveControl *) dsm_segment_address(seg);
+
+	/* Take the first free slot; the helpers may start in any order. */
+	SpinLockAcquire(&control->mutex);
+	for (id = 0; id < MAX_SAVE_HELPERS; ++id)
+	{
+		if (control->helpers[id].proc == NULL)
+			break;
+	}
+	if (id < MAX_SAVE_HELPERS)
+	{
+		helper			= &control->helpers[id];
+		helper->proc	= MyProc;
+		helper->pid		= MyProcPid;
+		helper->state	= SAVE_HELPER_READY;
+	}
+	SpinLockRelease(&control->mutex);
+
+	if (id >= MAX_SAVE_HELPERS)
+		proc_exit(1);
+
+	/*
+	 * Wait for our slice; once the shutdown has begun, for only so long, in
+	 * case the BufferSaver isn't going to save.
+	 */
+	for (;;)
+	{
+		int			state;
+		bool		aborted;
+		int			rc;
+
+		ResetLatch(&MyProc->procLatch);
+
+		SpinLockAcquire(&control->mutex);
+		state	= helper->state;
+		aborted	= control->aborted;
+		SpinLockRelease(&control->mutex);
+
+		if (state == SAVE_HELPER_ASSIGNED)
+			break;
+
+		if (aborted || !LeaderAlive(control))
+			proc_exit(1);
+
+		if (got_sigterm)
+		{
+			if (shutdown_began == 0)
+				shutdown_began = GetCurrentTimestamp();
+			else if (TimestampDifferenceExceeds(shutdown_began, GetCurrentTimestamp(),
+												SAVE_HELPER_TIMEOUT))
+				proc_exit(1);
+		}
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   1000L);
+
+		/* emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+	}
+
+	/* If we can't attach, the BufferSaver does our slice when we exit. */
+	buffers = dsm_attach(control->buffers);
+	if (buffers == NULL)
+		proc_exit(1);
+
+	num_buffers = SaveSlice((SavedBuffer *) dsm_segment_address(buffers),
+							helper->first, helper->end, control->lanes);
+
+	SpinLockAcquire(&control->mutex);
+	helper->num_buffers	= num_buffers;
+	helper->state		= SAVE_HELPER_DONE;
+	leader				= control->leader;
+	SpinLockRelease(&control->mutex);
+
+	SetLatch(&leader->procLatch);
+
+	dsm_detach(buffers);
+	dsm_detach(seg);
+
+	/* Exit with non-zero status, as the BlockReaders do. */
+	proc_exit(1);
+}
+
+/*
+ * Take a snapshot of the shared buffers; see JournalEntry.
+ *
+ * Unlike the shutdown save, we don't lock the buffer partitions, so as not to
+ * hold up the backends. Each buffer's tag is read consistently, but the
+ * snapshot as a whole is a little fuzzy; a list of blocks to restore can live
+ * with that.
+ */
+static void
+TakeSnapshot(void)
+{
+	int						i;
+	volatile BufferDesc	   *bufHdr;
+	SavedBuffer				buf;
+	bool					valid;
+	bool					full;
+	uint64					changes = 0;
+
+	full = (snapshotBuffers == NULL
+			|| journalEntries >= Max(baseBlocks, JOURNAL_MIN_ENTRIES));
+
+	if (snapshotBuffers == NULL)
+	{
+		snapshotBuffers = (SavedBuffer *) MemoryContextAllocHuge(TopMemoryContext,
+													sizeof(SavedBuffer) * NBuffers);
+		for (i = 0; i < NBuffers; ++i)
+			snapshotBuffers[i].filenode = InvalidOid;
+	}
+
+	pgstat_report_activity(STATE_RUNNING, "taking a snapshot");
+
+	for (i = 0, bufHdr = BufferDescriptors; i < NBuffers; ++i, ++bufHdr)
+	{
+		SavedBuffer	   *last = &snapshotBuffers[i];
+
+		LockBufHdr(bufHdr);
+
+		valid = ((bufHdr->flags & BM_VALID) && (bufHdr->flags & BM_TAG_VALID));
+		if (valid)
+		{
+			buf.database	= bufHdr->tag.rnode.dbNode;
+			buf.tablespace	= bufHdr->tag.rnode.spcNode;
+			buf.filenode	= bufHdr->tag.rnode.relNode;
+			buf.forknum		= bufHdr->tag.forkNum;
+			buf.blocknum	= bufHdr->tag.blockNum;
+			buf.usage		= (guc_usage_count_cap > 0 ? bufHdr->usage_count : 0);
+		}
+
+		UnlockBufHdr(bufHdr);
+
+		/* The buffer holds the same block as at the last snapshot. */
+		if (valid && last->filenode != InvalidOid
+			&& SavedBufferTagCmp(last, &buf) == 0)
+			continue;
+
+		if (last->filenode != InvalidOid)
+		{
+			if (!full)
+				AppendJournal(JOURNAL_REMOVE, last);
+			last->filenode = InvalidOid;
+			++changes;
+		}
+
+		if (valid)
+		{
+			buf.priority = ClassifyBuffer(bufHdr);
+			*last = buf;
+			if (!full)
+				AppendJournal(JOURNAL_ADD, last);
+			++changes;
+		}
+	}
+
+	if (full)
+	{
+		SavedBuffer	   *saved_buffers;
+		int				num_buffers = 0;
+		JournalHeader	header;
+
+		/*
+		 * The journal goes first; should we crash while writing the base, it
+		 * would be replayed over the wrong one.
+		 */
+		RemoveJournal();
+
+		saved_buffers = (SavedBuffer *) MemoryContextAllocHuge(CurrentMemoryContext,
+													sizeof(SavedBuffer) * NBuffers);
+		for (i = 0; i < NBuffers; ++i)
+		{
+			if (snapshotBuffers[i].filenode != InvalidOid)
+				saved_buffers[num_buffers++] = snapshotBuffers[i];
+		}
+
+		baseBlocks = WriteSave(saved_buffers, num_buffers, false);
+		pfree(saved_buffers);
+
+		/*
+		 * The base has to be on disk before the journal that goes with it;
+		 * WriteSave() has synced the files, but not their directory entries.
+		 */
+		fsync_fname(SAVE_LOCATION, true);
+
+		header.magic	= JOURNAL_MAGIC;
+		header.version	= JOURNAL_VERSION;
+
+		journalFile = fileOpen(JOURNAL_PATH, PG_BINARY_W);
+		fileWrite(&header, sizeof(header), journalFile, JOURNAL_PATH);
+		journalEntries = 0;
+
+		ereport(DEBUG1,
+				(errmsg("Buffer Saver: wrote a snapshot of %lu blocks",
+						(unsigned long) baseBlocks)));
+	}
+	else
+	{
+		AppendJournal(JOURNAL_COMMIT, NULL);
+
+		ereport(DEBUG1,
+				(errmsg("Buffer Saver: journaled %lu blocks that came or went since the last snapshot",
+						(unsigned long) changes)));
+	}
+
+	/* The snapshot counts only once its commit entry is on disk. */
+	SyncFile(journalFile, JOURNAL_PATH);
+
+	if (full)
+		fsync_fname(SAVE_LOCATION, true);
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+static void
+AppendJournal(uint32 op, const SavedBuffer *buf)
+{
+	JournalEntry	entry;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.op = op;
+	if (buf != NULL)
+		entry.buf = *buf;
+
+	fileWrite(&entry, sizeof(entry), journalFile, JOURNAL_PATH);
+
+	if (op != JOURNAL_COMMIT)
+		++journalEntries;
+}
+
+/* Remove the journal, if any, before its base is replaced. */
+static void
+RemoveJournal(void)
+{
+	if (journalFile != NULL)
+	{
+		fileClose(journalFile, JOURNAL_PATH);
+		journalFile = NULL;
+	}
+
+	if (unlink(JOURNAL_PATH) != 0)
+	{
+		if (errno == ENOENT)
+			return;
+
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("error removing file \"%s\" : %m", JOURNAL_PATH)));
+	}
+
+	fsync_fname(SAVE_LOCATION, true);
+}
+
+/* Count one more, or one fewer, buffer holding the block; see ReplayedBlock. */
+static void
+ReplayBlock(HTAB *blocks, const SavedBuffer *buf, int delta)
+{
+	RelFileNode		rnode;
+	BufferTag		tag;
+	ReplayedBlock  *block;
+	bool			found;
+
+	rnode.spcNode	= buf->tablespace;
+	rnode.dbNode	= buf->database;
+	rnode.relNode	= buf->filenode;
+	INIT_BUFFERTAG(tag, rnode, buf->forknum, buf->blocknum);
+
+	block = (ReplayedBlock *) hash_search(blocks, &tag, HASH_ENTER, &found);
+	if (!found)
+		block->count = 0;
+
+	/*
+	 * The base may have lost a block the journal knows of, to a dropped
+	 * database or the restore deadline; don't let its removal go negative.
+	 */
+	block->count = Max(block->count + delta, 0);
+
+	if (delta > 0)
+	{
+		block->priority	= buf->priority;
+		block->usage	= buf->usage;
+	}
+}
+
+static bool
+ReplayBaseBlock(const SavefileRecord *record, BlockNumber blocknum, void *arg)
+{
+	SavedBuffer		buf;
+
+	buf.database	= record->database;
+	buf.priority	= record->priority;
+	buf.tablespace	= record->tablespace;
+	buf.filenode	= record->filenode;
+	buf.forknum		= record->forknum;
+	buf.blocknum	= blocknum;
+	buf.usage		= record->usage;
+
+	ReplayBlock((HTAB *) arg, &buf, 1);
+
+	return true;
+}
+
+/*
+ * Replay the journal, if any, over its base, and replace the save-files with
+ * the result; see JournalEntry.
+ *
+ * Should we crash before the journal is removed, it's replayed again over the
+ * result; which, since we count the buffers holding each block, leaves at
+ * worst a few blocks in the list that had gone.
+ */
+static void
+ReplayJournal(void)
+{
+	FILE			   *file;
+	JournalHeader		header;
+	JournalEntry		entry;
+	HASHCTL				ctl;
+	HTAB			   *blocks;
+	HASH_SEQ_STATUS		status;
+	ReplayedBlock	   *block;
+	List			   *savefiles;
+	ListCell		   *lc;
+	SavedBuffer		   *saved_buffers;
+	int					num_buffers = 0;
+	uint64				nentries;
+	uint64				committed = 0;
+	uint64				i;
+
+	file = fopen(JOURNAL_PATH, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open \"%s\": %m", JOURNAL_PATH)));
+		return;
+	}
+
+	if (!fileRead(&header, sizeof(header), file, true, JOURNAL_PATH)
+		|| header.magic != JOURNAL_MAGIC
+		|| header.version != JOURNAL_VERSION)
+	{
+		ereport(LOG,
+				(errmsg("ignoring invalid snapshot journal \"%s\"", JOURNAL_PATH)));
+		fileClose(file, JOURNAL_PATH);
+		RemoveJournal();
+		return;
+	}
+
+	/* Only the snapshots that got as far as their commit entries count. */
+	for (nentries = 0; fileRead(&entry, sizeof(entry), file, true, JOURNAL_PATH); )
+	{
+		++nentries;
+		if (entry.op == JOURNAL_COMMIT)
+			committed = nentries;
+	}
+
+	pgstat_report_activity(STATE_RUNNING, "replaying snapshot journal");
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize		= sizeof(BufferTag);
+	ctl.entrysize	= sizeof(ReplayedBlock);
+	ctl.hash		= tag_hash;
+
+	blocks = hash_create("pg_hibernator replayed blocks", NBuffers, &ctl,
+						 HASH_ELEM | HASH_FUNCTION);
+
+	savefiles = ListSavefiles(DEBUG1);
+	foreach(lc, savefiles)
+		ForEachUnrestoredBlock(lfirst_int(lc), ReplayBaseBlock, blocks);
+	list_free(savefiles);
+
+	if (fseeko(file, sizeof(header), SEEK_SET) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not seek in file \"%s\": %m", JOURNAL_PATH)));
+
+	for (i = 0; i < committed; ++i)
+	{
+		fileRead(&entry, sizeof(entry), file, false, JOURNAL_PATH);
+
+		if (entry.op == JOURNAL_ADD)
+			ReplayBlock(blocks, &entry.buf, 1);
+		else if (entry.op == JOURNAL_REMOVE)
+			ReplayBlock(blocks, &entry.buf, -1);
+	}
+
+	fileClose(file, JOURNAL_PATH);
+
+	saved_buffers = (SavedBuffer *) MemoryContextAllocHuge(CurrentMemoryContext,
+												sizeof(SavedBuffer) * NBuffers);
+
+	hash_seq_init(&status, blocks);
+	while ((block = (ReplayedBlock *) hash_seq_search(&status)) != NULL)
+	{
+		SavedBuffer	   *buf;
+
+		if (block->count == 0 || num_buffers >= NBuffers)
+			continue;
+
+		buf = &saved_buffers[num_buffers++];
+
+		buf->database	= block->tag.rnode.dbNode;
+		buf->priority	= block->priority;
+		buf->tablespace	= block->tag.rnode.spcNode;
+		buf->filenode	= block->tag.rnode.relNode;
+		buf->forknum	= block->tag.forkNum;
+		buf->blocknum	= block->tag.blockNum;
+		buf->usage		= block->usage;
+	}
+
+	hash_destroy(blocks);
+
+	num_buffers = WriteSave(saved_buffers, num_buffers, false);
+
+	RemoveJournal();
+
+	ereport(LOG,
+			(errmsg("Buffer Saver: replayed %lu journal entries over the last snapshot, leaving %d blocks to restore",
+					(unsigned long) committed, num_buffers)));
+
+	pfree(saved_buffers);
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/*
+ * Remove the buffers of databases that have been dropped, or that we don't know
+ * the names of, from the sorted list, and return the new number of buffers.
+ *
+ * Whether a database still exists is told by its directory, in the tablespace
+ * of its first buffer, so as not to depend on the catalogs at shutdown. A
+ * database missing from the map was created after the map was last refreshed;
+ * unless the shutdown has begun, we refresh the map once, if need be, before
+ * giving up on it.
+ */
+static int
+RemoveDroppedDatabases(SavedBuffer *saved_buffers, int num_buffers)
+{
+	int			i;
+	int			kept = 0;
+	bool		refreshed = false;
+	bool		known = true;
+
+	for (i = 0; i < num_buffers; ++i)
+	{
+		Oid			database = saved_buffers[i].database;
+
+		if (i == 0 || database != saved_buffers[i-1].database)
+		{
+			if (database == InvalidOid)
+				known = true;
+			else if (!DatabaseDirectoryExists(database, saved_buffers[i].tablespace))
+			{
+				known = false;
+				ereport(LOG,
+						(errmsg("Buffer Saver: skipping blocks of database %u, which no longer exists",
+								database)));
+			}
+			else
+			{
+				known = (hash_search(databaseMap, &database, HASH_FIND, NULL) != NULL);
 
-	errno = 0;
-	while ((dent = readdir(dir)) != NULL)
-	{
-		int		filenum;
+				if (!known && !refreshed && !got_sigterm)
+				{
+					RefreshDatabaseMap();
+					refreshed = true;
 
-		/* Skip worker creation if we can't parse the file name. */
-		if (!parseSavefileName(dent->d_name, &filenum))
-			continue;
+					known = (hash_search(databaseMap, &database, HASH_FIND, NULL) != NULL);
+				}
 
-		addPendingWorker(filenum);
-	}
+				if (!known)
+					ereport(LOG,
+							(errmsg("Buffer Saver: skipping blocks of database %u, created since its name was last looked up",
+									database)));
+			}
+		}
 
-	if (errno != 0)
-		ereport(ERROR,
-				(errcode_for_file_access(),
-				errmsg("error encountered during readdir \"%s\": %m", hibernate_dir)));
+		if (known)
+			saved_buffers[kept++] = saved_buffers[i];
+	}
 
-	closedir(dir);
+	return kept;
 }
 
-static void
-addPendingWorker(int filenum)
+/* Does the database's directory exist in the given tablespace? */
+static bool
+DatabaseDirectoryExists(Oid database, Oid tablespace)
 {
-	MemoryContext oldContext = MemoryContextSwitchTo(TopMemoryContext);
+	char	   *path = GetDatabasePath(database, tablespace);
+	struct stat	st;
+	bool		exists;
 
-	pendingWorkers = lappend_int(pendingWorkers, filenum);
+	exists = (stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+	pfree(path);
 
-	MemoryContextSwitchTo(oldContext);
+	return exists;
 }
 
-static void
-processOnePendingWorker()
+/*
+ * Call the callback for each block of the given save-file, or section of the
+ * container, that the BlockReaders haven't restored yet; that is, for the blocks
+ * past the progress recorded by ReadBlocks(), if any. Stops early, returning
+ * false, if the callback returns false.
+ *
+ * A save-file that doesn't exist, perhaps because a BlockReader just finished
+ * with it, has no blocks left to restore.
+ */
+static bool
+ForEachUnrestoredBlock(int filenum, UnrestoredBlockCallback callback, void *arg)
 {
-	static BackgroundWorkerHandle *last_worker = NULL;
+	FILE			   *file;
+	char			   *dbname;
+	bool				in_container;
+	SavefileSection		section;
+	SavefileReader		reader;
+	SavefileRecord		record;
+	SavefileProgress	progress;
+	SavefileProgress	mark;
+	ForkNumber			done_forknum = InvalidForkNumber;
+	BlockNumber			done_blocknum = InvalidBlockNumber;
+	bool				keep_going = true;
+
+	file = OpenSavefile(filenum, true, &reader, &dbname, &in_container, &section);
+	if (file == NULL)
+		return true;
 
-	/* Nothing to do if the list is empty. */
-	if (list_length(pendingWorkers) == 0)
-		return;
+	if (!ReadProgress(filenum, &progress)
+		|| !resumeSavefileReader(&reader, &progress))
+		getSavefileProgress(&reader, &progress);
 
-	if (last_worker != NULL)
+	while (keep_going && readSavefileRecord(&reader, &record))
 	{
-		pid_t pid;
-		BgwHandleStatus status = GetBackgroundWorkerPid(last_worker, &pid);
+		BlockNumber	block;
+		BlockNumber	last;
 
-		switch (status)
+		switch (record.type)
 		{
-			case BGWH_STARTED:
-			case BGWH_NOT_YET_STARTED:
-				/* Do nothing if parallelism is disabled */
-				if (!guc_parallel_enabled)
-					return;
-
-				/* Fall through */
-			case BGWH_STOPPED:
-				last_worker = NULL;
+			case 'r':
+				/* The same logic as in ReadBlocks() */
+				getSavefileProgress(&reader, &mark);
+				if (mark.position == progress.position)
+				{
+					done_forknum	= progress.forknum;
+					done_blocknum	= progress.blocknum;
+				}
+				else
+				{
+					done_forknum	= InvalidForkNumber;
+					done_blocknum	= InvalidBlockNumber;
+				}
+				continue;
+			case 'b':
+				last = record.blocknum;
 				break;
-			default:
-				Assert(false);
+			case 'N':
+				last = record.blocknum + record.range - 1;
 				break;
+			default:
+				continue;
 		}
-	}
 
-	if (!RegisterWorker(linitial_int(pendingWorkers), &last_worker))
-	{
-		ereport(LOG, (errmsg("registration of background worker failed")));
-		return;
+		for (block = record.blocknum; block <= last && keep_going; ++block)
+		{
+			if (BlockAlreadyRestored(done_forknum, done_blocknum,
+									 record.forknum, block))
+				continue;
+
+			keep_going = callback(&record, block, arg);
+		}
 	}
 
-	/* Remove the element from pending list iff we could register a worker successfully. */
-	pendingWorkers = list_delete_first(pendingWorkers);
+	fileClose(file, reader.path);
+	pfree(dbname);
+
+	return keep_going;
 }
 
+/* State of AddUnrestoredBlocks() */
+typedef struct BufferList
+{
+	SavedBuffer	   *buffers;
+	int				num_buffers;
+	int				max_buffers;
+} BufferList;
+
 static bool
-RegisterWorker(int id, BackgroundWorkerHandle **handle)
+AddUnrestoredBlock(const SavefileRecord *record, BlockNumber blocknum, void *arg)
 {
-	BackgroundWorker	worker;
+	BufferList	   *list = (BufferList *) arg;
+	SavedBuffer	   *buf;
 
-	/*
-	 * Protect against the possibility of more members being added to the
-	 * structure than we are using below.
-	 */
-	MemSet(&worker, 0, sizeof(worker));
+	if (list->num_buffers >= list->max_buffers)
+		return false;
 
-	worker.bgw_main_arg = Int32GetDatum(id);
-	worker.bgw_flags		= BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	buf = &list->buffers[list->num_buffers++];
 
-	if (id == 0)
-	{
-		/* Register the BufferSaver background worker */
-		worker.bgw_start_time	= BgWorkerStart_ConsistentState;
-		worker.bgw_restart_time	= 0;	/* Keep the BufferSaver running */
-		worker.bgw_main			= BufferSaverMain;
-		snprintf(worker.bgw_name, BGW_MAXLEN, "Buffer Saver");
-		RegisterBackgroundWorker(&worker);
-		return true;
-	}
-	else
-	{
-		/* Register a BlockReader background worker process */
-		worker.bgw_start_time	= BgWorkerStart_ConsistentState;
-		worker.bgw_restart_time	= BGW_NEVER_RESTART;	/* Don't restart BlockReaders upon error */
-		worker.bgw_main			= BlockReaderMain;
-		worker.bgw_notify_pid	= MyProcPid;			/* Send me SIGUSR1 when a BGWorker is created or dies. */
-		snprintf(worker.bgw_name, BGW_MAXLEN, "Block Reader %d", id);
-		return RegisterDynamicBackgroundWorker(&worker, handle);
-	}
+	buf->database	= record->database;
+	buf->priority	= record->priority;
+	buf->tablespace	= record->tablespace;
+	buf->filenode	= record->filenode;
+	buf->forknum	= record->forknum;
+	buf->blocknum	= blocknum;
+	buf->usage		= record->usage;
+
+	return true;
 }
 
-static void
-WorkerCommon(void)
+/*
+ * Append to the list the blocks of the previous save that the BlockReaders
+ * haven't restored yet, up to max_buffers in all, and return the new number of
+ * buffers in the list. Blocks that are already in the list aren't added again.
+ * If any are added, the list is no longer sorted.
+ *
+ * The BlockReaders stop when the shutdown begins, and note how far they got;
+ * without this, the next save would overwrite the rest of their work.
+ */
+static int
+AddUnrestoredBlocks(SavedBuffer *saved_buffers, int num_buffers, int max_buffers,
+					bool *sorted)
 {
-	/* Establish signal handlers before unblocking signals. */
-	pqsignal(SIGHUP, sighupHandler);
-	pqsignal(SIGTERM, sigtermHandler);
-	pqsignal(SIGUSR1, sigusr1Handler);
+	List	   *savefiles = ListSavefiles(DEBUG1);
+	ListCell   *lc;
+	BufferList	list;
+	int			i;
+	int			kept;
 
-	/* We're now ready to receive signals */
-	BackgroundWorkerUnblockSignals();
-}
+	list.buffers		= saved_buffers;
+	list.num_buffers	= num_buffers;
+	list.max_buffers	= max_buffers;
 
-static void
-BlockReaderMain(Datum main_arg)
-{
-	int					id = DatumGetInt32(main_arg);
-	DIR				   *dir;
-	const char		   *hibernate_dir = SAVE_LOCATION;
-	struct dirent	   *dent;
-	int					filenum;
+	foreach(lc, savefiles)
+	{
+		if (!ForEachUnrestoredBlock(lfirst_int(lc), AddUnrestoredBlock, &list))
+			break;
+	}
 
-	WorkerCommon();
+	list_free(savefiles);
 
-	dir = opendir(hibernate_dir);
-	if (dir == NULL)
-		ereport(ERROR,
-				(errcode_for_file_access(),
-				 errmsg("Block Reader %d: could not open directory \"%s\": %m",
-						id, hibernate_dir)));
+	if (list.num_buffers == num_buffers)
+		return num_buffers;
+
+	ereport(LOG,
+			(errmsg("Buffer Saver: keeping %d blocks not yet restored",
+					list.num_buffers - num_buffers)));
+
+	num_buffers = list.num_buffers;
+	*sorted = false;
 
 	/*
-	 * Reset errno before making system call, so that we don't trip over an
-	 * error that occurred earlier.
+	 * Many of the blocks restored so far are in shared buffers, and in the list
+	 * already; remove the duplicates.
 	 */
-	errno = 0;
+	pg_qsort(saved_buffers, num_buffers, sizeof(SavedBuffer), SavedBufferTagCmp);
 
-	/* Scan the directory looking for file this worker is assigned to. */
-	while ((dent = readdir(dir)) != NULL)
+	for (kept = 0, i = 0; i < num_buffers; ++i)
 	{
-		if (!parseSavefileName(dent->d_name, &filenum))
+		if (kept > 0 && SavedBufferTagCmp(&saved_buffers[kept - 1], &saved_buffers[i]) == 0)
 			continue;
 
-		/* Stop if this is the file assigned to this worker. */
-		if (filenum == id)
-			break;
+		saved_buffers[kept++] = saved_buffers[i];
 	}
 
-	if (dent == NULL)
-	{
-		closedir(dir);
+	return kept;
+}
 
-		if (errno != 0)
-			ereport(ERROR,
-					(errcode_for_file_access(),
-					errmsg("Block Reader %d: encountered error during readdir \"%s\": %m",
-							filenum, hibernate_dir)));
+/*
+ * Decide the restore priority of a buffer; see savefile.h.
+ *
+ * We look at the page without a pin or a content lock, so the answer is only a
+ * hint; but then, it's only used to decide the restore order. When the caller
+ * holds the buffer mapping locks, the buffer can't be evicted and reused for a
+ * different block while we look at it; a snapshot doesn't take them, and may
+ * get the priority of the wrong block now and then.
+ */
+static uint32
+ClassifyBuffer(volatile BufferDesc *bufHdr)
+{
+	Page			page;
+	PageHeader		phdr;
+	BTPageOpaque	opaque;
 
-		ereport(ERROR,
-				(errmsg("Block Reader %d: could not find its save-file", filenum)));
-	}
-	closedir(dir);
+	if (bufHdr->tag.forkNum == VISIBILITYMAP_FORKNUM
+		|| bufHdr->tag.forkNum == FSM_FORKNUM)
+		return PRIORITY_MAPS;
 
-	/* We found the file we're supposed to restore. */
+	if (bufHdr->tag.forkNum != MAIN_FORKNUM)
+		return PRIORITY_DATA;
 
-	ReadBlocks(filenum);
+	page = BufferGetPage(bufHdr->buf_id + 1);
+	phdr = (PageHeader) page;
 
 	/*
-	 * Exit with non-zero status to ensure that this worker is not restarted.
-	 *
-	 * For any backend connected to shared-buffers, an exit code other than 0 or 1
-	 * causes a system-wide restart, so we have no choice but to use 1. Since an
-	 * ERROR also causes exit code 1, it would've been nice if we could use some
-	 * other code to signal normal exit, so that a monitor could differentiate
-	 * between a successful exit, and an exit due to an ERROR.
-	 *
-	 * To get around this ambiguity we resort to logging a message to server log;
-	 * this message should console the user that everything went okay, even though
-	 * the exit code is 1.
+	 * A B-tree page has a special space of exactly this size. So do GiST and
+	 * hash index pages, but their page ids are out of the range of B-tree
+	 * cycle ids, which occupy the same position.
 	 */
-	ereport(LOG, (errmsg("Block Reader %d: all blocks read successfully", filenum)));
-	proc_exit(1);
+	if (PageIsNew(page)
+		|| phdr->pd_special != BLCKSZ - MAXALIGN(sizeof(BTPageOpaqueData)))
+		return PRIORITY_DATA;
+
+	opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+
+	if (opaque->btpo_cycleid > MAX_BT_CYCLE_ID)
+		return PRIORITY_DATA;
+
+	if (P_ISMETA(opaque) || (!P_ISLEAF(opaque) && !P_IGNORE(opaque)))
+		return PRIORITY_INDEX_UPPER;
+
+	return PRIORITY_DATA;
 }
 
+/*
+ * Rebuild the BufferSaver's map of database OIDs to names from pg_database.
+ *
+ * This is done periodically while idle, rather than at shutdown, so that the
+ * shutdown save doesn't depend on the catalogs being accessible.
+ */
 static void
-ReadBlocks(int filenum)
+RefreshDatabaseMap(void)
 {
-	FILE	   *file;
-	char		record_type;
-	char	   *dbname;
-	Oid			record_filenode;
-	ForkNumber	record_forknum;
-	BlockNumber	record_blocknum;
-	BlockNumber	record_range;
-
-	int			log_level		= DEBUG3;
-	Oid			relOid			= InvalidOid;
-	Relation	rel				= NULL;
-	bool		skip_relation	= false;
-	bool		skip_fork		= false;
-	bool		skip_block		= false;
-	BlockNumber	nblocks			= 0;
-	BlockNumber	blocks_restored	= 0;
-	const char *filepath;
+	HASHCTL			ctl;
+	Relation		rel;
+	HeapScanDesc	scan;
+	HeapTuple		tup;
 
-	/*
-	 * If this condition changes, then this code, and the code in the writer
-	 * will need to be changed; especially the format specifiers in log and
-	 * error messages.
-	 */
-	StaticAssertStmt(MaxBlockNumber == 0xFFFFFFFE, "Code may need review.");
+	if (databaseMap != NULL)
+		hash_destroy(databaseMap);
 
-	filepath = getSavefileName(filenum);
-	file = fileOpen(filepath, PG_BINARY_R);
-	dbname = readDBName(file, filepath);
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize		= sizeof(Oid);
+	ctl.entrysize	= sizeof(DatabaseMapEntry);
+	ctl.hash		= tag_hash;
 
-	/*
-	 * When restoring global objects, the dbname is zero-length string, and non-
-	 * zero length otherwise. And filenum is never expected to be smaller than 1.
-	 */
-	Assert(filenum >= 1);
-	Assert(filenum == 1 ? strlen(dbname) == 0 : strlen(dbname) > 0);
+	databaseMap = hash_create("pg_hibernator database names", 64, &ctl,
+							  HASH_ELEM | HASH_FUNCTION);
 
-	/* To restore the global objects, use default database */
-	BackgroundWorkerInitializeConnection(filenum == 1 ? guc_default_database : dbname, NULL);
 	SetCurrentStatementStartTimestamp();
 	StartTransactionCommand();
-	SPI_connect();
-	PushActiveSnapshot(GetTransactionSnapshot());
-	pgstat_report_activity(STATE_RUNNING, "restoring buffers");
+	(void) GetTransactionSnapshot();
 
-	/*
-	 * Note that in case of a read error, we will leak relcache entry that we may
-	 * currently have open. In case of EOF, we close the relation after the loop.
-	 */
-	while (fileRead(&record_type, 1, file, true, filepath))
+	rel = heap_open(DatabaseRelationId, AccessShareLock);
+	scan = heap_beginscan_catalog(rel, 0, NULL);
+
+	while (HeapTupleIsValid(tup = heap_getnext(scan, ForwardScanDirection)))
 	{
-		/*
-		 * If we want to process the signals, this seems to be the best place
-		 * to do it. Generally the backends refrain from processing config file
-		 * while in transaction, but that's more for the fear of allowing GUC
-		 * changes to affect expression evaluation, causing different results
-		 * for the same expression in a transaction. Since this worker is not
-		 * processing any queries, it is okay to process the config file here.
-		 *
-		 * Even though it's okay to process SIGHUP here, doing so doesn't add
-		 * any value. The only reason we might want to process config file here
-		 * would be to allow the user to interrupt the BlockReader's operation
-		 * by changing this extenstion's GUC parameter. But the user can do that
-		 * anyway, using SIGTERM or pg_terminate_backend().
-		 */
+		Form_pg_database	pgdatabase = (Form_pg_database) GETSTRUCT(tup);
+		Oid					database = HeapTupleGetOid(tup);
+		DatabaseMapEntry   *entry;
 
-		/* Stop processing the save-file if the Postmaster wants us to die. */
-		if (got_sigterm)
-			break;
+		entry = (DatabaseMapEntry *) hash_search(databaseMap, &database, HASH_ENTER, NULL);
+		namecpy(&entry->dbname, &pgdatabase->datname);
+	}
 
-		ereport(log_level,
-				(errmsg("record type %x - %c", record_type, record_type)));
+	heap_endscan(scan);
+	heap_close(rel, AccessShareLock);
 
-		switch (record_type)
-		{
-			case 'r':
-			{
-				/* Close the previous relation, if any. */
-				if (rel)
-				{
-					relation_close(rel, AccessShareLock);
-					rel = NULL;
-				}
+	CommitTransactionCommand();
 
-				record_forknum = InvalidForkNumber;
-				record_blocknum = InvalidBlockNumber;
-				nblocks = 0;
+	databaseMapRefreshed = GetCurrentTimestamp();
 
-				fileRead(&record_filenode, sizeof(Oid), file, false, filepath);
+	ereport(DEBUG1,
+			(errmsg("Buffer Saver: found %ld databases", hash_get_num_entries(databaseMap))));
+}
 
-				relOid = GetRelOid(record_filenode);
+/*
+ * Returns the name of the database, or an empty string for global objects.
+ * The database must be in the map; see RemoveDroppedDatabases().
+ */
+static char *
+GetDatabaseName(Oid database)
+{
+	DatabaseMapEntry   *entry;
 
-				ereport(log_level, (errmsg("processing filenode %u, relation %u",
-										record_filenode, relOid)));
-				/*
-				 * If the relation has been rewritten/dropped since we saved it,
-				 * just skip it and process the next relation.
-				 */
-				if (relOid == InvalidOid)
-					skip_relation = true;
-				else
-				{
-					skip_relation = false;
+	if (database == InvalidOid)
+		return pstrdup("");
 
-					/* Open the relation */
-					rel = relation_open(relOid, AccessShareLock);
-					RelationOpenSmgr(rel);
-				}
-			}
-			break;
-			case 'f':
-			{
-				record_blocknum = InvalidBlockNumber;
-				nblocks = 0;
+	entry = (DatabaseMapEntry *) hash_search(databaseMap, &database, HASH_FIND, NULL);
 
-				fileRead(&record_forknum, sizeof(ForkNumber), file, false, filepath);
+	if (entry == NULL)
+		elog(ERROR, "database %u not found in the map of database names", database);
 
-				if (skip_relation)
-					continue;
+	return pstrdup(NameStr(entry->dbname));
+}
 
-				if (rel == NULL)
-					ereport(ERROR,
-							(errmsg("found a fork record without a preceeding relation record")));
+/*
+ * The number of buffers in the sorted list, from the given one on, that go in
+ * the same save-file: the rest of the database's, or with
+ * pg_hibernator.tablespace_lanes, the rest of those of the database that are
+ * on the same tablespace.
+ */
+static int
+SavefileLength(const SavedBuffer *saved_buffers, int first, int num_buffers)
+{
+	int			i;
 
-				ereport(log_level, (errmsg("processing fork %d", record_forknum)));
+	for (i = first + 1; i < num_buffers; ++i)
+	{
+		if (saved_buffers[i].database != saved_buffers[first].database
+			|| (guc_tablespace_lanes
+				&& saved_buffers[i].tablespace != saved_buffers[first].tablespace))
+			break;
+	}
 
-				if (!smgrexists(rel->rd_smgr, record_forknum))
-					skip_fork = true;
-				else
-				{
-					skip_fork = false;
+	return i - first;
+}
 
-					nblocks = RelationGetNumberOfBlocksInFork(rel, record_forknum);
-				}
-			}
-			break;
-			case 'b':
-			{
-				if (record_forknum == InvalidForkNumber)
-					ereport(ERROR,
-							(errmsg("found a block record without a preceeding fork record")));
+/*
+ * Write one save-file for each database in the sorted list of buffers, or with
+ * pg_hibernator.tablespace_lanes, for each tablespace of each database.
+ */
+static void
+WriteSavefiles(SavedBuffer *saved_buffers, int num_buffers)
+{
+	int			i;
+	int			database_counter;
 
-				fileRead(&record_blocknum, sizeof(BlockNumber), file, false, filepath);
+	/*
+	 * Database number (and save-file name) 1 is reserverd for storing list of
+	 * buffers of global objects; the sort brings them to the front of the list.
+	 */
+	database_counter = 1;
 
-				if (skip_relation || skip_fork)
-					continue;
+	for (i = 0; i < num_buffers; )
+	{
+		Oid			database = saved_buffers[i].database;
+		char	   *dbname;
+		const char *savefile_path;
+		FILE	   *file;
 
-				/*
-				 * Don't try to read past the file; the file may have been shrunk
-				 * by a vaccum/truncate operation.
-				 */
-				if (record_blocknum >= nblocks)
-				{
-					ereport(log_level,
-							(errmsg("reader %d skipping block filenode %u forknum %d blocknum %u",
-									filenum, record_filenode, record_forknum, record_blocknum)));
+		if (database != InvalidOid || i > 0)
+			++database_counter;
 
-					skip_block = true;
-					continue;
-				}
-				else
-				{
-					Buffer	buf;
+		dbname = GetDatabaseName(database);
 
-					skip_block = false;
+		savefile_path = getSavefileName(database_counter);
+		file = fileOpen(savefile_path, PG_BINARY_W);
+		writeDBName(dbname, file, savefile_path);
 
-					ereport(log_level,
-							(errmsg("reader %d reading block filenode %u forknum %d blocknum %u",
-									filenum, record_filenode, record_forknum, record_blocknum)));
+		i += writeSavefileRecords(&saved_buffers[i],
+								  SavefileLength(saved_buffers, i, num_buffers),
+								  guc_max_gap, file, savefile_path);
 
-					buf = ReadBufferExtended(rel, record_forknum, record_blocknum, RBM_NORMAL, NULL);
-					ReleaseBuffer(buf);
+		SyncFile(file, savefile_path);
+		fileClose(file, savefile_path);
 
-					++blocks_restored;
-				}
-			}
-			break;
-			case 'N':
-			{
-				BlockNumber block;
+		pfree(dbname);
+	}
+}
 
-				Assert(record_blocknum != InvalidBlockNumber);
+/*
+ * Write the sorted list of buffers into a single container, with one section
+ * for each save-file WriteSavefiles() would write, numbered the same way.
+ *
+ * The container is written under a temporary name, and renamed into place
+ * once complete, so that a BlockReader never sees a partial index.
+ */
+static void
+WriteContainer(SavedBuffer *saved_buffers, int num_buffers)
+{
+	int					i;
+	uint32				nsections;
+	uint32				sectionnum;
+	SavefileSection	   *sections;
+	FILE			   *file;
+	const char		   *path = CONTAINER_TEMP_PATH;
 
-				if (record_blocknum == InvalidBlockNumber)
-					ereport(ERROR,
-							(errmsg("found a block range record without a preceeding block record")));
+	/* One section for the global objects, and one for each database or lane. */
+	nsections = 1;
+	for (i = 0; i < num_buffers; i += SavefileLength(saved_buffers, i, num_buffers))
+		if (saved_buffers[i].database != InvalidOid || i > 0)
+			++nsections;
 
-				fileRead(&record_range, sizeof(int), file, false, filepath);
+	sections = (SavefileSection *) palloc0(sizeof(SavefileSection) * nsections);
+	sections[0].flags = SECTION_DONE;	/* In case there are no global objects */
 
-				if (skip_relation || skip_fork || skip_block)
-					continue;
+	file = fileOpen(path, PG_BINARY_W);
+	writeContainerHeader(file, path, nsections);
 
-				ereport(log_level,
-						(errmsg("reader %d reading range filenode %u forknum %d blocknum %u range %u",
-								filenum, record_filenode, record_forknum, record_blocknum, record_range)));
+	sectionnum = 1;
 
-				for (block = record_blocknum + 1; block <= (record_blocknum + record_range); ++block)
-				{
-					Buffer	buf;
+	for (i = 0; i < num_buffers; )
+	{
+		Oid				database = saved_buffers[i].database;
+		char		   *dbname;
+		SavefileSection *section;
+		int				consumed;
 
-					/*
-					* Don't try to read past the file; the file may have been
-					* shrunk by a vaccum operation.
-					*/
-					if (block >= nblocks)
-					{
-						ereport(log_level,
-								(errmsg("reader %d skipping block range filenode %u forknum %d start %u end %u",
-										filenum, record_filenode, record_forknum,
-										block, record_blocknum + record_range)));
+		if (database != InvalidOid || i > 0)
+			++sectionnum;
 
-						break;
-					}
+		Assert(sectionnum <= nsections);
 
-					buf = ReadBufferExtended(rel, record_forknum, block, RBM_NORMAL, NULL);
-					ReleaseBuffer(buf);
+		dbname = GetDatabaseName(database);
 
-					++blocks_restored;
-				}
-			}
-			break;
-			default:
-			{
-				ereport(ERROR,
-						(errmsg("found unexpected save-file marker %x - %c)", record_type, record_type)));
-				Assert(false);
-			}
-			break;
-		}
-	}
+		section = &sections[sectionnum - 1];
+		strlcpy(section->dbname, dbname, NAMEDATALEN);
+		section->database	= database;
+		section->flags		= 0;
+		section->offset		= ftello(file);
 
-	if (rel)
-		relation_close(rel, AccessShareLock);
+		writeDBName(dbname, file, path);
+		consumed = writeSavefileRecords(&saved_buffers[i],
+										SavefileLength(saved_buffers, i, num_buffers),
+										guc_max_gap, file, path);
 
-	ereport(LOG,
-			(errmsg("Block Reader %d: restored %u blocks",
-					filenum, blocks_restored)));
+		section->length		= ftello(file) - section->offset;
+		section->nblocks	= consumed;
 
-	SPI_finish();
-	PopActiveSnapshot();
-	CommitTransactionCommand();
-	pgstat_report_activity(STATE_IDLE, NULL);
+		i += consumed;
+
+		pfree(dbname);
+	}
 
-	fileClose(file, filepath);
+	/* Now that we know where the sections are, fill in the index. */
+	for (sectionnum = 1; sectionnum <= nsections; ++sectionnum)
+		writeContainerSection(file, path, sectionnum, &sections[sectionnum - 1]);
 
-	/* Remove the save-file */
-	if (remove(filepath) != 0)
+	/* Lest a crash after the rename leave a partial container in place */
+	SyncFile(file, path);
+	fileClose(file, path);
+
+	if (rename(path, CONTAINER_PATH) != 0)
 		ereport(ERROR,
 				(errcode_for_file_access(),
-				errmsg("error removing file \"%s\" : %m", filepath)));
+				errmsg("could not rename file \"%s\" to \"%s\": %m",
+						path, CONTAINER_PATH)));
+
+	pfree(sections);
 }
 
+/* Remove all the individual save-files, and the progress of their restore. */
 static void
-BufferSaverMain(Datum main_arg)
+RemoveSavefiles(void)
 {
-	WorkerCommon();
+	DIR			   *dir;
+	const char	   *hibernate_dir = SAVE_LOCATION;
+	struct dirent   *dent;
 
-	RegisterBlockReaders();
+	dir = opendir(hibernate_dir);
+	if (dir == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open directory \"%s\": %m", hibernate_dir)));
 
-	/*
-	 * Main loop: do this until the SIGTERM handler tells us to terminate
-	 */
-	while (!got_sigterm)
+	errno = 0;
+	while ((dent = readdir(dir)) != NULL)
 	{
-		int	rc;
+		int			filenum;
+		const char *path;
 
-		ResetLatch(&MyProc->procLatch);
-		processOnePendingWorker();
-
-		/*
-		 * Wait on the process latch, which sleeps as necessary, but is awakened
-		 * if postmaster dies. This way the background process goes away
-		 * immediately in case of an emergency.
-		 */
-		rc = WaitLatch(&MyProc->procLatch,
-					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   10 * 1000L);
+		if (parseSavefileName(dent->d_name, &filenum))
+			path = getSavefileName(filenum);
+		else if (parseProgressFileName(dent->d_name, &filenum))
+			path = getProgressFileName(filenum);
+		else
+			continue;
 
-		/* emergency bailout if postmaster has died */
-		if (rc & WL_POSTMASTER_DEATH)
-			proc_exit(1);
+		if (unlink(path) != 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					errmsg("error removing file \"%s\" : %m", path)));
 
-		/*
-		 * In case of a SIGHUP, just reload the configuration.
-		 */
-		if (got_sighup)
-		{
-			got_sighup = false;
-			ProcessConfigFile(PGC_SIGHUP);
-		}
+		errno = 0;
 	}
 
-	/*
-	 * We recieved the SIGTERM; Shutdown is in progress, so save the
-	 * shared-buffer contents.
-	 */
+	if (errno != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("error encountered during readdir \"%s\": %m", hibernate_dir)));
 
-	/* Save the buffers only if the extension is enabled. */
-	if (guc_enabled)
-		SaveBuffers();
+	closedir(dir);
+}
 
-	/*
-	 * The worker exits here. A proc_exit(0) is not necessary, we'll let the
-	 * caller do that.
-	 */
+/* Is there a container from the last shutdown? */
+static bool
+ContainerExists(void)
+{
+	struct stat	st;
+
+	if (stat(CONTAINER_PATH, &st) == 0)
+		return true;
+
+	if (errno != ENOENT)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", CONTAINER_PATH)));
+
+	return false;
 }
 
-static void
-SaveBuffers(void)
+static Oid
+GetRelOid(Oid tablespace, Oid filenode)
 {
-	int						i;
-	int						num_buffers;
-	int						log_level		= DEBUG3;
-	SavedBuffer			   *saved_buffers;
-	volatile BufferDesc	   *bufHdr;			// XXX: Do we really need volatile here?
-	FILE				   *file			= NULL;
-	int						database_counter= 0;
-	Oid						prev_database	= InvalidOid;
-	Oid						prev_filenode	= InvalidOid;
-	ForkNumber				prev_forknum	= InvalidForkNumber;
-	BlockNumber				prev_blocknum	= InvalidBlockNumber;
-	BlockNumber				range_counter	= 0;
-	const char			   *savefile_path;
+	int			ret;
+	Oid			relid;
+	bool		isnull;
+	Datum		value[1] = { ObjectIdGetDatum(filenode) };
+
+	static SPIPlanPtr	plan = NULL;
 
 	/*
-	 * XXX: If the memory request fails, ask for a smaller memory chunk, and use
-	 * it to create chunks of save-files, and make the workers read those chunks.
-	 *
-	 * This is not a concern as of now, so deferred; there's at least one other
-	 * place that allocates (NBuffers * (much_bigger_struct)), so this seems to
-	 * be an acceptable practice.
+	 * Use the relfilenode map, which is cached, and looks up pg_class by index;
+	 * the query below scans all of pg_class, which adds up over many thousands
+	 * of relations. Save-files that predate 't' records don't tell us the
+	 * tablespace the map needs. In pg_class, the database's default tablespace
+	 * is zero.
 	 */
+	if (tablespace != InvalidOid)
+		return RelidByRelfilenode(tablespace == MyDatabaseTableSpace ? InvalidOid : tablespace,
+								  filenode);
 
-	saved_buffers = (SavedBuffer *) palloc(sizeof(SavedBuffer) * NBuffers);
+	/*
+	 * If this is our first time here, create a plan and save it for later
+	 * calls; it has to outlive the transaction, since we commit every so often.
+	 */
+	if (plan == NULL)
+	{
+		StringInfoData	buf;
+		Oid	paramType[1] = {OIDOID};
 
-	/* Lock the buffer partitions for reading. */
-	for (i = 0; i < NUM_BUFFER_PARTITIONS; ++i)
-		LWLockAcquire(BufMappingPartitionLockByIndex(i), LW_SHARED);
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "select oid from pg_class where pg_relation_filenode(oid) = $1");
 
-	/* Scan and save a list of valid buffers. */
-	for (num_buffers = 0, i = 0, bufHdr = BufferDescriptors; i < NBuffers; ++i, ++bufHdr)
-	{
-		/* Lock each buffer header before inspecting. */
-		LockBufHdr(bufHdr);
+		plan = SPI_prepare(buf.data, 1, (Oid*)&paramType);
 
-		/* Skip invalid buffers */
-		if ((bufHdr->flags & BM_VALID) && (bufHdr->flags & BM_TAG_VALID))
-		{
-			saved_buffers[num_buffers].database	= bufHdr->tag.rnode.dbNode;
-			saved_buffers[num_buffers].filenode	= bufHdr->tag.rnode.relNode;
-			saved_buffers[num_buffers].forknum	= bufHdr->tag.forkNum;
-			saved_buffers[num_buffers].blocknum	= bufHdr->tag.blockNum;
+		if (plan == NULL)
+			elog(ERROR, "SPI_prepare returned %d", SPI_result);
 
-			++num_buffers;
-		}
+		if (SPI_keepplan(plan) != 0)
+			elog(ERROR, "SPI_keepplan failed");
 
-		UnlockBufHdr(bufHdr);
+		pfree(buf.data);
 	}
 
-	/* Unlock the buffer partitions in reverse order, to avoid a deadlock. */
-	for (i = NUM_BUFFER_PARTITIONS - 1; i >= 0; --i)
-		LWLockRelease(BufMappingPartitionLockByIndex(i));
-
-	/*
-	 * Sort the list, so that we can optimize the storage of these buffers.
-	 *
-	 * The side-effect of this storage optimization is that when reading the
-	 * blocks back from relation forks, it leads to sequential reads, which
-	 * improve the restore speeds quite considerably as compared to random reads
-	 * from different blocks all over the data directory.
-	 */
-	pg_qsort(saved_buffers, num_buffers, sizeof(SavedBuffer), SavedBufferCmp);
+	ret = SPI_execute_plan(plan, (Datum*)&value, NULL, true, 1);
 
-	/* Connect to the database and start a transaction for database name lookups. */
-	BackgroundWorkerInitializeConnection(guc_default_database, NULL);
-	SetCurrentStatementStartTimestamp();
-	StartTransactionCommand();
-	PushActiveSnapshot(GetTransactionSnapshot());
-	pgstat_report_activity(STATE_RUNNING, "saving buffers");
+	if (ret != SPI_OK_SELECT)
+		ereport(FATAL, (errmsg("SPI_execute_plan failed: error code %d", ret)));
 
-	for (i = 0; i < num_buffers; ++i)
+	relid = InvalidOid;
+	if (SPI_processed >= 1)
 	{
-		int j;
-		SavedBuffer *buf = &saved_buffers[i];
-
-		if (i == 0)
-		{
-			/*
-			 * Special case for global objects. The sort brings them to the
-			 * front of the list.
-			 */
-
-			/* Make sure the first buffer we save belongs to global object. */
-			Assert(buf->database == InvalidOid);
+		relid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0],
+												SPI_tuptable->tupdesc, 1, &isnull));
+		if (isnull)
+			relid = InvalidOid;
+	}
 
-			/*
-			 * Database number (and save-file name) 1 is reserverd for storing
-			 * list of buffers of global objects.
-			 */
-			database_counter = 1;
+	SPI_freetuptable(SPI_tuptable);
 
-			savefile_path = getSavefileName(database_counter);
-			file = fileOpen(savefile_path, PG_BINARY_W);
-			writeDBName("", file, savefile_path);
+	return relid;
+}
 
-			prev_database = buf->database;
-		}
+/*
+ * The controls that apply to the restore of the given database; see
+ * SetRestoreControl().
+ */
+static uint32
+RestoreControlFlags(Oid database)
+{
+	uint32		flags;
+	int			i;
 
-		if (buf->database != prev_database)
-		{
-			char *dbname;
+	if (shared_state == NULL)
+		return 0;
 
-			/*
-			 * We are beginning to process a different database than the
-			 * previous one; close the save-file of previous database, and open
-			 * a new one.
-			 */
-			++database_counter;
+	SpinLockAcquire(&shared_state->mutex);
+	flags = shared_state->control_flags;
+	for (i = 0; i < shared_state->ncontrols; ++i)
+	{
+		if (shared_state->controls[i].database != database)
+			continue;
 
-			dbname = get_database_name(buf->database);
+		if (shared_state->controls[i].flags & CONTROL_RESUMED)
+			flags &= ~CONTROL_PAUSE;
+		flags |= shared_state->controls[i].flags & ~CONTROL_RESUMED;
+	}
+	SpinLockRelease(&shared_state->mutex);
 
-			Assert(dbname != NULL);
+	return flags;
+}
 
-			if (file != NULL)
-				fileClose(file, savefile_path);
+/*
+ * Wait while the restore of the given database is paused. Returns false if
+ * it's been cancelled, or we've been asked to stop; the caller should then
+ * stop, keeping the rest of the save-file for later.
+ */
+static bool
+WaitWhilePaused(int filenum, Oid database)
+{
+	bool		paused = false;
+	uint32		flags;
+	int			rc;
 
-			savefile_path = getSavefileName(database_counter);
-			file = fileOpen(savefile_path, PG_BINARY_W);
-			writeDBName(dbname, file, savefile_path);
+	for (;;)
+	{
+		flags = RestoreControlFlags(database);
 
-			pfree(dbname);
+		if (flags & CONTROL_CANCEL)
+			restoreCancelled = true;
 
-			/* Reset trackers appropriately */
-			prev_database	= buf->database;
-			prev_filenode	= InvalidOid;
-			prev_forknum	= InvalidForkNumber;
-			prev_blocknum	= InvalidBlockNumber;
-			range_counter	= 0;
-		}
+		if (restoreCancelled || got_sigterm || !(flags & CONTROL_PAUSE))
+			break;
 
-		if (buf->filenode != prev_filenode)
+		if (!paused)
 		{
-			/* We're beginning to process a new relation; emit a record for it. */
-			fileWrite("r", 1, file, savefile_path);
-			fileWrite(&(buf->filenode), sizeof(Oid), file, savefile_path);
-
-			/* Reset trackers appropriately */
-			prev_filenode	= buf->filenode;
-			prev_forknum	= InvalidForkNumber;
-			prev_blocknum	= InvalidBlockNumber;
-			range_counter	= 0;
+			FlushDropBatch();
+			ereport(LOG,
+					(errmsg("Block Reader %d: restore paused", filenum)));
+			pgstat_report_activity(STATE_RUNNING, "restore paused");
+			ReportPaused(true);
+			paused = true;
 		}
 
-		if (buf->forknum != prev_forknum)
-		{
-			/*
-			 * We're beginning to process a new fork of this relation; add a
-			 * record for it.
-			 */
-			fileWrite("f", 1, file, savefile_path);
-			fileWrite(&(buf->forknum), sizeof(ForkNumber), file, savefile_path);
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   1000L);
+		ResetLatch(&MyProc->procLatch);
 
-			/* Reset trackers appropriately */
-			prev_forknum	= buf->forknum;
-			prev_blocknum	= InvalidBlockNumber;
-			range_counter	= 0;
-		}
+		/* emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
 
-		ereport(log_level,
-				(errmsg("writer: writing block db %d filenode %d forknum %d blocknum %d",
-						database_counter, prev_filenode, prev_forknum, buf->blocknum)));
+	if (paused)
+		ReportPaused(false);
 
-		fileWrite("b", 1, file, savefile_path);
-		fileWrite(&(buf->blocknum), sizeof(BlockNumber), file, savefile_path);
+	if (restoreCancelled || got_sigterm)
+		return false;
 
-		prev_blocknum = buf->blocknum;
+	if (paused)
+	{
+		ereport(LOG,
+				(errmsg("Block Reader %d: restore resumed", filenum)));
+		pgstat_report_activity(STATE_RUNNING, "restoring buffers");
+	}
 
-		/*
-		 * If a continuous range of blocks follows this block, then emit one
-		 * entry for the range, instead of one for each block.
-		 */
-		range_counter = 0;
+	return true;
+}
 
-		for ( j = i+1; j < num_buffers; ++j)
-		{
-			SavedBuffer *tmp = &saved_buffers[j];
+/*
+ * Open the relation with the given OID, and take a lock on it; but only if we
+ * can have the lock right away. The restore isn't worth holding up anyone's
+ * DDL for, nor is it worth waiting behind it. Returns NULL if someone else
+ * holds, or is waiting for, a conflicting lock, and sets *busy; the caller may
+ * try again later. Also returns NULL if the relation has been dropped, or now
+ * stores its blocks in a relfilenode other than the given one.
+ */
+static Relation
+OpenRelation(Oid relOid, Oid filenode, bool *busy)
+{
+	Relation	rel;
 
-			if (tmp->database		== prev_database
-				&& tmp->filenode	== prev_filenode
-				&& tmp->forknum		== prev_forknum
-				&& tmp->blocknum	== (prev_blocknum + range_counter + 1))
-			{
-				++range_counter;
-			}
-		}
+	*busy = false;
 
-		if (range_counter != 0)
-		{
-			ereport(log_level,
-				(errmsg("writer: writing range db %d filenode %d forknum %d blocknum %d range %d",
-						database_counter, prev_filenode, prev_forknum, prev_blocknum, range_counter)));
+	if (!ConditionalLockRelationOid(relOid, AccessShareLock))
+	{
+		*busy = true;
+		return NULL;
+	}
 
-			fileWrite("N", 1, file, savefile_path);
-			fileWrite(&range_counter, sizeof(range_counter), file, savefile_path);
+	/* Now that we hold the lock, the relation can't go away under us. */
+	if (!SearchSysCacheExists1(RELOID, ObjectIdGetDatum(relOid)))
+	{
+		UnlockRelationOid(relOid, AccessShareLock);
+		return NULL;
+	}
 
-			i += range_counter;
-		}
+	rel = relation_open(relOid, NoLock);
+
+	if (rel->rd_node.relNode != filenode)
+	{
+		relation_close(rel, AccessShareLock);
+		return NULL;
 	}
 
-	ereport(LOG,
-			(errmsg("Buffer Saver: saved metadata of %d blocks", num_buffers)));
+	return rel;
+}
+
+/*
+ * Let go of the lock on the relation, so that any DDL waiting for it can go
+ * ahead, and take it back as OpenRelation() does. On success, also returns the
+ * relation's smgr, and the current size of the given fork, which may have
+ * changed meanwhile.
+ *
+ * If we've been asked to pause, returns NULL with *busy set, so that the caller
+ * comes back for the rest of the relation; ReadBlocks() pauses between
+ * transactions, rather than here, holding back everyone's snapshots. If the
+ * restore has been cancelled, returns NULL with *busy unset.
+ */
+static Relation
+RelockRelation(Relation rel, ForkNumber forknum, SMgrRelation *smgr,
+			   BlockNumber *nblocks, bool *busy)
+{
+	Oid			relOid = RelationGetRelid(rel);
+	Oid			filenode = rel->rd_node.relNode;
+	uint32		flags = RestoreControlFlags(rel->rd_node.dbNode);
 
-	Assert(file != NULL);
-	fileClose(file, savefile_path);
+	relation_close(rel, AccessShareLock);
 
-	pfree(saved_buffers);
+	if (flags & CONTROL_CANCEL)
+		restoreCancelled = true;
 
-	PopActiveSnapshot();
-	CommitTransactionCommand();
-	pgstat_report_activity(STATE_IDLE, NULL);
-}
+	if (restoreCancelled || got_sigterm || (flags & CONTROL_PAUSE))
+	{
+		*busy = !restoreCancelled && !got_sigterm;
+		return NULL;
+	}
 
-#define svdbfrcmp(fld)			\
-	if (a->fld < b->fld)		\
-		return -1;				\
-	else if (a->fld > b->fld)	\
-		return 1;
+	rel = OpenRelation(relOid, filenode, busy);
+	if (rel == NULL)
+		return NULL;
 
-static int
-SavedBufferCmp(const void *p, const void *q)
+	RelationOpenSmgr(rel);
+	*smgr = rel->rd_smgr;
+	*nblocks = smgrexists(*smgr, forknum) ? smgrnblocks(*smgr, forknum) : 0;
+
+	return rel;
+}
+
+/*
+ * Note that a relation was found locked, so that ReadBlocks() can come back
+ * for it, and the blocks from the one after done_forknum and done_blocknum on,
+ * once it's done with the rest of the save-file. The list is kept in the given
+ * memory context.
+ */
+static void
+DeferRelation(List **deferred, MemoryContext context, const SavefileProgress *mark,
+			  ForkNumber done_forknum, BlockNumber done_blocknum)
 {
-	SavedBuffer *a = (SavedBuffer *) p;
-	SavedBuffer *b = (SavedBuffer *) q;
+	MemoryContext		oldcontext = MemoryContextSwitchTo(context);
+	SavefileProgress   *entry = (SavefileProgress *) palloc(sizeof(SavefileProgress));
 
-	svdbfrcmp(database);
-	svdbfrcmp(filenode);
-	svdbfrcmp(forknum);
-	svdbfrcmp(blocknum);
+	*entry = *mark;
+	entry->forknum	= done_forknum;
+	entry->blocknum	= done_blocknum;
 
-	Assert(false);	// No two buffers should be storing identical page
+	*deferred = lappend(*deferred, entry);
 
-	return 0;	// Keep compiler happy.
+	MemoryContextSwitchTo(oldcontext);
+
+	hibernator_trace("deferring relation at offset %lu", (unsigned long) mark->position);
 }
 
-static Oid
-GetRelOid(Oid filenode)
+/*
+ * Pick the next relation to go back for, from the ones found locked. Those
+ * found locked again are gone back for in the next round, after a pause, up to
+ * DEFERRAL_ROUNDS rounds. Returns false when there are none left, or we've
+ * given up on them.
+ */
+static bool
+NextDeferredRelation(int filenum, List **deferred, List **retries, int *round,
+					 SavefileProgress *mark)
 {
-	int			ret;
-	Oid			relid;
-	bool		isnull;
-	Datum		value[1] = { ObjectIdGetDatum(filenode) };
-
-	static SPIPlanPtr	plan = NULL;
+	SavefileProgress   *entry;
 
-	/* If this is our first time here, create a plan and save it for later calls. */
-	if (plan == NULL)
+	if (*retries == NIL)
 	{
-		StringInfoData	buf;
-		Oid	paramType[1] = {OIDOID};
+		if (*deferred == NIL)
+			return false;
 
-		initStringInfo(&buf);
-		appendStringInfo(&buf, "select oid from pg_class where pg_relation_filenode(oid) = $1");
+		if (++*round > DEFERRAL_ROUNDS)
+		{
+			ereport(LOG,
+					(errmsg("Block Reader %d: giving up on %d relations that stayed locked",
+							filenum, list_length(*deferred))));
 
-		plan = SPI_prepare(buf.data, 1, (Oid*)&paramType);
+			list_free_deep(*deferred);
+			*deferred = NIL;
+			return false;
+		}
 
-		if (plan == NULL)
-			elog(ERROR, "SPI_prepare returned %d", SPI_result);
-	}
+		/* Give the lockers a moment before we go back again. */
+		if (*round > 1)
+		{
+			int		rc;
 
-	ret = SPI_execute_plan(plan, (Datum*)&value, NULL, true, 1);
+			rc = WaitLatch(&MyProc->procLatch,
+						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+						   1000L);
+			ResetLatch(&MyProc->procLatch);
 
-	if (ret != SPI_OK_SELECT)
-		ereport(FATAL, (errmsg("SPI_execute_plan failed: error code %d", ret)));
+			/* emergency bailout if postmaster has died */
+			if (rc & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+		}
 
-	if (SPI_processed < 1)
-		return InvalidOid;
+		*retries = *deferred;
+		*deferred = NIL;
+	}
 
-	relid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0],
-											SPI_tuptable->tupdesc, 1, &isnull));
-	if (isnull)
-		return InvalidOid;
+	entry = (SavefileProgress *) linitial(*retries);
+	*retries = list_delete_first(*retries);
 
-	return relid;
+	*mark = *entry;
+	pfree(entry);
+
+	return true;
 }
 
 #endif /* PG_VERSION_NUM >= 90400 */
@@ -0,0 +1,131 @@
+/* pg_hibernator--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_hibernator" to load this file. \quit
+
+-- Wait until the given fraction of the saved blocks (or of the blocks of the
+-- hottest tier) has been restored; returns false if the timeout, in seconds,
+-- expires first. A NULL timeout waits forever.
+CREATE FUNCTION pg_hibernator_wait(
+	target_fraction float8 DEFAULT 1.0,
+	timeout float8 DEFAULT NULL,
+	hottest_tier boolean DEFAULT false)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pg_hibernator_wait'
+LANGUAGE C VOLATILE;
+
+-- Progress of the restore: blocks planned and restored so far, blocks read only
+-- to bridge gaps between saved blocks, and BlockReaders still running.
+CREATE FUNCTION pg_hibernator_progress(
+	OUT planned_blocks int8,
+	OUT done_blocks int8,
+	OUT gap_blocks int8,
+	OUT readers_left int4)
+RETURNS record
+AS 'MODULE_PATHNAME', 'pg_hibernator_progress'
+LANGUAGE C VOLATILE;
+
+-- Pause, resume or cancel the restore of the given database, or of all of them.
+-- A cancelled restore keeps the rest of its save-file for the next startup.
+CREATE FUNCTION pg_hibernator_pause(database name DEFAULT NULL)
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_hibernator_pause'
+LANGUAGE C CALLED ON NULL INPUT VOLATILE;
+
+CREATE FUNCTION pg_hibernator_resume(database name DEFAULT NULL)
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_hibernator_resume'
+LANGUAGE C CALLED ON NULL INPUT VOLATILE;
+
+CREATE FUNCTION pg_hibernator_cancel(database name DEFAULT NULL)
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_hibernator_cancel'
+LANGUAGE C CALLED ON NULL INPUT VOLATILE;
+
+-- Number of BlockReaders to run at once from now on; 0 for the default.
+CREATE FUNCTION pg_hibernator_set_max_readers(max_readers int4)
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_hibernator_set_max_readers'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION pg_hibernator_pause(name) FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_hibernator_resume(name) FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_hibernator_cancel(name) FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_hibernator_set_max_readers(int4) FROM PUBLIC;
+
+-- Blocks the BlockReaders loaded of each relation, and how many of those were
+-- used before being evicted.
+CREATE FUNCTION pg_hibernator_restore_stats(
+	OUT database oid,
+	OUT tablespace oid,
+	OUT relfilenode oid,
+	OUT blocks_restored int8,
+	OUT blocks_used int8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_hibernator_restore_stats'
+LANGUAGE C VOLATILE;
+
+REVOKE ALL ON FUNCTION pg_hibernator_restore_stats() FROM PUBLIC;
+
+-- The relation is known only for the current database and the shared catalogs.
+CREATE VIEW pg_hibernator_relation_efficacy AS
+	SELECT s.database, d.datname, s.tablespace, s.relfilenode,
+		   CASE WHEN s.database IN (0, (SELECT oid FROM pg_database
+										WHERE datname = current_database()))
+				THEN pg_filenode_relation(s.tablespace, s.relfilenode)
+		   END AS relation,
+		   s.blocks_restored, s.blocks_used,
+		   round(s.blocks_used::numeric / nullif(s.blocks_restored, 0), 3) AS used_fraction
+	  FROM pg_hibernator_restore_stats() s
+	  LEFT JOIN pg_database d ON d.oid = s.database;
+
+CREATE VIEW pg_hibernator_database_efficacy AS
+	SELECT s.database, d.datname,
+		   sum(s.blocks_restored) AS blocks_restored,
+		   sum(s.blocks_used) AS blocks_used,
+		   round(sum(s.blocks_used) / nullif(sum(s.blocks_restored), 0), 3) AS used_fraction
+	  FROM pg_hibernator_restore_stats() s
+	  LEFT JOIN pg_database d ON d.oid = s.database
+	 GROUP BY s.database, d.datname;
+
+-- What the next restore will read, per fork of each relation in the save-files:
+-- blocks yet to be restored, those within the fork's current size, the runs of
+-- consecutive blocks they make, and estimates of the bytes read and the time
+-- taken. Decodes the save-files, without reading any blocks.
+CREATE FUNCTION pg_hibernator_plan(
+	OUT database oid,
+	OUT tablespace oid,
+	OUT relfilenode oid,
+	OUT fork text,
+	OUT blocks_listed int8,
+	OUT blocks_valid int8,
+	OUT runs int8,
+	OUT est_bytes int8,
+	OUT est_seconds float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_hibernator_plan'
+LANGUAGE C VOLATILE;
+
+REVOKE ALL ON FUNCTION pg_hibernator_plan() FROM PUBLIC;
+
+-- The relation is known only for the current database and the shared catalogs.
+CREATE VIEW pg_hibernator_relation_plan AS
+	SELECT p.database, d.datname, p.tablespace, p.relfilenode,
+		   CASE WHEN p.database IN (0, (SELECT oid FROM pg_database
+										WHERE datname = current_database()))
+				THEN pg_filenode_relation(p.tablespace, p.relfilenode)
+		   END AS relation,
+		   p.fork, p.blocks_listed, p.blocks_valid, p.runs, p.est_bytes, p.est_seconds
+	  FROM pg_hibernator_plan() p
+	  LEFT JOIN pg_database d ON d.oid = p.database;
+
+CREATE VIEW pg_hibernator_database_plan AS
+	SELECT p.database, d.datname,
+		   sum(p.blocks_listed) AS blocks_listed,
+		   sum(p.blocks_valid) AS blocks_valid,
+		   sum(p.runs) AS runs,
+		   sum(p.est_bytes) AS est_bytes,
+		   sum(p.est_seconds) AS est_seconds
+	  FROM pg_hibernator_plan() p
+	  LEFT JOIN pg_database d ON d.oid = p.database
+	 GROUP BY p.database, d.datname;
@@ -1,7 +1,10 @@
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifndef FRONTEND
+
 /* These are always necessary for a bgworker */
 #include "miscadmin.h"
 #include "postmaster/bgworker.h"
@@ -12,22 +15,59 @@
 #include "storage/shmem.h"
 
 /* Header files needed by this extension */
+#include "access/clog.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/multixact.h"
+#include "access/nbtree.h"
+#include "access/slru.h"
 #include "access/xact.h"
+#include "catalog/pg_database.h"
 #include "catalog/pg_type.h"
 #include "commands/dbcommands.h"
+#include "executor/executor.h"
+#include "executor/instrument.h"
 #include "executor/spi.h"
 #include "fmgr.h"
+#include "funcapi.h"
+#include "lib/binaryheap.h"
 #include "nodes/pg_list.h"
 #include "pgstat.h"
 #include "storage/block.h"
 #include "storage/buf_internals.h"
 #include "storage/bufmgr.h"
 #include "storage/fd.h"
+#include "storage/lmgr.h"
 #include "storage/relfilenode.h"
+#include "storage/smgr.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/resowner.h"
 #include "utils/snapmgr.h"
 #include "utils/rel.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+
+/* Not in 9.3; only pg_hibernate.c, which is 9.4-only, uses them. */
+#if PG_VERSION_NUM >= 90400
+#include "storage/dsm.h"
+#include "utils/relfilenodemap.h"
+#endif
+
+#else
+
+/*
+ * misc.c and savefile.c are also compiled into frontend programs (see tests/).
+ * Those programs supply this function; it reports the error and must not
+ * return.
+ */
+extern void		hibernator_error(const char *fmt,...);
+
+#endif   /* FRONTEND */
 
 /* Functions defined in misc.c */
 extern bool		parseSavefileName(const char *fname, int *filenum);
@@ -38,7 +78,19 @@ extern bool		fileWrite(const void *src, size_t size, FILE *file, const char *pat
 extern bool		writeDBName(const char *dbname, FILE *file, const char *path);
 extern char*	readDBName(FILE *file, const char *path);
 extern const char* getSavefileName(int filenum);
+extern const char* getProgressFileName(int filenum);
+extern bool		parseProgressFileName(const char *fname, int *filenum);
 
 /* Constants */
 #define SAVE_LOCATION "pg_hibernator"
+#define CONTAINER_PATH			SAVE_LOCATION "/all.save"
+#define CONTAINER_TEMP_PATH		SAVE_LOCATION "/all.save.tmp"
+#define READY_FILE_PATH			SAVE_LOCATION "/ready"
+#define HISTORY_PATH			SAVE_LOCATION "/history"
+#define THROUGHPUT_PATH			SAVE_LOCATION "/throughput"
+#define JOURNAL_PATH			SAVE_LOCATION "/journal"
+#define SLRU_PATH				SAVE_LOCATION "/slru"
+
+/* Mode for updating a file in place; c.h doesn't provide one. */
+#define PG_BINARY_RW	"r+b"
 
@@ -0,0 +1,49 @@
+/*
+ * Tracing of the save and restore loops.
+ *
+ * The static probes (see probes.d) cost nothing unless a tracer is attached,
+ * and are compiled in only if Postgres was configured with --enable-dtrace.
+ *
+ * hibernator_trace() emits a DEBUG3 message per record or block; it's meant for
+ * debugging the extension, and is compiled in only with -DHIBERNATOR_TRACE
+ * (make TRACE=1), since even a filtered-out ereport() costs a function call.
+ */
+#ifndef PG_HIBERNATOR_TRACE_H
+#define PG_HIBERNATOR_TRACE_H
+
+#ifdef HIBERNATOR_DTRACE
+
+#include "probes.h"
+
+#else
+
+#define TRACE_PG_HIBERNATOR_SAVEFILE_OPEN(INT1, INT2, INT3) do {} while (0)
+#define TRACE_PG_HIBERNATOR_SAVEFILE_OPEN_ENABLED() (0)
+#define TRACE_PG_HIBERNATOR_RELATION_OPEN(INT1, INT2, INT3, INT4) do {} while (0)
+#define TRACE_PG_HIBERNATOR_RELATION_OPEN_ENABLED() (0)
+#define TRACE_PG_HIBERNATOR_FORK_SIZE(INT1, INT2, INT3) do {} while (0)
+#define TRACE_PG_HIBERNATOR_FORK_SIZE_ENABLED() (0)
+#define TRACE_PG_HIBERNATOR_BLOCK_READ_START(INT1, INT2, INT3, INT4, INT5) do {} while (0)
+#define TRACE_PG_HIBERNATOR_BLOCK_READ_START_ENABLED() (0)
+#define TRACE_PG_HIBERNATOR_BLOCK_READ_DONE(INT1, INT2, INT3, INT4, INT5) do {} while (0)
+#define TRACE_PG_HIBERNATOR_BLOCK_READ_DONE_ENABLED() (0)
+#define TRACE_PG_HIBERNATOR_RANGE_DONE(INT1, INT2, INT3, INT4) do {} while (0)
+#define TRACE_PG_HIBERNATOR_RANGE_DONE_ENABLED() (0)
+#define TRACE_PG_HIBERNATOR_SAVEFILE_DONE(INT1, INT2) do {} while (0)
+#define TRACE_PG_HIBERNATOR_SAVEFILE_DONE_ENABLED() (0)
+#define TRACE_PG_HIBERNATOR_SAVE_START() do {} while (0)
+#define TRACE_PG_HIBERNATOR_SAVE_START_ENABLED() (0)
+#define TRACE_PG_HIBERNATOR_SAVE_DONE(INT1) do {} while (0)
+#define TRACE_PG_HIBERNATOR_SAVE_DONE_ENABLED() (0)
+
+#endif   /* HIBERNATOR_DTRACE */
+
+#ifdef HIBERNATOR_TRACE
+#define hibernator_trace(...) \
+	ereport(DEBUG3, (errmsg(__VA_ARGS__)))
+#else
+#define hibernator_trace(...) \
+	((void) 0)
+#endif
+
+#endif   /* PG_HIBERNATOR_TRACE_H */
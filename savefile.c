@@ -0,0 +1,674 @@
+
+#ifndef FRONTEND
+#include "postgres.h"
+#else
+#include "postgres_fe.h"
+#endif
+
+#include "pg_hibernator.h"
+#include "savefile.h"
+
+#ifndef FRONTEND
+#define savefileError(path, msg, ...) \
+	ereport(ERROR, \
+			(errmsg("invalid save-file \"%s\": " msg, path, ##__VA_ARGS__)))
+#else
+#define savefileError(path, msg, ...) \
+	hibernator_error("invalid save-file \"%s\": " msg, path, ##__VA_ARGS__)
+#endif
+
+#define svdbfrcmp(fld)			\
+	if (a->fld < b->fld)		\
+		return -1;				\
+	else if (a->fld > b->fld)	\
+		return 1;
+
+int
+SavedBufferCmp(const void *p, const void *q)
+{
+	SavedBuffer *a = (SavedBuffer *) p;
+	SavedBuffer *b = (SavedBuffer *) q;
+
+	svdbfrcmp(database);
+	svdbfrcmp(priority);
+	svdbfrcmp(tablespace);
+	svdbfrcmp(filenode);
+	svdbfrcmp(forknum);
+	svdbfrcmp(blocknum);
+
+	Assert(false);	// No two buffers should be storing identical page
+
+	return 0;	// Keep compiler happy.
+}
+
+/*
+ * Like SavedBufferCmp(), but ordering the buffers of a database by tablespace
+ * before priority; for writing a save-file for each tablespace of a database,
+ * each in priority order.
+ */
+int
+SavedBufferLaneCmp(const void *p, const void *q)
+{
+	SavedBuffer *a = (SavedBuffer *) p;
+	SavedBuffer *b = (SavedBuffer *) q;
+
+	svdbfrcmp(database);
+	svdbfrcmp(tablespace);
+	svdbfrcmp(priority);
+	svdbfrcmp(filenode);
+	svdbfrcmp(forknum);
+	svdbfrcmp(blocknum);
+
+	Assert(false);	// No two buffers should be storing identical page
+
+	return 0;	// Keep compiler happy.
+}
+
+/*
+ * Like SavedBufferCmp(), but ignoring the priority; for finding the entries
+ * that identify the same block.
+ */
+int
+SavedBufferTagCmp(const void *p, const void *q)
+{
+	SavedBuffer *a = (SavedBuffer *) p;
+	SavedBuffer *b = (SavedBuffer *) q;
+
+	svdbfrcmp(database);
+	svdbfrcmp(tablespace);
+	svdbfrcmp(filenode);
+	svdbfrcmp(forknum);
+	svdbfrcmp(blocknum);
+
+	return 0;
+}
+
+/*
+ * Write the records for the buffers at the front of the sorted array that
+ * belong to the same database as the first buffer. The database name must
+ * already have been written by the caller.
+ *
+ * Runs of blocks separated by gaps of up to max_gap blocks are covered by
+ * spans; zero disables spans.
+ *
+ * Returns the number of buffers consumed, so that the caller can move on to
+ * the next database.
+ */
+int
+writeSavefileRecords(const SavedBuffer *buffers, int num_buffers,
+					 BlockNumber max_gap, FILE *file, const char *path)
+{
+	int			i;
+	Oid			database		= buffers[0].database;
+	bool		first			= true;
+	uint32		prev_priority	= 0;
+	Oid			prev_tablespace	= InvalidOid;
+	Oid			prev_filenode	= InvalidOid;
+	ForkNumber	prev_forknum	= InvalidForkNumber;
+	BlockNumber	prev_blocknum	= InvalidBlockNumber;
+	BlockNumber	range_counter	= 0;
+	BlockNumber	span_end		= InvalidBlockNumber;
+	uint8		prev_usage		= 0;
+
+	/* Record the database OID, so that the blocks can be read without a connection. */
+	fileWrite("d", 1, file, path);
+	fileWrite(&database, sizeof(Oid), file, path);
+
+	for (i = 0; i < num_buffers; ++i)
+	{
+		int j;
+		const SavedBuffer *buf = &buffers[i];
+
+		if (buf->database != database)
+			break;
+
+		if (first || buf->priority != prev_priority)
+		{
+			/* We're beginning to process blocks of a new priority. */
+			fileWrite("p", 1, file, path);
+			fileWrite(&(buf->priority), sizeof(uint32), file, path);
+
+			/* Reset trackers appropriately */
+			first			= false;
+			prev_priority	= buf->priority;
+			prev_tablespace	= InvalidOid;
+			prev_filenode	= InvalidOid;
+			prev_forknum	= InvalidForkNumber;
+			prev_blocknum	= InvalidBlockNumber;
+		}
+
+		if (buf->tablespace != prev_tablespace)
+		{
+			/* We're beginning to process relations of a new tablespace. */
+			fileWrite("t", 1, file, path);
+			fileWrite(&(buf->tablespace), sizeof(Oid), file, path);
+
+			/* Reset trackers appropriately */
+			prev_tablespace	= buf->tablespace;
+			prev_filenode	= InvalidOid;
+			prev_forknum	= InvalidForkNumber;
+			prev_blocknum	= InvalidBlockNumber;
+		}
+
+		if (buf->filenode != prev_filenode)
+		{
+			/* We're beginning to process a new relation; emit a record for it. */
+			fileWrite("r", 1, file, path);
+			fileWrite(&(buf->filenode), sizeof(Oid), file, path);
+
+			/* Reset trackers appropriately */
+			prev_filenode	= buf->filenode;
+			prev_forknum	= InvalidForkNumber;
+			prev_blocknum	= InvalidBlockNumber;
+		}
+
+		if (buf->forknum != prev_forknum)
+		{
+			/*
+			 * We're beginning to process a new fork of this relation; add a
+			 * record for it.
+			 */
+			fileWrite("f", 1, file, path);
+			fileWrite(&(buf->forknum), sizeof(ForkNumber), file, path);
+
+			/* Reset trackers appropriately */
+			prev_forknum	= buf->forknum;
+			prev_blocknum	= InvalidBlockNumber;
+			prev_usage		= 0;
+		}
+
+		if (buf->usage != prev_usage)
+		{
+			uint32	usage = buf->usage;
+
+			fileWrite("u", 1, file, path);
+			fileWrite(&usage, sizeof(uint32), file, path);
+
+			prev_usage = buf->usage;
+		}
+
+		fileWrite("b", 1, file, path);
+		fileWrite(&(buf->blocknum), sizeof(BlockNumber), file, path);
+
+		/*
+		 * Unless this block is in a span already, or among the blocks the last
+		 * search found contiguous, see if one starting here would bridge any
+		 * gaps. Spans don't cross forks; a new fork is when
+		 * prev_blocknum is invalid.
+		 */
+		if (max_gap > 0
+			&& (prev_blocknum == InvalidBlockNumber || span_end == InvalidBlockNumber
+				|| buf->blocknum > span_end))
+		{
+			BlockNumber	last = buf->blocknum;
+			bool		bridged = false;
+
+			for (j = i+1; j < num_buffers; ++j)
+			{
+				const SavedBuffer *tmp = &buffers[j];
+
+				if (tmp->database		!= database
+					|| tmp->priority	!= prev_priority
+					|| tmp->tablespace	!= prev_tablespace
+					|| tmp->filenode	!= prev_filenode
+					|| tmp->forknum		!= prev_forknum
+					|| tmp->blocknum - last - 1 > max_gap
+					|| tmp->blocknum - buf->blocknum >= MAX_SPAN_BLOCKS)
+					break;
+
+				if (tmp->blocknum != last + 1)
+					bridged = true;
+
+				last = tmp->blocknum;
+			}
+
+			/*
+			 * Even without a span, the blocks up to the last one looked at are
+			 * contiguous; a span can't start among them, so don't look again.
+			 */
+			span_end = last;
+
+			if (bridged)
+			{
+				BlockNumber	span = last - buf->blocknum + 1;
+
+				fileWrite("S", 1, file, path);
+				fileWrite(&span, sizeof(span), file, path);
+			}
+		}
+
+		prev_blocknum = buf->blocknum;
+
+		/*
+		 * If a continuous range of blocks follows this block, then emit one
+		 * entry for the range, instead of one for each block.
+		 *
+		 * The list is sorted, so the range ends at the first buffer that doesn't
+		 * continue it, or that has a different usage count.
+		 */
+		range_counter = 0;
+
+		for (j = i+1; j < num_buffers; ++j)
+		{
+			const SavedBuffer *tmp = &buffers[j];
+
+			if (tmp->database		!= database
+				|| tmp->priority	!= prev_priority
+				|| tmp->tablespace	!= prev_tablespace
+				|| tmp->filenode	!= prev_filenode
+				|| tmp->forknum		!= prev_forknum
+				|| tmp->blocknum	!= (prev_blocknum + range_counter + 1)
+				|| tmp->usage		!= prev_usage)
+				break;
+
+			++range_counter;
+		}
+
+		if (range_counter != 0)
+		{
+			fileWrite("N", 1, file, path);
+			fileWrite(&range_counter, sizeof(range_counter), file, path);
+
+			i += range_counter;
+		}
+	}
+
+	return i;
+}
+
+/* Remember the current point as one to resume decoding from. */
+static void
+setMark(SavefileReader *reader)
+{
+	SavefileProgress   *mark = &reader->mark;
+
+	mark->magic			= PROGRESS_MAGIC;
+	mark->version		= PROGRESS_VERSION;
+	mark->position		= reader->position;
+	mark->database		= reader->database;
+	mark->priority		= reader->priority;
+	mark->tablespace	= reader->tablespace;
+	mark->forknum		= InvalidForkNumber;
+	mark->blocknum		= InvalidBlockNumber;
+}
+
+void
+initSavefileReader(SavefileReader *reader, FILE *file, const char *path)
+{
+	reader->file		= file;
+	reader->path		= path;
+	reader->start		= ftello(file);
+	reader->position	= reader->start;
+	reader->end			= -1;
+	reader->database	= InvalidOid;
+	reader->priority	= PRIORITY_DATA;
+	reader->tablespace	= InvalidOid;
+	reader->filenode	= InvalidOid;
+	reader->forknum		= InvalidForkNumber;
+	reader->blocknum	= InvalidBlockNumber;
+	reader->usage		= 0;
+
+	setMark(reader);
+}
+
+/*
+ * Make the reader stop at the given offset, rather than at EOF; used for
+ * reading a section of a container.
+ */
+void
+limitSavefileReader(SavefileReader *reader, off_t end)
+{
+	if (end < reader->position)
+		savefileError(reader->path, "section ends at %lld, before it begins at %lld",
+					  (long long) end, (long long) reader->position);
+
+	reader->end = end;
+}
+
+/*
+ * Read the next record from the save-file.
+ *
+ * Returns false on a clean EOF, that is, an EOF at a record boundary. Any
+ * record that is malformed, or is out of place according to the grammar, is
+ * reported as an error; we never hand out a record that the caller would have
+ * to second-guess.
+ */
+bool
+readSavefileRecord(SavefileReader *reader, SavefileRecord *record)
+{
+	char		record_type;
+	FILE	   *file = reader->file;
+	const char *path = reader->path;
+
+	/*
+	 * If this condition changes, then this code, and the code in the writer
+	 * will need to be changed; especially the format specifiers in log and
+	 * error messages.
+	 */
+	StaticAssertStmt(MaxBlockNumber == 0xFFFFFFFE, "Code may need review.");
+	StaticAssertStmt(sizeof(Oid) == 4 && sizeof(ForkNumber) == 4 && sizeof(BlockNumber) == 4,
+					 "save-file record payloads are expected to be 4 bytes long");
+
+	if (reader->end >= 0 && reader->position >= reader->end)
+		return false;
+
+	/* An EOF is clean only if the stream isn't supposed to continue. */
+	if (!fileRead(&record_type, 1, file, reader->end < 0, path))
+		return false;
+
+	/*
+	 * The context records are the points we can resume from, since nothing
+	 * that precedes them is needed to decode what follows.
+	 */
+	if (record_type == 'd' || record_type == 'p' || record_type == 't' || record_type == 'r')
+		setMark(reader);
+
+	switch (record_type)
+	{
+		case 'd':
+		{
+			fileRead(&reader->database, sizeof(Oid), file, false, path);
+
+			reader->priority	= PRIORITY_DATA;
+			reader->tablespace	= InvalidOid;
+			reader->filenode	= InvalidOid;
+			reader->forknum		= InvalidForkNumber;
+			reader->blocknum	= InvalidBlockNumber;
+		}
+		break;
+		case 'p':
+		{
+			uint32		priority;
+
+			fileRead(&priority, sizeof(uint32), file, false, path);
+
+			if (priority >= NUM_PRIORITIES)
+				savefileError(path, "invalid priority %u", priority);
+
+			reader->priority	= priority;
+			reader->tablespace	= InvalidOid;
+			reader->filenode	= InvalidOid;
+			reader->forknum		= InvalidForkNumber;
+			reader->blocknum	= InvalidBlockNumber;
+		}
+		break;
+		case 't':
+		{
+			Oid			tablespace;
+
+			fileRead(&tablespace, sizeof(Oid), file, false, path);
+
+			if (tablespace == InvalidOid)
+				savefileError(path, "invalid tablespace");
+
+			reader->tablespace	= tablespace;
+			reader->filenode	= InvalidOid;
+			reader->forknum		= InvalidForkNumber;
+			reader->blocknum	= InvalidBlockNumber;
+		}
+		break;
+		case 'r':
+		{
+			Oid			filenode;
+
+			fileRead(&filenode, sizeof(Oid), file, false, path);
+
+			if (filenode == InvalidOid)
+				savefileError(path, "invalid relfilenode");
+
+			reader->filenode	= filenode;
+			reader->forknum		= InvalidForkNumber;
+			reader->blocknum	= InvalidBlockNumber;
+		}
+		break;
+		case 'f':
+		{
+			ForkNumber	forknum;
+
+			fileRead(&forknum, sizeof(ForkNumber), file, false, path);
+
+			if (reader->filenode == InvalidOid)
+				savefileError(path, "found a fork record without a preceeding relation record");
+
+			if (forknum < 0 || forknum > MAX_FORKNUM)
+				savefileError(path, "invalid fork number %d", forknum);
+
+			reader->forknum		= forknum;
+			reader->blocknum	= InvalidBlockNumber;
+			reader->usage		= 0;
+		}
+		break;
+		case 'u':
+		{
+			uint32		usage;
+
+			fileRead(&usage, sizeof(uint32), file, false, path);
+
+			if (reader->forknum == InvalidForkNumber)
+				savefileError(path, "found a usage count record without a preceeding fork record");
+
+			if (usage > MAX_SAVED_USAGE)
+				savefileError(path, "invalid usage count %u", usage);
+
+			reader->usage = (uint8) usage;
+		}
+		break;
+		case 'b':
+		{
+			BlockNumber	blocknum;
+
+			fileRead(&blocknum, sizeof(BlockNumber), file, false, path);
+
+			if (reader->forknum == InvalidForkNumber)
+				savefileError(path, "found a block record without a preceeding fork record");
+
+			if (blocknum == InvalidBlockNumber)
+				savefileError(path, "invalid block number");
+
+			reader->blocknum = blocknum;
+		}
+		break;
+		case 'S':
+		{
+			BlockNumber	span;
+
+			fileRead(&span, sizeof(BlockNumber), file, false, path);
+
+			if (reader->blocknum == InvalidBlockNumber)
+				savefileError(path, "found a span record without a preceeding block record");
+
+			if (span == 0 || span - 1 > MaxBlockNumber - reader->blocknum)
+				savefileError(path, "invalid span %u at block %u",
+							  span, reader->blocknum);
+
+			record->range = span;
+		}
+		break;
+		case 'N':
+		{
+			BlockNumber	range;
+
+			fileRead(&range, sizeof(BlockNumber), file, false, path);
+
+			if (reader->blocknum == InvalidBlockNumber)
+				savefileError(path, "found a block range record without a preceeding block record");
+
+			if (range == 0 || range > MaxBlockNumber - reader->blocknum)
+				savefileError(path, "invalid block range %u after block %u",
+							  range, reader->blocknum);
+
+			record->range = range;
+		}
+		break;
+		default:
+			savefileError(path, "found unexpected save-file marker %x", (unsigned char) record_type);
+			break;
+	}
+
+	/* Every record is a marker followed by a 4-byte payload. */
+	reader->position += 1 + 4;
+
+	if (reader->end >= 0 && reader->position > reader->end)
+		savefileError(path, "record crosses the end of the section at %lld",
+					  (long long) reader->end);
+
+	record->type		= record_type;
+	record->database	= reader->database;
+	record->priority	= reader->priority;
+	record->tablespace	= reader->tablespace;
+	record->filenode	= reader->filenode;
+	record->forknum		= reader->forknum;
+	record->blocknum	= (record_type == 'N' ? reader->blocknum + 1 : reader->blocknum);
+	record->usage		= reader->usage;
+
+	return true;
+}
+
+/*
+ * Compare the priority of the record with that of a pass over the save-file
+ * that restores the blocks of just one priority: negative if the pass has to
+ * skip the record, positive if the pass is done once it gets to the record.
+ * A 'd' record belongs to every pass; the priority it resets the stream to is
+ * only the default for save-files that predate 'p' records.
+ */
+int
+savefilePassCmp(const SavefileRecord *record, uint32 priority)
+{
+	if (record->type == 'd' || record->priority == priority)
+		return 0;
+
+	return record->priority < priority ? -1 : 1;
+}
+
+/*
+ * Get the last point the decoding can be resumed from, that is, the beginning
+ * of the latest context record read. Decoding from that point on reproduces
+ * that record and everything after it.
+ */
+void
+getSavefileProgress(const SavefileReader *reader, SavefileProgress *progress)
+{
+	*progress = reader->mark;
+}
+
+/*
+ * Continue decoding from the given point, which must have been obtained from
+ * getSavefileProgress() for the same stream. Returns false, leaving the reader
+ * as it was, if the progress doesn't make sense for this stream; say, because
+ * the stream has been replaced since.
+ */
+bool
+resumeSavefileReader(SavefileReader *reader, const SavefileProgress *progress)
+{
+	if (progress->magic != PROGRESS_MAGIC
+		|| progress->version != PROGRESS_VERSION
+		|| progress->position < (uint64) reader->start
+		|| (reader->end >= 0 && progress->position > (uint64) reader->end)
+		|| progress->priority >= NUM_PRIORITIES
+		|| progress->forknum < InvalidForkNumber
+		|| progress->forknum > MAX_FORKNUM)
+		return false;
+
+	if (fseeko(reader->file, progress->position, SEEK_SET) != 0)
+		return false;
+
+	reader->position	= progress->position;
+	reader->database	= progress->database;
+	reader->priority	= progress->priority;
+	reader->tablespace	= progress->tablespace;
+	reader->filenode	= InvalidOid;
+	reader->forknum		= InvalidForkNumber;
+	reader->blocknum	= InvalidBlockNumber;
+	reader->usage		= 0;
+	reader->mark		= *progress;
+
+	return true;
+}
+
+/*
+ * Write the header of a container with the given number of sections, and an
+ * index of empty entries; the caller fills in the entries as it writes the
+ * sections. Leaves the file positioned where the first section goes.
+ */
+void
+writeContainerHeader(FILE *file, const char *path, uint32 nsections)
+{
+	SavefileContainerHeader	header;
+	SavefileSection			section;
+	uint32					i;
+
+	header.magic		= CONTAINER_MAGIC;
+	header.version		= CONTAINER_VERSION;
+	header.nsections	= nsections;
+
+	fileWrite(&header, sizeof(header), file, path);
+
+	memset(&section, 0, sizeof(section));
+	section.flags = SECTION_DONE;
+
+	for (i = 0; i < nsections; ++i)
+		fileWrite(&section, sizeof(section), file, path);
+}
+
+/* Offset in the container of the index entry of the given section */
+static off_t
+sectionEntryOffset(uint32 sectionnum)
+{
+	return sizeof(SavefileContainerHeader) + (off_t) (sectionnum - 1) * sizeof(SavefileSection);
+}
+
+/*
+ * Overwrite the index entry of the given section. The file position is left
+ * at the end of the entry.
+ */
+void
+writeContainerSection(FILE *file, const char *path, uint32 sectionnum,
+					  const SavefileSection *section)
+{
+	if (fseeko(file, sectionEntryOffset(sectionnum), SEEK_SET) != 0)
+		savefileError(path, "could not seek to section %u", sectionnum);
+
+	fileWrite(section, sizeof(*section), file, path);
+}
+
+/* Read and validate the container header; returns the number of sections. */
+uint32
+readContainerHeader(FILE *file, const char *path)
+{
+	SavefileContainerHeader	header;
+
+	if (fseeko(file, 0, SEEK_SET) != 0)
+		savefileError(path, "could not seek to the header");
+
+	fileRead(&header, sizeof(header), file, false, path);
+
+	if (header.magic != CONTAINER_MAGIC)
+		savefileError(path, "bad magic number %08x", header.magic);
+
+	if (header.version != CONTAINER_VERSION)
+		savefileError(path, "unsupported container version %u", header.version);
+
+	return header.nsections;
+}
+
+/* Read and validate the index entry of the given section. */
+void
+readContainerSection(FILE *file, const char *path, uint32 nsections,
+					 uint32 sectionnum, SavefileSection *section)
+{
+	if (sectionnum < 1 || sectionnum > nsections)
+		savefileError(path, "section %u does not exist; the container has %u sections",
+					  sectionnum, nsections);
+
+	if (fseeko(file, sectionEntryOffset(sectionnum), SEEK_SET) != 0)
+		savefileError(path, "could not seek to section %u", sectionnum);
+
+	fileRead(section, sizeof(*section), file, false, path);
+
+	if (memchr(section->dbname, '\0', NAMEDATALEN) == NULL)
+		savefileError(path, "database name of section %u is not terminated", sectionnum);
+
+	if (section->offset + section->length < section->offset
+		|| (section->length != 0 && section->offset < (uint64) sectionEntryOffset(nsections + 1)))
+		savefileError(path, "section %u has invalid bounds", sectionnum);
+}
@@ -0,0 +1,190 @@
+/*
+ * Save-file record codec.
+ *
+ * A save-file holds the list of blocks of one database. It begins with the
+ * null-terminated name of the database (a zero-length name for global
+ * objects), followed by a stream of records; each record is a one-byte marker
+ * followed by its payload:
+ *
+ *	'd' Oid			database OID; the first record of the stream
+ *	'p' uint32		restore priority of the blocks that follow; see below
+ *	't' Oid			tablespace OID of the relations that follow
+ *	'r' Oid			relfilenode; starts a new relation
+ *	'f' ForkNumber	fork of the current relation
+ *	'b' BlockNumber	a block of the current fork
+ *	'N' BlockNumber	the given number of blocks following the last 'b' block
+ *	'S' BlockNumber	the number of blocks in a span that begins with the last 'b'
+ *					block, and covers the blocks listed after it up to its end,
+ *					along with the gaps between them; see below
+ *	'u' uint32		usage count of the blocks of the current fork that follow
+ *
+ * The blocks are sorted by priority before anything else, so that the blocks
+ * that queries need first (the upper levels of B-tree indexes, the visibility
+ * maps, and so on) are restored first, across all relations. A relation with
+ * blocks in more than one priority shows up once under each; save-files that
+ * predate 'p' records list all their blocks under PRIORITY_DATA.
+ *
+ * The blocks of relations whose restored blocks mostly went unused after the
+ * past few restores are put under PRIORITY_UNUSED, whatever their kind.
+ *
+ * A save-file may hold the blocks of just one tablespace of its database, for
+ * the tablespaces to be restored in parallel; the database then has a
+ * save-file for each of its tablespaces.
+ *
+ * A span tells the BlockReader that reading the blocks in the gaps between the
+ * listed blocks along with them is cheaper than seeking over the gaps. Spans
+ * are optional; the writer emits one only if it bridges at least one gap, of at
+ * most the number of blocks the caller allows, and makes none longer than
+ * MAX_SPAN_BLOCKS, since the BlockReader asks the kernel for a whole span at
+ * once.
+ *
+ * The usage count of a block is what its buffer's was when it was saved, for
+ * the restore to give it back. Blocks whose fork has no 'u' record before them
+ * have a usage count of zero, that is, unknown; so do all the blocks in
+ * save-files that predate 'u' records. A 'u' record never precedes an 'N'
+ * record directly; a range of blocks has the usage count of its first block.
+ *
+ * Alternatively, the save-files of all the databases can be stored as sections
+ * of a single container file. The container begins with a header and an index
+ * of fixed-size entries, one for each section, so a BlockReader can find its
+ * section with a single seek. Section numbers are the same as the numbers of
+ * the save-files they replace; that is, section 1 holds the global objects,
+ * and is empty if there are no blocks of global objects.
+ *
+ * This code has no dependency on a running server, so that it can be compiled
+ * into frontend programs (-DFRONTEND) as well as the extension.
+ */
+#ifndef PG_HIBERNATOR_SAVEFILE_H
+#define PG_HIBERNATOR_SAVEFILE_H
+
+#include "storage/block.h"
+#include "common/relpath.h"
+
+/* Restore priorities, highest first */
+#define PRIORITY_INDEX_UPPER	0	/* B-tree metapages and internal pages */
+#define PRIORITY_MAPS			1	/* Visibility map and free space map */
+#define PRIORITY_DATA			2	/* Everything else */
+#define PRIORITY_UNUSED			3	/* Relations seldom used after past restores */
+#define NUM_PRIORITIES			4
+
+typedef struct SavedBuffer
+{
+	Oid			database;	/* On-disk marker: 'd' */
+	uint32		priority;	/* On-disk marker: 'p' */
+	Oid			tablespace;	/* On-disk marker: 't' */
+	Oid			filenode;	/* On-disk marker: 'r', for Relfilenode */
+	ForkNumber	forknum;	/* On-disk marker: 'f' */
+	BlockNumber	blocknum;	/* On-disk marker: 'b' */
+							/* On-disk marker: 'N', for range of N blocks */
+							/* On-disk marker: 'S', for span over gaps */
+	uint8		usage;		/* On-disk marker: 'u' */
+} SavedBuffer;
+
+/* Highest usage count a save-file may record */
+#define MAX_SAVED_USAGE			255
+
+/* Longest span the writer emits, in blocks; 8 MB of the default BLCKSZ */
+#define MAX_SPAN_BLOCKS			1024
+
+/* One decoded record, along with the context it applies to. */
+typedef struct SavefileRecord
+{
+	char		type;		/* 'd', 'p', 't', 'r', 'f', 'b', 'N', 'S' or 'u' */
+	Oid			database;
+	uint32		priority;
+	Oid			tablespace;	/* InvalidOid in save-files that predate 't' */
+	Oid			filenode;
+	ForkNumber	forknum;
+	BlockNumber	blocknum;	/* For 'N' records, the first block of the range */
+	BlockNumber	range;		/* For 'N' and 'S' records, number of blocks in the
+							 * range or span */
+	uint8		usage;		/* Usage count of the blocks; zero if not known */
+} SavefileRecord;
+
+/*
+ * A point in the record stream from which decoding can be resumed, along with
+ * the context it needs; see getSavefileProgress().
+ *
+ * The point is always the beginning of a 'd', 'p', 't' or 'r' record. If it's
+ * an 'r' record, forknum and blocknum may be set by the caller to say that the
+ * blocks of that relation up to and including this one need not be read again.
+ */
+typedef struct SavefileProgress
+{
+	uint32		magic;
+	uint32		version;
+	uint64		position;
+	Oid			database;
+	uint32		priority;
+	Oid			tablespace;
+	ForkNumber	forknum;
+	BlockNumber	blocknum;
+} SavefileProgress;
+
+#define PROGRESS_MAGIC		0x50424750	/* "PGBP" */
+#define PROGRESS_VERSION	1
+
+/* Decoder state; callers should treat this as opaque. */
+typedef struct SavefileReader
+{
+	FILE	   *file;
+	const char *path;
+	off_t		start;		/* Offset in the file of the first record */
+	off_t		position;	/* Offset in the file of the next record */
+	off_t		end;		/* Offset where the stream ends, or -1 for EOF */
+	Oid			database;
+	uint32		priority;
+	Oid			tablespace;
+	Oid			filenode;
+	ForkNumber	forknum;
+	BlockNumber	blocknum;
+	uint8		usage;
+	SavefileProgress mark;	/* Last point decoding can be resumed from */
+} SavefileReader;
+
+#define CONTAINER_MAGIC		0x48424750	/* "PGBH" */
+#define CONTAINER_VERSION	1
+
+typedef struct SavefileContainerHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		nsections;
+} SavefileContainerHeader;
+
+/* An entry of the container's index. */
+typedef struct SavefileSection
+{
+	char		dbname[NAMEDATALEN];
+	Oid			database;
+	uint32		flags;
+	uint64		offset;		/* Offset of the section in the container */
+	uint64		length;		/* Length of the section, in bytes */
+	uint64		nblocks;	/* Number of blocks listed in the section */
+} SavefileSection;
+
+/* Flags of a section */
+#define SECTION_DONE	0x0001	/* Restored, or nothing to restore */
+
+extern int	SavedBufferCmp(const void *a, const void *b);
+extern int	SavedBufferLaneCmp(const void *a, const void *b);
+extern int	SavedBufferTagCmp(const void *a, const void *b);
+
+extern int	writeSavefileRecords(const SavedBuffer *buffers, int num_buffers,
+								 BlockNumber max_gap, FILE *file, const char *path);
+
+extern void	initSavefileReader(SavefileReader *reader, FILE *file, const char *path);
+extern void	limitSavefileReader(SavefileReader *reader, off_t end);
+extern bool	readSavefileRecord(SavefileReader *reader, SavefileRecord *record);
+extern int	savefilePassCmp(const SavefileRecord *record, uint32 priority);
+extern void	getSavefileProgress(const SavefileReader *reader, SavefileProgress *progress);
+extern bool	resumeSavefileReader(SavefileReader *reader, const SavefileProgress *progress);
+
+extern void	writeContainerHeader(FILE *file, const char *path, uint32 nsections);
+extern void	writeContainerSection(FILE *file, const char *path, uint32 sectionnum,
+								  const SavefileSection *section);
+extern uint32 readContainerHeader(FILE *file, const char *path);
+extern void	readContainerSection(FILE *file, const char *path, uint32 nsections,
+								 uint32 sectionnum, SavefileSection *section);
+
+#endif   /* PG_HIBERNATOR_SAVEFILE_H */
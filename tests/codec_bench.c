@@ -0,0 +1,335 @@
+/*
+ * codec_bench: measure the cost of the save-file codec in isolation.
+ *
+ * Generates a synthetic list of buffers, sorts it the way the BufferSaver does,
+ * encodes it into a save-file, then decodes the save-file the way a
+ * BlockReader does, and reports the throughput of each step and the size of
+ * the save-file.
+ *
+ * Usage: codec_bench [-n nbuffers] [-p dense|mixed-usage|scattered|many-relation] [-g max_gap]
+ *                    [-s seed] [-f path]
+ *
+ * Note that the buffer list alone needs (sizeof(SavedBuffer) * nbuffers), that
+ * is (28 * nbuffers), bytes of memory; that's 14 GB for 500M buffers, which
+ * corresponds to a 4 TB shared_buffers.
+ */
+#include "postgres_fe.h"
+
+#include <limits.h>
+#include <time.h>
+
+#include "pg_hibernator.h"
+#include "savefile.h"
+
+#define BENCH_DATABASE		16384
+#define BENCH_TABLESPACE	1663
+#define BENCH_FIRST_FILENODE 16385
+
+static const char *progname = "codec_bench";
+
+void
+hibernator_error(const char *fmt,...)
+{
+	va_list		ap;
+
+	fprintf(stderr, "%s: ", progname);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+
+	exit(1);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Cheap, reproducible PRNG; xorshift64* */
+static uint64
+nextRandom(uint64 *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return *state * UINT64CONST(2685821657736338717);
+}
+
+static void
+setBuffer(SavedBuffer *buf, Oid filenode, ForkNumber forknum, BlockNumber blocknum,
+		  uint8 usage)
+{
+	buf->database	= BENCH_DATABASE;
+	buf->priority	= PRIORITY_DATA;
+	buf->tablespace	= BENCH_TABLESPACE;
+	buf->filenode	= filenode;
+	buf->forknum	= forknum;
+	buf->blocknum	= blocknum;
+	buf->usage		= usage;
+}
+
+/*
+ * A handful of large relations, cached mostly in long runs; what a pool looks
+ * like after sequential scans or a bulk load. The usage counts are alike within
+ * a run, unless mixed_usage is set; then they vary from block to block, as
+ * they do after queries have been at the blocks of the runs since, and the
+ * encoder can't list the runs as ranges.
+ */
+static void
+generateDense(SavedBuffer *buffers, int64 n, uint64 *seed, bool mixed_usage)
+{
+	int64		i = 0;
+	Oid			filenode = BENCH_FIRST_FILENODE;
+	BlockNumber	blocknum = 0;
+
+	while (i < n)
+	{
+		int64	run = 1 + nextRandom(seed) % 4096;
+		uint8	usage = 1 + nextRandom(seed) % 5;
+
+		for (; run > 0 && i < n; --run, ++i)
+		{
+			if (mixed_usage)
+				usage = 1 + nextRandom(seed) % 5;
+			setBuffer(&buffers[i], filenode, MAIN_FORKNUM, blocknum++, usage);
+		}
+
+		/* Leave a gap, and occasionally move on to the next relation. */
+		blocknum += 1 + nextRandom(seed) % 64;
+		if (blocknum > MaxBlockNumber / 2 || nextRandom(seed) % 64 == 0)
+		{
+			++filenode;
+			blocknum = 0;
+		}
+	}
+}
+
+static int64
+gcd(int64 a, int64 b)
+{
+	while (b != 0)
+	{
+		int64	t = a % b;
+
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/*
+ * Blocks picked uniformly from a few very large relations; what a pool looks
+ * like under an OLTP workload with a data set much bigger than memory.
+ */
+static void
+generateScattered(SavedBuffer *buffers, int64 n, uint64 *seed)
+{
+	int64		i;
+	int64		space = n * 16;				/* 1 in 16 blocks is cached */
+	int64		per_relation = INT64CONST(1) << 24;	/* 128 GB relations */
+	int64		stride;
+
+	/*
+	 * Walk the block space with a stride that is coprime to its size; that
+	 * visits distinct blocks in a scattered order without needing to track
+	 * which ones have been picked already.
+	 */
+	for (stride = nextRandom(seed) % space; gcd(space, stride) != 1; ++stride)
+		;
+
+	for (i = 0; i < n; ++i)
+	{
+		int64	g = (int64) (((uint64) i * (uint64) stride) % (uint64) space);
+
+		setBuffer(&buffers[i], BENCH_FIRST_FILENODE + g / per_relation,
+				  MAIN_FORKNUM, g % per_relation, 1 + nextRandom(seed) % 5);
+	}
+}
+
+/*
+ * Lots of small relations, each with a few blocks of each fork cached; what a
+ * pool looks like in a database with very many partitions.
+ */
+static void
+generateManyRelation(SavedBuffer *buffers, int64 n, uint64 *seed)
+{
+	int64		i = 0;
+	Oid			filenode = BENCH_FIRST_FILENODE;
+
+	while (i < n)
+	{
+		ForkNumber	forknum;
+
+		for (forknum = MAIN_FORKNUM; forknum <= VISIBILITYMAP_FORKNUM && i < n; ++forknum)
+		{
+			BlockNumber	blocknum = 0;
+			int			count = (forknum == MAIN_FORKNUM ? 1 + nextRandom(seed) % 32 : 1);
+
+			for (; count > 0 && i < n; --count, ++i)
+			{
+				blocknum += 1 + nextRandom(seed) % 3;
+				setBuffer(&buffers[i], filenode, forknum, blocknum, 1 + nextRandom(seed) % 5);
+			}
+		}
+
+		++filenode;
+	}
+}
+
+/* Shuffle, so that the sort has as much work to do as on a real pool. */
+static void
+shuffle(SavedBuffer *buffers, int64 n, uint64 *seed)
+{
+	int64		i;
+
+	for (i = n - 1; i > 0; --i)
+	{
+		int64		j = nextRandom(seed) % (i + 1);
+		SavedBuffer	tmp = buffers[i];
+
+		buffers[i] = buffers[j];
+		buffers[j] = tmp;
+	}
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+			"Usage: %s [-n nbuffers] [-p dense|mixed-usage|scattered|many-relation] [-g max_gap] [-s seed] [-f path]\n",
+			progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int64		n = 10 * 1000 * 1000;
+	const char *pattern = "dense";
+	const char *path = "codec_bench.save";
+	uint64		seed = 42;
+	BlockNumber	max_gap = 0;
+	int			c;
+	SavedBuffer *buffers;
+	FILE	   *file;
+	SavefileReader	reader;
+	SavefileRecord	record;
+	int64		done;
+	int64		decoded = 0;
+	int64		records = 0;
+	int64		spans = 0;
+	int64		spanned = 0;
+	long		file_size;
+	double		t_start, t_sort, t_encode, t_decode;
+
+	while ((c = getopt(argc, argv, "n:p:g:s:f:")) != -1)
+	{
+		switch (c)
+		{
+			case 'n':
+				n = strtoll(optarg, NULL, 10);
+				break;
+			case 'p':
+				pattern = optarg;
+				break;
+			case 'g':
+				max_gap = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'f':
+				path = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+
+	/* The encoder, like the BufferSaver, counts buffers in an int. */
+	if (n <= 0 || n > INT_MAX || seed == 0)
+		usage();
+
+	buffers = malloc(sizeof(SavedBuffer) * n);
+	if (buffers == NULL)
+		hibernator_error("out of memory allocating %lld buffers", (long long) n);
+
+	if (strcmp(pattern, "dense") == 0)
+		generateDense(buffers, n, &seed, false);
+	else if (strcmp(pattern, "mixed-usage") == 0)
+		generateDense(buffers, n, &seed, true);
+	else if (strcmp(pattern, "scattered") == 0)
+		generateScattered(buffers, n, &seed);
+	else if (strcmp(pattern, "many-relation") == 0)
+		generateManyRelation(buffers, n, &seed);
+	else
+		usage();
+
+	shuffle(buffers, n, &seed);
+
+	/* Sort */
+	t_start = now();
+	qsort(buffers, n, sizeof(SavedBuffer), SavedBufferCmp);
+	t_sort = now() - t_start;
+
+	/* Encode */
+	t_start = now();
+	file = fileOpen(path, PG_BINARY_W);
+	writeDBName("bench", file, path);
+	for (done = 0; done < n; )
+		done += writeSavefileRecords(&buffers[done], (int) (n - done), max_gap, file, path);
+	fileClose(file, path);
+	t_encode = now() - t_start;
+
+	/* Decode */
+	t_start = now();
+	file = fileOpen(path, PG_BINARY_R);
+	readDBName(file, path);
+	initSavefileReader(&reader, file, path);
+	while (readSavefileRecord(&reader, &record))
+	{
+		++records;
+		if (record.type == 'b')
+			++decoded;
+		else if (record.type == 'N')
+			decoded += record.range;
+		else if (record.type == 'S')
+		{
+			++spans;
+			spanned += record.range;
+		}
+	}
+	file_size = ftell(file);
+	fileClose(file, path);
+	t_decode = now() - t_start;
+
+	if (decoded != n)
+		hibernator_error("decoded %lld blocks, expected %lld",
+						 (long long) decoded, (long long) n);
+
+	printf("pattern:   %s\n", pattern);
+	printf("buffers:   %lld\n", (long long) n);
+	printf("records:   %lld\n", (long long) records);
+	if (max_gap > 0)
+		printf("spans:     %lld, covering %lld blocks\n",
+			   (long long) spans, (long long) spanned);
+	printf("file size: %ld bytes (%.2f bytes/buffer)\n", file_size, (double) file_size / n);
+	printf("sort:      %.3f s (%.1f M buffers/s)\n", t_sort, n / t_sort / 1e6);
+	printf("encode:    %.3f s (%.1f M buffers/s, %.1f MB/s)\n",
+		   t_encode, n / t_encode / 1e6, file_size / t_encode / 1e6);
+	printf("decode:    %.3f s (%.1f M buffers/s, %.1f MB/s)\n",
+		   t_decode, n / t_decode / 1e6, file_size / t_decode / 1e6);
+
+	free(buffers);
+	unlink(path);
+
+	return 0;
+}
@@ -0,0 +1,364 @@
+/*
+ * codec_fuzz: check that decoding a damaged save-file fails cleanly.
+ *
+ * "Cleanly" means the decoder either hands out records that obey the
+ * save-file grammar, or reports an error through hibernator_error(); it must
+ * never crash, read out of bounds, or return a record the BlockReader would
+ * have to second-guess.
+ *
+ * Usage: codec_fuzz [-i iterations] [-s seed] [file ...]
+ *
+ * With file arguments, each file is decoded once; this is handy for replaying
+ * a failing input. Otherwise a valid save-file is generated and decoded after
+ * each of the given number of random mutations.
+ *
+ * When compiled with -DCODEC_LIBFUZZER this instead provides the libFuzzer
+ * entry point, for use with clang's -fsanitize=fuzzer.
+ */
+#include "postgres_fe.h"
+
+#include <setjmp.h>
+
+#include "pg_hibernator.h"
+#include "savefile.h"
+
+static const char *progname = "codec_fuzz";
+static sigjmp_buf error_jmp;
+static bool	verbose = false;
+
+void
+hibernator_error(const char *fmt,...)
+{
+	if (verbose)
+	{
+		va_list		ap;
+
+		fprintf(stderr, "%s: ", progname);
+		va_start(ap, fmt);
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+		fprintf(stderr, "\n");
+	}
+
+	siglongjmp(error_jmp, 1);
+}
+
+/* Complain about a decoder bug, and abort so that the input can be kept. */
+static void
+decoderBug(const char *what)
+{
+	fprintf(stderr, "%s: decoder bug: %s\n", progname, what);
+	abort();
+}
+
+/*
+ * Decode the given bytes as a save-file. Returns true if the input was
+ * accepted, false if the decoder rejected it.
+ */
+static bool
+decode(const char *data, size_t size)
+{
+	FILE	   *volatile file;
+	SavefileReader	reader;
+	SavefileRecord	record;
+	const char *path = "<fuzz input>";
+
+	/* fmemopen() doesn't like zero-length buffers. */
+	if (size == 0)
+		return false;
+
+	file = fmemopen((void *) data, size, PG_BINARY_R);
+	if (file == NULL)
+	{
+		fprintf(stderr, "%s: fmemopen failed: %m\n", progname);
+		exit(1);
+	}
+
+	if (sigsetjmp(error_jmp, 1) != 0)
+	{
+		fclose(file);
+		return false;
+	}
+
+	if (strlen(readDBName(file, path)) >= NAMEDATALEN)
+		decoderBug("database name too long");
+
+	initSavefileReader(&reader, file, path);
+
+	while (readSavefileRecord(&reader, &record))
+	{
+		switch (record.type)
+		{
+			case 'd':
+				break;
+			case 'p':
+				if (record.priority >= NUM_PRIORITIES)
+					decoderBug("invalid priority");
+				break;
+			case 't':
+				if (record.tablespace == InvalidOid)
+					decoderBug("invalid tablespace");
+				break;
+			case 'r':
+				if (record.filenode == InvalidOid)
+					decoderBug("invalid relfilenode");
+				break;
+			case 'f':
+				if (record.forknum < 0 || record.forknum > MAX_FORKNUM)
+					decoderBug("invalid fork number");
+				break;
+			case 'b':
+				if (record.forknum == InvalidForkNumber || record.blocknum == InvalidBlockNumber)
+					decoderBug("block record without context");
+				break;
+			case 'N':
+				if (record.range == 0
+					|| record.blocknum == InvalidBlockNumber
+					|| record.blocknum + record.range - 1 > MaxBlockNumber
+					|| record.blocknum + record.range - 1 < record.blocknum)
+					decoderBug("invalid block range");
+				break;
+			case 'S':
+				if (record.range == 0
+					|| record.blocknum == InvalidBlockNumber
+					|| record.blocknum + record.range - 1 > MaxBlockNumber
+					|| record.blocknum + record.range - 1 < record.blocknum)
+					decoderBug("invalid span");
+				break;
+			case 'u':
+				if (record.forknum == InvalidForkNumber)
+					decoderBug("usage count record without context");
+				break;
+			default:
+				decoderBug("unexpected record type");
+		}
+	}
+
+	fclose(file);
+
+	return true;
+}
+
+#ifdef CODEC_LIBFUZZER
+
+int
+LLVMFuzzerTestOneInput(const uint8 *data, size_t size)
+{
+	decode((const char *) data, size);
+
+	return 0;
+}
+
+#else
+
+/* Cheap, reproducible PRNG; xorshift64* */
+static uint64
+nextRandom(uint64 *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return *state * UINT64CONST(2685821657736338717);
+}
+
+/* Build a valid save-file to use as the starting point of mutations. */
+static char *
+makeSeedInput(size_t *size, uint64 *seed)
+{
+	SavedBuffer	buffers[256];
+	int			n = 0;
+	int			done;
+	Oid			filenode;
+	FILE	   *file;
+	const char *path = "<seed input>";
+	char	   *data;
+
+	for (filenode = 16385; n < lengthof(buffers); ++filenode)
+	{
+		BlockNumber	blocknum = nextRandom(seed) % 1000;
+		int			count = 1 + nextRandom(seed) % 40;
+
+		for (; count > 0 && n < lengthof(buffers); --count, ++n)
+		{
+			buffers[n].database	= 16384;
+			buffers[n].priority	= nextRandom(seed) % NUM_PRIORITIES;
+			buffers[n].tablespace = filenode % 4 == 0 ? 16400 : 1663;
+			buffers[n].filenode	= filenode;
+			buffers[n].forknum	= nextRandom(seed) % 8 == 0 ? FSM_FORKNUM : MAIN_FORKNUM;
+			buffers[n].blocknum	= blocknum;
+			buffers[n].usage	= nextRandom(seed) % 4 == 0 ? nextRandom(seed) % 6 : 1;
+
+			blocknum += 1 + (nextRandom(seed) % 4 == 0 ? nextRandom(seed) % 8 : 0);
+		}
+	}
+
+	qsort(buffers, n, sizeof(SavedBuffer), SavedBufferCmp);
+
+	file = tmpfile();
+	if (file == NULL)
+	{
+		fprintf(stderr, "%s: could not create temporary file: %m\n", progname);
+		exit(1);
+	}
+
+	writeDBName("fuzz", file, path);
+	for (done = 0; done < n; )
+		done += writeSavefileRecords(&buffers[done], n - done, 4, file, path);
+
+	*size = ftell(file);
+	data = malloc(*size);
+	rewind(file);
+	if (data == NULL || fread(data, *size, 1, file) != 1)
+	{
+		fprintf(stderr, "%s: could not read back the seed input\n", progname);
+		exit(1);
+	}
+	fclose(file);
+
+	if (!decode(data, *size))
+		decoderBug("seed input rejected");
+
+	return data;
+}
+
+/* Apply a few random mutations to the input, in place. */
+static size_t
+mutate(char *data, size_t size, size_t capacity, uint64 *seed)
+{
+	int			nmutations = 1 + nextRandom(seed) % 4;
+
+	while (nmutations-- > 0 && size > 0)
+	{
+		size_t		pos = nextRandom(seed) % size;
+
+		switch (nextRandom(seed) % 5)
+		{
+			case 0:		/* flip a bit */
+				data[pos] ^= 1 << (nextRandom(seed) % 8);
+				break;
+			case 1:		/* replace a byte */
+				data[pos] = (char) nextRandom(seed);
+				break;
+			case 2:		/* truncate */
+				size = pos;
+				break;
+			case 3:		/* clobber a 4-byte field with an interesting value */
+				if (pos + 4 <= size)
+				{
+					static const uint32 values[] = {0, 1, 0x7FFFFFFF, 0xFFFFFFFE, 0xFFFFFFFF};
+					uint32	v = values[nextRandom(seed) % lengthof(values)];
+
+					memcpy(&data[pos], &v, sizeof(v));
+				}
+				break;
+			case 4:		/* insert a byte */
+				if (size < capacity)
+				{
+					memmove(&data[pos + 1], &data[pos], size - pos);
+					data[pos] = "dptrfbNSu\0"[nextRandom(seed) % 10];
+					++size;
+				}
+				break;
+		}
+	}
+
+	return size;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [-v] [-i iterations] [-s seed] [file ...]\n", progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	long		iterations = 100000;
+	uint64		seed = 42;
+	int			c;
+	char	   *seed_input;
+	size_t		seed_size;
+	char	   *data;
+	size_t		capacity;
+	long		i;
+	long		accepted = 0;
+
+	while ((c = getopt(argc, argv, "vi:s:")) != -1)
+	{
+		switch (c)
+		{
+			case 'v':
+				verbose = true;
+				break;
+			case 'i':
+				iterations = strtol(optarg, NULL, 10);
+				break;
+			case 's':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				usage();
+		}
+	}
+
+	if (seed == 0)
+		usage();
+
+	/* Replay the given files, if any. */
+	if (optind < argc)
+	{
+		for (; optind < argc; ++optind)
+		{
+			FILE   *file = fopen(argv[optind], PG_BINARY_R);
+			long	size;
+
+			if (file == NULL || fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0)
+			{
+				fprintf(stderr, "%s: could not read \"%s\": %m\n", progname, argv[optind]);
+				exit(1);
+			}
+			rewind(file);
+
+			data = malloc(size + 1);
+			if (data == NULL || (size > 0 && fread(data, size, 1, file) != 1))
+			{
+				fprintf(stderr, "%s: could not read \"%s\": %m\n", progname, argv[optind]);
+				exit(1);
+			}
+			fclose(file);
+
+			printf("%s: %s\n", argv[optind], decode(data, size) ? "accepted" : "rejected");
+			free(data);
+		}
+
+		return 0;
+	}
+
+	seed_input = makeSeedInput(&seed_size, &seed);
+	capacity = seed_size + 64;
+	data = malloc(capacity);
+
+	for (i = 0; i < iterations; ++i)
+	{
+		size_t	size;
+
+		memcpy(data, seed_input, seed_size);
+		size = mutate(data, seed_size, capacity, &seed);
+
+		if (decode(data, size))
+			++accepted;
+	}
+
+	printf("%ld inputs: %ld accepted, %ld rejected cleanly\n",
+		   iterations, accepted, iterations - accepted);
+
+	free(data);
+	free(seed_input);
+
+	return 0;
+}
+
+#endif   /* CODEC_LIBFUZZER */
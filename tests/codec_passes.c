@@ -0,0 +1,251 @@
+/*
+ * codec_passes: check that reading a save-file one priority at a time, the
+ * way a connectionless BlockReader does, gets to every block exactly once.
+ *
+ * Each pass resumes from the progress the previous pass left, skips the
+ * records of the priorities already restored, and stops at the first record
+ * of a later priority; see ReadBlocks(). The save-files checked are a
+ * generated one with blocks of every priority, and one in the format that
+ * predates 'p' records, whose blocks are all of PRIORITY_DATA.
+ *
+ * Usage: codec_passes [-s seed]
+ */
+#include "postgres_fe.h"
+
+#include "pg_hibernator.h"
+#include "savefile.h"
+
+#define PASSES_DATABASE		16384
+
+static const char *progname = "codec_passes";
+
+void
+hibernator_error(const char *fmt,...)
+{
+	va_list		ap;
+
+	fprintf(stderr, "%s: ", progname);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+
+	exit(1);
+}
+
+/* Cheap, reproducible PRNG; xorshift64* */
+static uint64
+nextRandom(uint64 *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return *state * UINT64CONST(2685821657736338717);
+}
+
+static FILE *
+createFile(void)
+{
+	FILE	   *file = tmpfile();
+
+	if (file == NULL)
+	{
+		fprintf(stderr, "%s: could not create temporary file: %m\n", progname);
+		exit(1);
+	}
+
+	return file;
+}
+
+/* Write a record the way an older version of the encoder did. */
+static void
+writeRecord(FILE *file, char type, uint32 payload)
+{
+	fileWrite(&type, 1, file, "<old save-file>");
+	fileWrite(&payload, sizeof(payload), file, "<old save-file>");
+}
+
+/*
+ * A save-file with the blocks of a few relations spread over all the
+ * priorities, as the BufferSaver writes them. Counts the blocks of each
+ * priority into expected[].
+ */
+static FILE *
+makeSavefile(uint64 *seed, uint64 *expected)
+{
+	SavedBuffer	buffers[4096];
+	int			n = 0;
+	int			done;
+	Oid			filenode;
+	FILE	   *file;
+	const char *path = "<save-file>";
+
+	for (filenode = 16385; n < lengthof(buffers); ++filenode)
+	{
+		BlockNumber	blocknum = nextRandom(seed) % 1000;
+		int			count = 1 + nextRandom(seed) % 200;
+
+		for (; count > 0 && n < lengthof(buffers); --count, ++n)
+		{
+			buffers[n].database	= PASSES_DATABASE;
+			buffers[n].priority	= nextRandom(seed) % NUM_PRIORITIES;
+			buffers[n].tablespace = filenode % 3 == 0 ? 16400 : 1663;
+			buffers[n].filenode	= filenode;
+			buffers[n].forknum	= nextRandom(seed) % 8 == 0 ? VISIBILITYMAP_FORKNUM : MAIN_FORKNUM;
+			buffers[n].blocknum	= blocknum;
+			buffers[n].usage	= nextRandom(seed) % 6;
+
+			blocknum += 1 + (nextRandom(seed) % 4 == 0 ? nextRandom(seed) % 8 : 0);
+		}
+	}
+
+	qsort(buffers, n, sizeof(SavedBuffer), SavedBufferCmp);
+
+	for (done = 0; done < n; ++done)
+		++expected[buffers[done].priority];
+
+	file = createFile();
+
+	writeDBName("passes", file, path);
+	for (done = 0; done < n; )
+		done += writeSavefileRecords(&buffers[done], n - done, 4, file, path);
+
+	return file;
+}
+
+/*
+ * A save-file in the format that predates 'p' and 't' records; all its blocks
+ * are of PRIORITY_DATA.
+ */
+static FILE *
+makeOldSavefile(uint64 *expected)
+{
+	FILE	   *file = createFile();
+
+	writeDBName("passes", file, "<old save-file>");
+	writeRecord(file, 'd', PASSES_DATABASE);
+	writeRecord(file, 'r', 16385);
+	writeRecord(file, 'f', MAIN_FORKNUM);
+	writeRecord(file, 'b', 0);
+	writeRecord(file, 'N', 9);
+	writeRecord(file, 'b', 20);
+	writeRecord(file, 'r', 16386);
+	writeRecord(file, 'f', MAIN_FORKNUM);
+	writeRecord(file, 'b', 5);
+	writeRecord(file, 'f', VISIBILITYMAP_FORKNUM);
+	writeRecord(file, 'b', 0);
+
+	expected[PRIORITY_DATA] += 13;
+
+	return file;
+}
+
+/*
+ * Read the save-file a priority at a time, and check that each pass gets to
+ * all the blocks of its priority, and only those.
+ */
+static void
+checkPasses(FILE *file, const char *what, const uint64 *expected)
+{
+	SavefileProgress progress;
+	bool		have_progress = false;
+	uint32		priority;
+
+	for (priority = 0; priority < NUM_PRIORITIES; ++priority)
+	{
+		SavefileReader	reader;
+		SavefileRecord	record;
+		uint64			blocks = 0;
+
+		rewind(file);
+		readDBName(file, what);
+		initSavefileReader(&reader, file, what);
+
+		if (have_progress && !resumeSavefileReader(&reader, &progress))
+		{
+			fprintf(stderr, "%s: %s: pass %u could not resume\n", progname, what, priority);
+			exit(1);
+		}
+
+		while (readSavefileRecord(&reader, &record))
+		{
+			int		cmp = savefilePassCmp(&record, priority);
+
+			if (cmp < 0)
+				continue;
+
+			if (cmp > 0)
+			{
+				/* The next pass starts here. */
+				getSavefileProgress(&reader, &progress);
+				have_progress = true;
+				break;
+			}
+
+			if (record.type != 'b' && record.type != 'N')
+				continue;
+
+			if (record.priority != priority)
+			{
+				fprintf(stderr, "%s: %s: pass %u got a block of priority %u\n",
+						progname, what, priority, record.priority);
+				exit(1);
+			}
+
+			blocks += (record.type == 'b' ? 1 : record.range);
+		}
+
+		if (blocks != expected[priority])
+		{
+			fprintf(stderr, "%s: %s: pass %u got " UINT64_FORMAT " blocks; expected " UINT64_FORMAT "\n",
+					progname, what, priority, blocks, expected[priority]);
+			exit(1);
+		}
+	}
+
+	printf("%s: every pass got all the blocks of its priority\n", what);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [-s seed]\n", progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64		seed = 42;
+	uint64		expected[NUM_PRIORITIES];
+	int			c;
+	FILE	   *file;
+
+	while ((c = getopt(argc, argv, "s:")) != -1)
+	{
+		switch (c)
+		{
+			case 's':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				usage();
+		}
+	}
+
+	if (seed == 0)
+		usage();
+
+	memset(expected, 0, sizeof(expected));
+	file = makeSavefile(&seed, expected);
+	checkPasses(file, "save-file", expected);
+	fclose(file);
+
+	memset(expected, 0, sizeof(expected));
+	file = makeOldSavefile(expected);
+	checkPasses(file, "old save-file", expected);
+	fclose(file);
+
+	return 0;
+}
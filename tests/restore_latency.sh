@@ -0,0 +1,209 @@
+#!/bin/bash
+#
+# Measure how much the BlockReaders' restore I/O hurts foreground queries.
+#
+# For each scenario, the server is filled with the pgbench data set, restarted
+# with OS caches dropped, and a rate-limited, latency-sensitive pgbench run is
+# started as soon as the server accepts connections; that is, while the
+# BlockReaders are restoring. The per-transaction logs of that run are reduced
+# to p50, p99 and p99.9 latencies, and to the number of transactions that were
+# skipped or late with respect to --latency-limit.
+#
+# The scenarios are:
+#
+#   cold      pg_hibernator.enabled=off; nothing is restored (the baseline)
+#   serial    pg_hibernator.parallel=off
+#   parallel  pg_hibernator.parallel=on
+#
+# and serial and parallel are each repeated for every entry in RESTORE_SETTINGS,
+# which is a list of extra server settings, separated by ';', to apply to the
+# restore (for example, throttling settings). Each entry is a space-separated
+# list of name=value pairs; an empty entry means the defaults.
+#
+# Dropping OS caches requires sudo; set DROP_CACHES=no to skip that, at the
+# cost of measuring a warm OS cache.
+#
+# Example:
+#   RESTORE_SETTINGS=";pg_hibernator.some_setting=10" ./restore_latency.sh
+
+set -e
+
+# Define/tweak variables
+CORES=${CORES:-8}
+SHARED_BUFFERS=${SHARED_BUFFERS:-4GB}
+TESTDIR=${TESTDIR:-./pg_hibernator_latency}
+PGBENCH_SCALE=${PGBENCH_SCALE:-260}		# Big enough to fill up the shared_buffers
+RATE=${RATE:-2000}						# Transactions per second, across all clients
+LATENCY_LIMIT=${LATENCY_LIMIT:-10}		# Milliseconds
+DURATION=${DURATION:-120}				# Seconds of measurement after each restart
+FILL_DURATION=${FILL_DURATION:-300}		# Seconds of workload to fill the buffers
+DROP_CACHES=${DROP_CACHES:-yes}
+RESTORE_SETTINGS=${RESTORE_SETTINGS:-}
+
+PGBENCH_FILL="pgbench --no-vacuum --protocol=prepared --select-only --jobs=$CORES --client=$CORES --time=$FILL_DURATION pgbench"
+PGBENCH_RUN="pgbench --no-vacuum --protocol=prepared --select-only --jobs=$CORES --client=$CORES --time=$DURATION --rate=$RATE --latency-limit=$LATENCY_LIMIT --log"
+
+RESULTS="$TESTDIR/results.txt"
+
+server_start()
+{
+	# $1: extra server settings, as name=value pairs
+	local opts=""
+	local setting
+
+	for setting in $1; do
+		opts="$opts -c $setting"
+	done
+
+	pg_ctl -w -D "$TESTDIR/data" -l "$TESTDIR/server.log" -o "$opts" start > /dev/null
+}
+
+server_stop()
+{
+	pg_ctl -w -D "$TESTDIR/data" -l "$TESTDIR/server.log" stop > /dev/null
+}
+
+drop_caches()
+{
+	if [[ "$DROP_CACHES" == "yes" ]]; then
+		sync
+		echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+	fi
+}
+
+restore_in_progress()
+{
+	[[ $(psql -At -d postgres -c "select count(*) from pg_stat_activity where query in ('restoring buffers', 'restore paused')") != "0" ]]
+}
+
+# The BlockReaders show up some time after the server accepts connections; the
+# ready file is there once they're done, should we have missed them.
+restore_started()
+{
+	[[ -f "$TESTDIR/data/pg_hibernator/ready" ]] || restore_in_progress
+}
+
+# Print p50, p99 and p99.9 of the latencies (in ms) in the given pgbench logs,
+# followed by the counts of skipped and late transactions, all on one line.
+latency_report()
+{
+	local tmp="$TESTDIR/latencies.tmp"
+	local counts
+
+	# Per-transaction log lines look like:
+	#   client_id transaction_no time_us script_no time_epoch time_us_part [schedule_lag]
+	# where time_us is "skipped" for transactions skipped due to --latency-limit.
+	counts=$(cat "$@" | awk -v limit="$LATENCY_LIMIT" -v out="$tmp" '
+		$3 == "skipped" { skipped++; next }
+		{ ms = $3 / 1000.0; print ms > out; if (ms > limit) late++ }
+		END { printf "%d %d", skipped, late }')
+
+	sort -n "$tmp" | awk -v counts="$counts" '
+		function pct(p,    i) { i = int(NR * p + 0.5); return v[i > 0 ? i : 1] }
+		{ v[NR] = $1 }
+		END {
+			if (NR == 0)
+				printf "n/a n/a n/a %s\n", counts
+			else
+				printf "%.2f %.2f %.2f %s\n", pct(0.50), pct(0.99), pct(0.999), counts
+		}'
+
+	rm -f "$tmp"
+}
+
+# Run one scenario, and append a line to the results.
+run_scenario()
+{
+	# $1: scenario name, $2: server settings
+	local name="$1"
+	local settings="$2"
+	local logdir="$TESTDIR/logs/$name"
+	local start restore_secs report pgbench_pid
+
+	echo "Running scenario: $name [$settings]"
+
+	# Fill up the buffers, then restart; the shutdown saves the buffer list,
+	# unless the extension is disabled. Start from a clean slate, so that no
+	# save-files of the previous scenario are restored.
+	rm -f "$TESTDIR"/data/pg_hibernator/*
+	server_start "$settings"
+	$PGBENCH_FILL > /dev/null
+	server_stop
+	drop_caches
+
+	rm -rf "$logdir"
+	mkdir -p "$logdir"
+
+	server_start "$settings"
+	start=$SECONDS
+
+	# pgbench writes its per-transaction logs in the current directory.
+	(cd "$logdir" && $PGBENCH_RUN pgbench > pgbench.out 2>&1) &
+	pgbench_pid=$!
+
+	# Note how long the restore takes, while pgbench runs. With the extension
+	# disabled, there's no restore to wait for.
+	restore_secs=0
+	while ! restore_started && kill -0 $pgbench_pid 2> /dev/null; do
+		sleep 0.1
+	done
+	if restore_started; then
+		while restore_in_progress; do
+			sleep 1
+		done
+		restore_secs=$((SECONDS - start))
+	fi
+
+	wait
+
+	report=$(latency_report "$logdir"/pgbench_log.*)
+
+	printf "%-40s %10s %10s %10s %10s %10s %10s\n" "$name" $report "$restore_secs" >> "$RESULTS"
+
+	server_stop
+}
+
+# Create a new data directory just for these tests
+rm -rf "$TESTDIR"
+mkdir -p "$TESTDIR"
+initdb -D "$TESTDIR/data" > /dev/null
+
+# Apply our configuration
+echo \# Changes for pgbench testing >> "$TESTDIR/data/postgresql.conf"
+echo shared_buffers=$SHARED_BUFFERS >> "$TESTDIR/data/postgresql.conf"
+echo max_connections=$((CORES * 2 + 20)) >> "$TESTDIR/data/postgresql.conf"
+echo "shared_preload_libraries='pg_hibernator'" >> "$TESTDIR/data/postgresql.conf"
+
+# Create and initialize the pgbench database
+server_start ""
+createdb pgbench
+pgbench --initialize --scale=$PGBENCH_SCALE pgbench > /dev/null 2>&1
+server_stop
+
+printf "%-40s %10s %10s %10s %10s %10s %10s\n" scenario "p50_ms" "p99_ms" "p99.9_ms" skipped late "restore_s" > "$RESULTS"
+
+run_scenario cold "pg_hibernator.enabled=off"
+
+IFS=';' read -r -a settings_list <<< "$RESTORE_SETTINGS"
+if [[ ${#settings_list[@]} -eq 0 ]]; then
+	settings_list=("")
+fi
+
+for mode in serial parallel; do
+	if [[ $mode == "parallel" ]]; then
+		parallel=on
+	else
+		parallel=off
+	fi
+
+	for extra in "${settings_list[@]}"; do
+		name="$mode"
+		if [[ -n "$extra" ]]; then
+			name="$mode:$(echo $extra | tr ' ' ',')"
+		fi
+
+		run_scenario "$name" "pg_hibernator.parallel=$parallel $extra"
+	done
+done
+
+cat "$RESULTS"
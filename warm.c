@@ -0,0 +1,484 @@
+/*
+ * pg_hibernator_warm: read the blocks listed in the save-files into the OS
+ * page cache, without a running server.
+ *
+ * The BlockReaders can't start before the server reaches a consistent state;
+ * after a crash, that's only after all of the WAL has been replayed. This
+ * program can run before the server is started, or alongside it, so that by
+ * the time the BlockReaders get going most of their reads are served from
+ * memory.
+ *
+ * Usage: pg_hibernator_warm [-D datadir] [-j jobs] [-g max_gap] [-t seconds] [-v]
+ *
+ * The save-files are decoded in the order the BlockReaders restore them, and
+ * the blocks are coalesced into extents of segment files, which a pool of
+ * threads reads with pread(). A save-file that is partly restored is read from
+ * where its progress file says the restore got to. The save-files, progress
+ * files and container are only ever read, never modified.
+ */
+#include "postgres_fe.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "pg_hibernator.h"
+#include "savefile.h"
+#include "storage/backendid.h"
+
+/* Largest extent a thread reads at once, in blocks; 1 MB with 8 kB blocks */
+#define MAX_EXTENT_BLOCKS	128
+
+/* Extents decoded but not yet read */
+#define QUEUE_SIZE			1024
+
+/* A run of blocks of one segment file, gaps included. */
+typedef struct Extent
+{
+	char		path[MAXPGPATH];
+	off_t		offset;
+	size_t		length;
+} Extent;
+
+static const char *progname = "pg_hibernator_warm";
+static bool	verbose = false;
+static BlockNumber max_gap = 8;
+static double deadline = 0;		/* Give up at this time; 0 for never */
+
+/* The queue of extents, shared by the decoder and the reader threads. */
+static Extent queue[QUEUE_SIZE];
+static uint64 queue_head = 0;	/* Number of extents ever added */
+static uint64 queue_tail = 0;	/* Number of extents ever taken */
+static bool	queue_finished = false;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+
+/* Totals, updated by the reader threads under queue_mutex */
+static uint64 bytes_read = 0;
+static uint64 extents_missing = 0;	/* Not found, or past the end of the file */
+
+/* The extent being built by the decoder */
+static Extent current;
+static BlockNumber current_start = InvalidBlockNumber;
+static BlockNumber current_end = InvalidBlockNumber;
+static BlockNumber current_segno = InvalidBlockNumber;
+
+/* Last block of the current fork queued, or in the extent being built */
+static BlockNumber covered_end = InvalidBlockNumber;
+
+void
+hibernator_error(const char *fmt,...)
+{
+	va_list		ap;
+
+	fprintf(stderr, "%s: ", progname);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+
+	exit(1);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool
+pastDeadline(void)
+{
+	return deadline != 0 && now() >= deadline;
+}
+
+/* Hand the extent to the reader threads, waiting for room in the queue. */
+static void
+enqueueExtent(const Extent *extent)
+{
+	pthread_mutex_lock(&queue_mutex);
+
+	while (queue_head - queue_tail >= QUEUE_SIZE)
+		pthread_cond_wait(&queue_not_full, &queue_mutex);
+
+	queue[queue_head % QUEUE_SIZE] = *extent;
+	++queue_head;
+
+	pthread_cond_signal(&queue_not_empty);
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+/* Queue the extent being built, if any. */
+static void
+flushExtent(void)
+{
+	if (current_start == InvalidBlockNumber)
+		return;
+
+	current.offset = (off_t) (current_start % RELSEG_SIZE) * BLCKSZ;
+	current.length = (size_t) (current_end - current_start + 1) * BLCKSZ;
+
+	enqueueExtent(&current);
+
+	current_start = InvalidBlockNumber;
+}
+
+/*
+ * Add the given blocks of a relation fork to the extent being built, starting
+ * a new extent wherever the blocks leave the segment file, are too far from
+ * the last block, or would make the extent too long.
+ */
+static void
+addBlocks(const SavefileRecord *record, BlockNumber blocknum, BlockNumber count)
+{
+	BlockNumber	block;
+
+	for (block = blocknum; block < blocknum + count && block <= MaxBlockNumber; ++block)
+	{
+		BlockNumber	segno = block / RELSEG_SIZE;
+
+		/*
+		 * The blocks of a fork come in ascending order, but a span covers
+		 * blocks that are then listed on their own.
+		 */
+		if (covered_end != InvalidBlockNumber && block <= covered_end)
+			continue;
+
+		if (current_start != InvalidBlockNumber
+			&& segno == current_segno
+			&& block > current_end
+			&& block - current_end <= max_gap + 1
+			&& block - current_start < MAX_EXTENT_BLOCKS)
+		{
+			current_end = block;
+			covered_end = block;
+			continue;
+		}
+
+		flushExtent();
+
+		/* Look up the path only when we move on to another segment file. */
+		if (segno != current_segno || current.path[0] == '\0')
+		{
+			char	   *relpath;
+
+			relpath = GetRelationPath(record->database, record->tablespace,
+									  record->filenode, InvalidBackendId,
+									  record->forknum);
+			if (segno == 0)
+				snprintf(current.path, sizeof(current.path), "%s", relpath);
+			else
+				snprintf(current.path, sizeof(current.path), "%s.%u", relpath, segno);
+			pfree(relpath);
+		}
+
+		current_segno	= segno;
+		current_start	= block;
+		current_end		= block;
+		covered_end		= block;
+	}
+}
+
+/*
+ * Decode one save-file, or section of the container, and queue its blocks.
+ * Returns the number of blocks listed.
+ */
+static uint64
+warmSavefile(int filenum, bool in_container, const SavefileSection *section)
+{
+	const char *path;
+	FILE	   *file;
+	char	   *dbname;
+	SavefileReader	reader;
+	SavefileRecord	record;
+	SavefileProgress progress;
+	FILE	   *progress_file;
+	uint64		nblocks = 0;
+
+	path = in_container ? CONTAINER_PATH : getSavefileName(filenum);
+	file = fileOpen(path, PG_BINARY_R);
+
+	if (in_container && fseeko(file, section->offset, SEEK_SET) != 0)
+		hibernator_error("could not seek to section %d of \"%s\": %m", filenum, path);
+
+	dbname = readDBName(file, path);
+
+	initSavefileReader(&reader, file, path);
+	if (in_container)
+		limitSavefileReader(&reader, section->offset + section->length);
+
+	/* Skip what the BlockReader has already restored, as it would. */
+	progress_file = fopen(getProgressFileName(filenum), PG_BINARY_R);
+	if (progress_file != NULL)
+	{
+		if (fileRead(&progress, sizeof(progress), progress_file, true, getProgressFileName(filenum))
+			&& resumeSavefileReader(&reader, &progress)
+			&& verbose)
+			fprintf(stderr, "%s: save-file %d: resuming at offset %lu\n",
+					progname, filenum, (unsigned long) progress.position);
+		fclose(progress_file);
+	}
+
+	/* A new relation, fork or save-file always begins a new extent. */
+	current.path[0]	= '\0';
+	current_segno	= InvalidBlockNumber;
+	covered_end		= InvalidBlockNumber;
+
+	while (!pastDeadline() && readSavefileRecord(&reader, &record))
+	{
+		switch (record.type)
+		{
+			case 'd':
+			case 'p':
+			case 't':
+			case 'r':
+			case 'f':
+				flushExtent();
+				current.path[0]	= '\0';
+				current_segno	= InvalidBlockNumber;
+				covered_end		= InvalidBlockNumber;
+				break;
+
+			case 'b':
+			case 'N':
+			case 'S':
+				/*
+				 * Save-files that predate 't' records don't say where the
+				 * relations are.
+				 */
+				if (record.tablespace == InvalidOid)
+					break;
+
+				if (record.type == 'b')
+					record.range = 1;
+
+				addBlocks(&record, record.blocknum, record.range);
+
+				/* A span covers blocks that are listed on their own. */
+				if (record.type != 'S')
+					nblocks += record.range;
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	flushExtent();
+
+	if (verbose)
+		fprintf(stderr, "%s: save-file %d (database \"%s\"): " UINT64_FORMAT " blocks\n",
+				progname, filenum, dbname, nblocks);
+
+	fileClose(file, path);
+
+	return nblocks;
+}
+
+/* Reader thread: read the queued extents until there are no more. */
+static void *
+readerThread(void *arg)
+{
+	char	   *buf;
+	Extent		extent;
+
+	buf = pg_malloc((size_t) MAX_EXTENT_BLOCKS * BLCKSZ);
+
+	for (;;)
+	{
+		ssize_t		nread;
+		int			fd;
+
+		pthread_mutex_lock(&queue_mutex);
+		while (queue_head == queue_tail && !queue_finished)
+			pthread_cond_wait(&queue_not_empty, &queue_mutex);
+
+		if (queue_head == queue_tail)
+		{
+			pthread_mutex_unlock(&queue_mutex);
+			break;
+		}
+
+		extent = queue[queue_tail % QUEUE_SIZE];
+		++queue_tail;
+
+		pthread_cond_signal(&queue_not_full);
+		pthread_mutex_unlock(&queue_mutex);
+
+		if (pastDeadline())
+			continue;
+
+		/*
+		 * The relation may have been dropped or truncated since the save; not
+		 * finding all of it is no reason to complain.
+		 */
+		fd = open(extent.path, O_RDONLY | PG_BINARY, 0);
+		if (fd < 0)
+		{
+			if (errno != ENOENT)
+				fprintf(stderr, "%s: could not open \"%s\": %s\n",
+						progname, extent.path, strerror(errno));
+			nread = -1;
+		}
+		else
+		{
+			nread = pread(fd, buf, extent.length, extent.offset);
+			if (nread < 0)
+				fprintf(stderr, "%s: could not read \"%s\": %s\n",
+						progname, extent.path, strerror(errno));
+			close(fd);
+		}
+
+		pthread_mutex_lock(&queue_mutex);
+		if (nread > 0)
+			bytes_read += nread;
+		else
+			++extents_missing;
+		pthread_mutex_unlock(&queue_mutex);
+	}
+
+	pg_free(buf);
+
+	return NULL;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [-D datadir] [-j jobs] [-g max_gap] [-t seconds] [-v]\n", progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *datadir = getenv("PGDATA");
+	int			njobs = 16;
+	double		timeout = 0;
+	int			c;
+	pthread_t  *threads;
+	int			i;
+	int			filenum;
+	int			nsavefiles = 0;
+	uint64		nblocks = 0;
+	double		start;
+
+	while ((c = getopt(argc, argv, "D:j:g:t:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'D':
+				datadir = optarg;
+				break;
+			case 'j':
+				njobs = atoi(optarg);
+				break;
+			case 'g':
+				max_gap = strtoul(optarg, NULL, 10);
+				break;
+			case 't':
+				timeout = atof(optarg);
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				usage();
+		}
+	}
+
+	if (optind < argc || datadir == NULL || njobs < 1
+		|| max_gap >= MAX_EXTENT_BLOCKS || timeout < 0)
+		usage();
+
+	/* The paths in the save-files, and those of relations, are relative. */
+	if (chdir(datadir) != 0)
+		hibernator_error("could not change directory to \"%s\": %m", datadir);
+
+	start = now();
+	if (timeout > 0)
+		deadline = start + timeout;
+
+	threads = pg_malloc(njobs * sizeof(pthread_t));
+	for (i = 0; i < njobs; ++i)
+	{
+		if (pthread_create(&threads[i], NULL, readerThread, NULL) != 0)
+			hibernator_error("could not create thread: %m");
+	}
+
+	/*
+	 * Decode the save-files in the order the BlockReaders restore them; the
+	 * global objects, then the databases. That's the order of their numbers, in
+	 * a container or not.
+	 */
+	if (access(CONTAINER_PATH, F_OK) == 0)
+	{
+		FILE	   *file;
+		uint32		nsections;
+		uint32		sectionnum;
+		SavefileSection section;
+
+		file = fileOpen(CONTAINER_PATH, PG_BINARY_R);
+		nsections = readContainerHeader(file, CONTAINER_PATH);
+
+		for (sectionnum = 1; sectionnum <= nsections && !pastDeadline(); ++sectionnum)
+		{
+			readContainerSection(file, CONTAINER_PATH, nsections, sectionnum, &section);
+
+			if (section.flags & SECTION_DONE)
+				continue;
+
+			nblocks += warmSavefile(sectionnum, true, &section);
+			++nsavefiles;
+		}
+
+		fileClose(file, CONTAINER_PATH);
+	}
+	else
+	{
+		DIR		   *dir;
+		struct dirent *dent;
+		int			max_filenum = 0;
+
+		dir = opendir(SAVE_LOCATION);
+		if (dir == NULL)
+			hibernator_error("could not open directory \"%s\": %m", SAVE_LOCATION);
+
+		while ((dent = readdir(dir)) != NULL)
+		{
+			if (parseSavefileName(dent->d_name, &filenum) && filenum > max_filenum)
+				max_filenum = filenum;
+		}
+		closedir(dir);
+
+		for (filenum = 1; filenum <= max_filenum && !pastDeadline(); ++filenum)
+		{
+			if (access(getSavefileName(filenum), F_OK) != 0)
+				continue;
+
+			nblocks += warmSavefile(filenum, false, NULL);
+			++nsavefiles;
+		}
+	}
+
+	pthread_mutex_lock(&queue_mutex);
+	queue_finished = true;
+	pthread_cond_broadcast(&queue_not_empty);
+	pthread_mutex_unlock(&queue_mutex);
+
+	for (i = 0; i < njobs; ++i)
+		pthread_join(threads[i], NULL);
+
+	printf("%s: read " UINT64_FORMAT " MB for " UINT64_FORMAT " blocks of %d save-files in %.1f s"
+		   "; %lu extents missing%s\n",
+		   progname, bytes_read / (1024 * 1024), nblocks, nsavefiles, now() - start,
+		   (unsigned long) extents_missing, pastDeadline() ? "; timed out" : "");
+
+	return 0;
+}